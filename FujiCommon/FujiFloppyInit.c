@@ -104,25 +104,96 @@ static OSErr getDriveAndDrvr(short vRefNum, short *drive, short *drvrRefNum) {
 	return err;
 }
 
+/* Sets up a parameter block for I/O to the special sector. The negative
+ * LBA is a byte offset of -512, which the disk driver sends out as block
+ * 0x7FFFFF; since no track holds it, it can never be served from the
+ * Sony track cache.
+ */
+
+static void fujiSetupIO (volatile IOParam *pb, short driveNum, short drvrRefNum, long sectorAddr, Ptr buffer) {
+	pb->ioRefNum     = drvrRefNum;
+	pb->ioCompletion = 0;
+	pb->ioBuffer     = buffer;
+	pb->ioReqCount   = 512;
+	pb->ioPosMode    = fsFromStart;
+	pb->ioPosOffset  = (long) (512UL * sectorAddr);
+	pb->ioVRefNum    = driveNum;
+}
+
+/* Checks whether the FujiNet answers reads from a special block, returning
+ * the session ID from the reply header. A read from the negative LBA returns
+ * pending serial data, so any data that was waiting from before the driver
+ * was opened will be discarded; a read from the status LBA returns only the
+ * header, so it is safe to use while the driver is running.
+ */
+
+static Boolean fujiProbe (short driveNum, short drvrRefNum, long sectorAddr, unsigned short *session) {
+	ParamBlockRec pb;
+	SectorBuffer  sector;
+
+	sector.reply.id = 0;
+	fujiSetupIO (&pb.ioParam, driveNum, drvrRefNum, sectorAddr, sector.bytes);
+	if ((PBReadSync(&pb) == noErr) && (sector.reply.id == MAC_FUJI_REPLY_TAG)) {
+		*session = sector.reply.session;
+		return true;
+	}
+	return false;
+}
+
 OSErr fujiInit (struct FujiConData *fuji) {
 	fuji->fRefNum = 0;
+	fuji->session = 0;
 }
 
 Boolean fujiReady (struct FujiConData *fuji) {
 	return fuji->iopb.ioRefNum != 0;
 }
 
+Boolean fujiOnDrive (struct FujiConData *fuji, short vRefNum) {
+	short driveNum, drvrRefNum;
+	return (getDriveAndDrvr (vRefNum, &driveNum, &drvrRefNum) == noErr) && (fuji->iopb.ioVRefNum == driveNum);
+}
+
 OSErr fujiOpen (struct FujiConData *fuji, short vRefNum) {
 	long          inOutCount;
 	SectorBuffer  sector;
 	ParamBlockRec pb;
 	short         i, drvrRefNum, driveNum;
+	unsigned short session;
 	long          sectorAddr;
 	const char    knockSeq[] = MAC_FUJI_KNOCK_SEQ;
 
 	OSErr err = getDriveAndDrvr (vRefNum, &driveNum, &drvrRefNum); CHECK_ERR;
 
-	// Create and open the special FujiNet file
+	// If we are already connected to this drive and the FujiNet has not
+	// restarted since, as shown by an unchanged session ID, the existing
+	// connection can be kept as-is.
+
+	if (fujiReady (fuji) && (fuji->iopb.ioVRefNum == driveNum) && fuji->session &&
+	    fujiProbe (driveNum, drvrRefNum, MAC_FUJI_STATUS_LBA, &session) &&
+	    (session == fuji->session)) {
+		#if DEBUG
+			printf("Reusing FujiNet connection, session %x\n", session);
+		#endif
+		return noErr;
+	}
+
+	// Newer FujiNet firmware answers on the negative LBA at any time, so
+	// try that first; if it works, a single read is all the handshaking
+	// we need, and nothing is written to the volume.
+
+	DEBUG_STAGE("Probing negative LBA");
+
+	if (fujiProbe (driveNum, drvrRefNum, MAC_FUJI_NEGATIVE_LBA, &fuji->session)) {
+		#if DEBUG
+			printf("FujiNet device present, using negative LBA for I/O\n");
+		#endif
+		fujiSetupIO (&fuji->iopb, driveNum, drvrRefNum, MAC_FUJI_NEGATIVE_LBA, sector.bytes);
+		return noErr;
+	}
+
+	// Otherwise, fall back to knocking and learning the location of a
+	// magic sector through a file. Create and open the special file.
 
 	DEBUG_STAGE("Creating file");
 
@@ -142,9 +213,13 @@ OSErr fujiOpen (struct FujiConData *fuji, short vRefNum) {
 	err = PBOpenSync(&pb); CHECK_ERR;
 	fuji->fRefNum = pb.ioParam.ioRefNum;
 
+	// The knock sequence must reach the FujiNet, so turn off the track
+	// cache while handshaking. It is only disabled, not removed, so it
+	// can be turned back on cheaply once we are done.
+
 	DEBUG_STAGE("Disabling Cache");
 
-	err = sonyTrackCacheControl(driveNum, drvrRefNum, sonyDisableCache | sonyRemoveCache); ON_ERROR();
+	err = sonyTrackCacheControl(driveNum, drvrRefNum, sonyDisableCache); ON_ERROR();
 
 	// Send knocking sequence
 
@@ -159,7 +234,7 @@ OSErr fujiOpen (struct FujiConData *fuji, short vRefNum) {
 		pb.ioParam.ioPosMode    = fsFromStart;
 		pb.ioParam.ioPosOffset  = 512L * (long) knockSeq[i];
 		pb.ioParam.ioVRefNum    = driveNum;
-		err = PBReadSync(&pb); CHECK_ERR;
+		err = PBReadSync(&pb); ON_ERROR(goto cleanup);
 	}
 
 	// Did we get a FujiNet reply?
@@ -182,6 +257,10 @@ OSErr fujiOpen (struct FujiConData *fuji, short vRefNum) {
 		goto cleanup;
 	}
 
+	// The tags hold a reply header, which ends with the session ID
+
+	fuji->session = BufTgDate & 0xFFFF;
+
 	// Fill buffer with special bytes
 
 	DEBUG_STAGE("Clearing buff");
@@ -226,19 +305,18 @@ OSErr fujiOpen (struct FujiConData *fuji, short vRefNum) {
 		goto cleanup;
 	}
 
-	fuji->iopb.ioRefNum     = drvrRefNum;
-	fuji->iopb.ioCompletion = 0;
-	fuji->iopb.ioBuffer     = sector.bytes;
-	fuji->iopb.ioReqCount   = 512;
-	fuji->iopb.ioPosMode    = fsFromStart;
-	fuji->iopb.ioPosOffset  = 512L * (long) sectorAddr;
-	fuji->iopb.ioVRefNum    = driveNum;
+	fujiSetupIO (&fuji->iopb, driveNum, drvrRefNum, sectorAddr, sector.bytes);
+
+	// The magic sector lies on a real track, so reads from it could be
+	// served stale from the track cache; the cache must stay off.
 
-	err = OpenDriver(FUJI_DRVR_NAME, &drvrRefNum);
+	return noErr;
 
 cleanup:
-	//DEBUG_STAGE("Enabling Cache\n");
-	//err = sonyTrackCacheControl(driveNum, drvrRefNum, sonyEnableCache); ON_ERROR();
+	// Give ordinary disk I/O its track cache back
+
+	DEBUG_STAGE("Enabling Cache");
+	sonyTrackCacheControl(driveNum, drvrRefNum, sonyEnableCache);
 
 	return err;
 }
\ No newline at end of file
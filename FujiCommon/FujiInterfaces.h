@@ -19,9 +19,53 @@
 
 #include <stddef.h>
 
-#define USE_WRITE_BUFFER 1
+// Build profiles. Each one leaves out the code and the FujiSerData fields
+// of features it does not use, to save system heap on 128K and 512K Macs.
+// The driver, the DA and FujiTests must all be built with the same profile,
+// which is chosen by defining FUJI_PROFILE (e.g. in the THINK C prefix).
+
+#define FUJI_PROFILE_MODEM     1                 // Modem port only
+#define FUJI_PROFILE_SERIAL    2                 // Modem and printer ports, with indicators
+#define FUJI_PROFILE_FULL      3                 // Both ports, MacTCP and all diagnostics
+
+#ifndef FUJI_PROFILE
+	#define FUJI_PROFILE FUJI_PROFILE_FULL
+#endif
+
+#define USE_WRITE_BUFFER       1
+#define USE_PRINTER            (FUJI_PROFILE >= FUJI_PROFILE_SERIAL)
+#define USE_LED_INDICATORS     (FUJI_PROFILE >= FUJI_PROFILE_SERIAL)
+#define USE_IPP_UDP            (FUJI_PROFILE >= FUJI_PROFILE_FULL)
+#define USE_IPP_TCP            (FUJI_PROFILE >= FUJI_PROFILE_FULL)
+#define USE_IPP                (USE_IPP_UDP || USE_IPP_TCP)
+#define USE_EVENT_LOG          (FUJI_PROFILE >= FUJI_PROFILE_FULL)
+#define USE_HISTOGRAMS         (FUJI_PROFILE >= FUJI_PROFILE_FULL)
+#define USE_PORT_BUFFERS       (FUJI_PROFILE >= FUJI_PROFILE_SERIAL)
+#define SANITY_CHECK           (FUJI_PROFILE >= FUJI_PROFILE_FULL) // Do additional error checking
+
+// Budgets for the size of FujiSerData in each profile, in bytes. Each
+// connection allocates one of these in the system heap, next to a copy of
+// the driver code; FujiTests reports both for the running build.
+
+#if FUJI_PROFILE == FUJI_PROFILE_MODEM
+	#define FUJI_SER_DATA_BUDGET   1200
+#elif FUJI_PROFILE == FUJI_PROFILE_SERIAL
+	#define FUJI_SER_DATA_BUDGET   1232
+#else
+	#define FUJI_SER_DATA_BUDGET   2800
+#endif
+
+// Limits for the serial buffers allocated when a port is redirected. They
+// are sized at 1/128 of the RAM in the machine, but take no more than a
+// quarter of the free system heap; below the minimum, which is above the
+// 1K share of a 128K Mac, the driver works straight out of the 500 byte
+// block payloads.
+
+#define FUJI_PORT_BUF_MIN      2048
+#define FUJI_PORT_BUF_MAX      16384
 
 #define FUJI_DRVR_NAME "\p.Fuji"  // Only installed if STANDALONE_FUJI_DRIVER is 1
+#define FUJI_MAX_CONNS 4          // Connections through separate drives (".Fuji", ".Fuji2", ...)
 #define MODEM_OUT_NAME "\p.AOut"
 #define MODEM_IN__NAME "\p.AIn"
 #define PRNTR_OUT_NAME "\p.BOut"
@@ -37,6 +81,65 @@
 #define MAC_FUJI_REQUEST_TAG   'NDEV'            // OSType, tag marking FujiNet request
 #define MAC_FUJI_REPLY_TAG     'FUJI'            // OSType, tag marking FujiNet reply
 #define MAC_FUJI_POLL_INTERVAL 60
+#define MAC_FUJI_NEGATIVE_LBA  0x007FFFFF        // Block number of special I/O outside the disk
+#define MAC_FUJI_STATUS_LBA    0x007FFFFE        // Block number of header-only status reads
+
+// Each exchange through the magic sector carries data for one channel,
+// identified by the "chan" and "cmd" bytes of the sector header. Channel
+// zero is the serial port; each MacTCP stream is given a channel of its
+// own, with the TCP state machine running on the far side of the link.
+//
+// On UDP channels, the payload of a DATA message is a sequence of
+// datagrams, each preceded by a FujiUDPHeader and padded to an even
+// length, so that several datagrams can share one block.
+
+#define MAC_FUJI_CHAN_SERIAL   0
+#define MAC_FUJI_CHAN_TCP      8                 // First channel used for TCP streams
+#define MAC_FUJI_MAX_TCP       4                 // Maximum number of TCP streams
+#define MAC_FUJI_CHAN_UDP      16                // First channel used for UDP streams
+#define MAC_FUJI_MAX_UDP       4                 // Maximum number of UDP streams
+
+enum {
+	MAC_FUJI_CMD_DATA,                           // Payload is channel data
+	MAC_FUJI_CMD_OPEN,                           // Mac: connect; Fuji: connection established
+	MAC_FUJI_CMD_CLOSE,                          // Mac: done sending; Fuji: remote closed
+	MAC_FUJI_CMD_ABORT,                          // Connection reset or failed
+	MAC_FUJI_CMD_WINDOW                          // Mac: receive buffer space freed
+};
+
+// The async driver keeps a log of its most recent events, for finding out
+// where the time goes between a call and the block I/O that carries it out.
+// The log is read with a status call on any of the FujiNet drivers, with
+// a pointer to room for FUJI_LOG_SIZE events in csParam[0..1]. The events
+// are copied oldest first, the number copied is returned in csParam[2]
+// and the number of events logged since the driver was installed in
+// csParam[3..4].
+
+#define FUJI_LOG_SIZE          128               // Events kept, must be a power of two
+#define FUJI_CS_EVENT_LOG      100               // Status code for copying out the log
+
+enum {
+	FUJI_EV_VBL = 1,                             // VBL task fired
+	FUJI_EV_CONTENDED,                           // Mutex was busy; arg: 0 in VBL task, 1 in Read/Write
+	FUJI_EV_READ_START,                          // Async block read issued
+	FUJI_EV_READ_DONE,                           // Block read finished; arg: payload length or error
+	FUJI_EV_WRITE_START,                         // Async block write issued; arg: payload length
+	FUJI_EV_WRITE_DONE,                          // Block write finished; arg: result code
+	FUJI_EV_SUSPEND,                             // Read/Write call suspended; arg: bytes to go
+	FUJI_EV_WAKEUP,                              // Suspended call retried; arg: result code
+	FUJI_EV_COPY_IN,                             // Bytes taken from a Write call; arg: count
+	FUJI_EV_COPY_OUT                             // Bytes given to a Read call; arg: count
+};
+
+// The async driver also keeps histograms of how long block I/O takes, how
+// much payload each block carries and how long Read/Write calls are kept
+// waiting. Bucket zero counts values of zero; bucket n counts values from
+// 2^(n-1) up to 2^n - 1, with the last bucket also taking anything larger.
+// These are read with a status call, with a pointer to a FujiStats in
+// csParam[0..1], or with fujiSerialGetStats.
+
+#define FUJI_HIST_BUCKETS      12                // Up to 2048 ticks or bytes and over
+#define FUJI_CS_STATS          101               // Status code for copying out a FujiStats
 
 #define MIN(a,b) ((a < b) ? a : b)
 #define MAX(a,b) ((a > b) ? a : b)
@@ -49,11 +152,13 @@ struct DriverInfo {
 	short              refNum;
 	IOParam           *pendingPb;
 	DCtlEntry         *pendingDce;
+	unsigned long      pendingSince;             // Ticks when pendingPb was first suspended
 };
 
 struct FujiConData {
 	volatile IOParam   iopb;
 	short              fRefNum;
+	unsigned short     session;                  // Session ID given by the FujiNet at handshake
 } ;
 
 struct StorageSpec {
@@ -65,23 +170,61 @@ struct StorageSpec {
 	volatile long ioActCount;
 };
 
+struct FujiTCPStream;
+struct FujiUDPStream;
+
+struct FujiUDPHeader {
+	unsigned long      remoteHost;
+	unsigned short     remotePort;
+	unsigned short     length;                   // Length of the datagram that follows
+};
+
+struct FujiHistograms {
+	unsigned long      readRate;                 // Bytes per second read over the last second
+	unsigned long      writeRate;                // Bytes per second written over the last second
+	unsigned long      ioErrors;                 // Block I/O that failed or had the wrong tag
+	unsigned long      badTags;                  // Block reads not answered by the FujiNet
+	unsigned long      ioTicks[FUJI_HIST_BUCKETS];   // Block I/O time, from issue to completion
+	unsigned long      ioBytes[FUJI_HIST_BUCKETS];   // Payload bytes carried by each block
+	unsigned long      waitTicks[FUJI_HIST_BUCKETS]; // Time Read/Write calls spent suspended
+};
+
+struct FujiStats {
+	unsigned long      bytesRead;
+	unsigned long      bytesWritten;
+	short              pollTicks;                // Interval of the VBL task
+	struct FujiHistograms hist;
+};
+
+struct FujiLogEvent {
+	unsigned long      ticks;                    // Ticks when the event was logged
+	short              arg;                      // Depends on the event
+	unsigned char      event;                    // One of FUJI_EV_*
+	unsigned char      chan;                     // Channel, or driver unit number for Read/Write calls
+	unsigned char      timer;                    // High byte of VIA timer 2, counts down every 0.33 ms
+	unsigned char      unused;
+};
+
 struct FujiSerData {
 	struct FujiConData conn;
 	OSType             id;
 
 	/* Length of driver info table is one more than the
-	 * number of drivers we may override:
+	 * number of drivers whose Read/Write calls we handle:
+	 *
+	 * (.Fuji, .AOut, .AIn, .BOut., .Bin) + 1 = 6
 	 *
-	 * (.Fuji, .AOut, .AIn, .BOut., .Bin, .IPP) + 1 = 7
+	 * MacTCP calls are queued separately, in ippQueue.
 	 */
-	struct DriverInfo  drvrInfo[7];
+	struct DriverInfo  drvrInfo[USE_PRINTER ? 6 : 4];
 
 	struct {
 		OSType         id;
-		char           src;
-		char           dst;
+		unsigned char  chan;
+		unsigned char  cmd;
 		short          avail;
-		long           reserved;
+		short          length;
+		unsigned short session;
 		char           payload[500];
 	} readData;
 
@@ -95,11 +238,16 @@ struct FujiSerData {
 
 	unsigned char vblCount;
 
+	#if USE_LED_INDICATORS
+		unsigned char  ledRead, ledWrit;         // Menubar indicators, as last set
+		unsigned char  ledReadShown, ledWritShown; // Menubar indicators, as last drawn
+	#endif
+
 	#if USE_WRITE_BUFFER
 		struct {
 			OSType     id;
-			char       src;
-			char       dst;
+			unsigned char chan;
+			unsigned char cmd;
 			short      length;
 			long       reserved;
 			char       payload[500];
@@ -107,6 +255,35 @@ struct FujiSerData {
 
 		struct StorageSpec writeStorage;
 	#endif
+
+	#if USE_PORT_BUFFERS
+		Ptr                rxBuf, txBuf;         // Serial buffers, if allocated at redirection
+		long               rxSize, txSize;
+	#endif
+
+	#if USE_IPP
+		// MacTCP emulation
+
+		QHdr                   ippQueue;         // Calls waiting for the VBL task
+		struct FujiTCPStream  *tcpStreams[MAC_FUJI_MAX_TCP];
+		unsigned char          tcpAborts;        // Released streams that still need an ABORT
+		struct FujiUDPStream  *udpStreams[MAC_FUJI_MAX_UDP];
+		unsigned char          udpCloses;        // Released streams that still need a CLOSE
+		unsigned long          ippLocalHost;
+	#endif
+
+	#if USE_HISTOGRAMS
+		struct FujiHistograms hist;
+		unsigned long       ioStarted;           // Ticks when the block I/O in progress was issued
+		unsigned long       rateTicks;           // Ticks, bytes read and bytes written when the
+		unsigned long       rateRead;            //   rates in "hist" were last worked out
+		unsigned long       rateWritten;
+	#endif
+
+	#if USE_EVENT_LOG
+		unsigned long       logCount;            // Events logged since the driver was installed
+		struct FujiLogEvent log[FUJI_LOG_SIZE];
+	#endif
 } ;
 
 typedef struct FujiSerData **FujiSerDataHndl;
@@ -114,6 +291,15 @@ typedef struct FujiSerData **FujiSerDataHndl;
 typedef union {
 	char    bytes[512 ];
 	OSType values[512 / sizeof(OSType)];
+	struct {
+		// Header of a block read from the FujiNet
+		OSType         id;
+		unsigned char  chan;
+		unsigned char  cmd;
+		short          avail;
+		short          length;
+		unsigned short session;
+	} reply;
 } SectorBuffer;
 
 typedef union {
@@ -146,6 +332,7 @@ FujiSerDataHndl getFujiSerialDataHndl (void);
 #endif
 
 Declare_LoMem(volatile unsigned long,  Ticks,       0x16A);
+Declare_LoMem(volatile unsigned long,  MemTop,      0x108);
 Declare_LoMem(volatile unsigned long,  UTableBase,  0x11C);
 Declare_LoMem(volatile unsigned short, UnitNtryCnt, 0x1D2);
 Declare_LoMem(volatile unsigned long,  ScrnBase,    0x824);
@@ -153,6 +340,7 @@ Declare_LoMem(volatile unsigned long,  BufTgFNum,   0x2FC);
 Declare_LoMem(volatile unsigned short, BufTgFFlag,  0x300);
 Declare_LoMem(volatile unsigned short, BufTgFBkNum, 0x302);
 Declare_LoMem(volatile unsigned long,  BufTgDate,   0x304);
+Declare_LoMem(volatile unsigned char*, VIABase,     0x1D4);
 
 #define FUJI_TAG_ID   BufTgFNum
 #define FUJI_TAG_SRC  BufTgFFlag
@@ -160,6 +348,7 @@ Declare_LoMem(volatile unsigned long,  BufTgDate,   0x304);
 
 STATIC_ASSERT( MEMBER_SIZE(struct FujiSerData, readData)  == 512 , fuji_ser_data_r_size);
 STATIC_ASSERT( MEMBER_SIZE(struct FujiSerData, writeData) == 512 ,fuji_ser_data_w_size);
+STATIC_ASSERT( sizeof(struct FujiSerData) <= FUJI_SER_DATA_BUDGET, fuji_ser_data_budget);
 STATIC_ASSERT( offsetof(struct StorageSpec,ioBuffer)   == 0, ss_test_1);
 STATIC_ASSERT( offsetof(struct StorageSpec,ioReqCount) == (offsetof(IOParam,ioReqCount) - offsetof(IOParam,ioBuffer)), ss_test_2);
 STATIC_ASSERT( offsetof(struct StorageSpec,ioActCount) == (offsetof(IOParam,ioActCount) - offsetof(IOParam,ioBuffer)), ss_test_3);
@@ -17,6 +17,9 @@
 
 #pragma once
 
+struct FujiConData;
+struct FujiStats;
+
 // Higher-level access via the serial drivers
 
 OSErr   fujiSerialInstall (void);
@@ -25,6 +28,8 @@ OSErr   fujiSerialRedirectPrinter (void);
 OSErr   fujiSerialRedirectMacTCP (void);
 OSErr   fujiSerialOpen (short vRefNum);
 Boolean fujiSerialStats (unsigned long *bytesRead, unsigned long *bytesWritten);
+Boolean fujiSerialGetStats (struct FujiStats *);
+void    fujiSerialHeapUsage (long *codeBytes, long *dataBytes);
 
 Boolean isFujiConnected(void);
 Boolean isFujiSerialInstalled(void);
@@ -35,5 +40,6 @@ Boolean isFujiMacTCPRedirected(void);
 // Low-level access via the floppy port
 
 Boolean fujiReady (struct FujiConData *);
+Boolean fujiOnDrive (struct FujiConData *, short vRefNum);
 OSErr   fujiInit  (struct FujiConData *);
 OSErr   fujiOpen  (struct FujiConData *, short vRefNum);
\ No newline at end of file
@@ -119,14 +119,33 @@ static FujiSerDataHndl getSerialDataHndl (ConstStr255Param drvrName) {
 	   ) ? (FujiSerDataHndl)dce->dCtlStorage : NULL;
 }
 
-FujiSerDataHndl getFujiSerialDataHndl () {
+/**
+ * Each connection to the FujiNet goes through its own drive, and is served
+ * by its own instance of the driver, with its own storage. The first one
+ * is named ".Fuji", the others ".Fuji2", ".Fuji3" and so on. The longer
+ * names fit in the driver header, which is padded for them.
+ */
+static void getFujiDrvrName (short conn, Str255 name) {
+	BlockMove (FUJI_DRVR_NAME, name, FUJI_DRVR_NAME[0] + 1);
+	if (conn > 0) {
+		name[++name[0]] = '1' + conn;
+	}
+}
+
+static FujiSerDataHndl getFujiConnDataHndl (short conn) {
 	#if STANDALONE_FUJI_DRIVER
-		return getSerialDataHndl (FUJI_DRVR_NAME);
+		Str255 name;
+		getFujiDrvrName (conn, name);
+		return getSerialDataHndl (name);
 	#else
-		return getSerialDataHndl (MODEM_OUT_NAME);
+		return (conn == 0) ? getSerialDataHndl (MODEM_OUT_NAME) : NULL;
 	#endif
 }
 
+FujiSerDataHndl getFujiSerialDataHndl () {
+	return getFujiConnDataHndl (0);
+}
+
 /**
  * Allocate a new storage block for the FujiNet driver. The storage
  * will be shared by the input and output drivers.
@@ -208,18 +227,20 @@ static OSErr installDCE (short unitNum, Handle drvrHdl, Handle drvrStorage) {
 /* Replaces an existing or new driver with a stub driver that
  * forwards requests to the main FujiNet driver.
  */
-static OSErr installStubDriver (ConstStr255Param stubName) {
+static OSErr installStubDriver (ConstStr255Param stubName, short conn) {
 	OSErr          err = noErr;
 	DCtlEntry      *fujiDCE;
 	DRVRHeader     *fujiHdr;
 	unsigned long *stubHndlStorage;
 	Handle         stubHndl;
-	short          stubNum;
+	short          stubNum, fujiNum;
 
 	#if STANDALONE_FUJI_DRIVER
-		const short fujiNum = findUnitNumberByName(FUJI_DRVR_NAME);
+		Str255 fujiName;
+		getFujiDrvrName (conn, fujiName);
+		fujiNum = findUnitNumberByName(fujiName);
 	#else
-		const short fujiNum = findUnitNumberByName(MODEM_OUT_NAME);
+		fujiNum = findUnitNumberByName(MODEM_OUT_NAME);
 	#endif
 
 	if (fujiNum != -1) {
@@ -280,23 +301,87 @@ error:
 	return err;
 }
 
+#if USE_PORT_BUFFERS
+	/**
+	 * Picks the size of the serial buffers from the memory in the machine,
+	 * giving a 4 MB Mac Plus deep buffers, while a 128K Mac gets none and
+	 * works straight out of the block payloads in FujiSerData.
+	 */
+	static long choosePortBufferSize () {
+		long size = MemTop / 128;
+		if (size > FreeMemSys() / 4) {
+			size = FreeMemSys() / 4;
+		}
+		if (size > FUJI_PORT_BUF_MAX) {
+			size = FUJI_PORT_BUF_MAX;
+		}
+		return (size < FUJI_PORT_BUF_MIN) ? 0 : size;
+	}
+
+	/**
+	 * Allocates the serial buffers for a connection, if it does not have
+	 * them already. The modem and printer ports share the serial channel,
+	 * so the buffers are shared too. The driver starts using them the next
+	 * time it is opened. Running without them is not an error.
+	 */
+	static void allocPortBuffers (short conn) {
+		FujiSerDataHndl data = getFujiConnDataHndl (conn);
+		const long size = choosePortBufferSize ();
+		Ptr rxBuf, txBuf;
+
+		if ((data == NULL) || (size == 0) || (*data)->rxBuf) {
+			return;
+		}
+		rxBuf = NewPtrSys (size);
+		txBuf = NewPtrSys (size);
+		if (rxBuf && txBuf) {
+			(*data)->rxBuf  = rxBuf;
+			(*data)->rxSize = size;
+			(*data)->txBuf  = txBuf;
+			(*data)->txSize = size;
+			#if DEBUG
+				printf("Allocated %ld byte serial buffers\n", size);
+			#endif
+		} else {
+			if (rxBuf) {
+				DisposPtr (rxBuf);
+			}
+			if (txBuf) {
+				DisposPtr (txBuf);
+			}
+		}
+	}
+#endif
+
 static OSErr installStubDrivers (ConstStr255Param outDrvrName, ConstStr255Param inDrvrName) {
 	// Initialize in and out drivers
 
-	OSErr err = installStubDriver (outDrvrName);
+	OSErr err;
+
+	#if USE_PORT_BUFFERS
+		allocPortBuffers (0);
+	#endif
+
+	err = installStubDriver (outDrvrName, 0);
 	if (err != noErr) {
 		return err;
 	}
-	return installStubDriver (inDrvrName);
+	return installStubDriver (inDrvrName, 0);
 }
 
-OSErr fujiSerialInstall () {
+static OSErr fujiInstallConn (short conn) {
 	OSErr           err = noErr;
 	Handle          fujiHndl = 0;
 	FujiSerDataHndl fujiData = 0;
 	short           fujiNum  = 0;
 
-	if (!isFujiSerialInstalled()) {
+	#if !STANDALONE_FUJI_DRIVER
+		if (conn > 0) {
+			return openErr;
+		}
+	#endif
+
+	if (getFujiConnDataHndl (conn) == NULL) {
 
 		// Load the driver and allocate driver data
 
@@ -334,6 +419,8 @@ OSErr fujiSerialInstall () {
 				printf("Installing Fuji driver in unit number %d\n", fujiNum);
 			#endif
 
+			getFujiDrvrName (conn, ((DRVRHeader*)*fujiHndl)->drvrName);
+
 			err = installDCE (fujiNum, fujiHndl, (Handle)fujiData);
 			if (err) {
 				goto error;
@@ -359,7 +446,7 @@ OSErr fujiSerialInstall () {
 
 			// Install a stub driver as the serial in driver
 
-			err = installStubDriver (MODEM_IN__NAME);
+			err = installStubDriver (MODEM_IN__NAME, 0);
 		#endif
 	}
 	return err;
@@ -374,6 +461,10 @@ error:
 	return err;
 }
 
+OSErr fujiSerialInstall () {
+	return fujiInstallConn (0);
+}
+
 Boolean isFujiSerialInstalled() {
 	return getFujiSerialDataHndl () != NULL;
 }
@@ -400,11 +491,32 @@ OSErr fujiSerialRedirectModem () {
 }
 
 OSErr fujiSerialRedirectPrinter () {
-	return installStubDrivers (PRNTR_OUT_NAME, PRNTR_IN__NAME);
+	#if USE_PRINTER
+		return installStubDrivers (PRNTR_OUT_NAME, PRNTR_IN__NAME);
+	#else
+		return unimpErr;
+	#endif
 }
 
+/* When the FujiNet is connected through more than one drive, MacTCP is
+ * given the most recent connection, so that its traffic does not have to
+ * share a drive with the serial ports.
+ */
 OSErr fujiSerialRedirectMacTCP () {
-	return installStubDriver (MACTCP_IP_NAME);
+	#if USE_IPP
+		FujiSerDataHndl data;
+		short conn = FUJI_MAX_CONNS - 1;
+		while (conn > 0) {
+			data = getFujiConnDataHndl (conn);
+			if (data && fujiReady (&(*data)->conn)) {
+				break;
+			}
+			conn--;
+		}
+		return installStubDriver (MACTCP_IP_NAME, conn);
+	#else
+		return unimpErr;
+	#endif
 }
 
 Boolean fujiSerialStats (unsigned long *bytesRead, unsigned long *bytesWritten) {
@@ -420,24 +532,99 @@ Boolean fujiSerialStats (unsigned long *bytesRead, unsigned long *bytesWritten)
 	}
 }
 
+/* Like fujiSerialStats, but also returns the rates and histograms kept by
+ * the driver. Returns false, leaving "stats" alone, if there is no driver
+ * or it was built without USE_HISTOGRAMS.
+ */
+Boolean fujiSerialGetStats (struct FujiStats *stats) {
+	#if USE_HISTOGRAMS
+		FujiSerDataHndl data = getFujiSerialDataHndl ();
+		if (data) {
+			stats->bytesRead    = (*data)->bytesRead;
+			stats->bytesWritten = (*data)->bytesWritten;
+			stats->pollTicks    = (*data)->vblCount;
+			stats->hist         = (*data)->hist;
+			return true;
+		}
+	#endif
+	return false;
+}
+
+/* Adds up the system heap taken by the FujiNet drivers: the code of the
+ * main and stub drivers, and the storage and serial buffers of each
+ * connection.
+ */
+void fujiSerialHeapUsage (long *codeBytes, long *dataBytes) {
+	DCtlEntry  *dce;
+	DRVRHeader *header;
+	short unitNum, conn;
+
+	*codeBytes = 0;
+	*dataBytes = 0;
+	for (unitNum = 0; unitNum < UnitNtryCnt; unitNum++) {
+		if (getDCE(unitNum, &dce, &header) &&
+			(dce->dCtlFlags & dRAMBasedMask) &&
+			(dce->dCtlStorage != NULL) &&
+			((*(FujiSerDataHndl)dce->dCtlStorage)->id == 'FUJI')) {
+			*codeBytes += GetHandleSize ((Handle)dce->dCtlDriver);
+		}
+	}
+	for (conn = 0; conn < FUJI_MAX_CONNS; conn++) {
+		FujiSerDataHndl data = getFujiConnDataHndl (conn);
+		if (data) {
+			*dataBytes += GetHandleSize ((Handle)data);
+			#if USE_PORT_BUFFERS
+				*dataBytes += (*data)->rxSize + (*data)->txSize;
+			#endif
+		}
+	}
+}
+
+/* Connects to the FujiNet through the drive holding "vRefNum". This reuses
+ * the connection already made through that drive, if there is one, or else
+ * sets up the first unused connection, installing a driver for it.
+ */
 OSErr fujiSerialOpen (short vRefNum) {
 	OSErr err;
 	FujiSerDataHndl data;
-	if (!isFujiSerialInstalled()) {
-		err = fujiSerialInstall ();
+	Str255 name;
+	short conn, refNum;
+
+	for (conn = 0; conn < FUJI_MAX_CONNS; conn++) {
+		data = getFujiConnDataHndl (conn);
+		if ((data == NULL) || !fujiReady (&(*data)->conn) || fujiOnDrive (&(*data)->conn, vRefNum)) {
+			break;
+		}
+	}
+	if (conn == FUJI_MAX_CONNS) {
+		#if DEBUG
+			printf("No more connections available\n");
+		#endif
+		return openErr;
+	}
+	if (data == NULL) {
+		err = fujiInstallConn (conn);
 		if (err != noErr) {
 			return err;
 		}
+		data = getFujiConnDataHndl (conn);
 	} else {
 		#if DEBUG
 			printf("Fuji driver already installed\n");
 		#endif
 	}
-	data = getFujiSerialDataHndl ();
 	if (data) {
 		HLock((Handle)data);
 		err = fujiOpen (&(*data)->conn, vRefNum);
 		HUnlock((Handle)data);
+		if (err == noErr) {
+			#if STANDALONE_FUJI_DRIVER
+				getFujiDrvrName (conn, name);
+				err = OpenDriver (name, &refNum);
+			#else
+				err = OpenDriver (MODEM_OUT_NAME, &refNum);
+			#endif
+		}
 		return err;
 	} else {
 		#if DEBUG
@@ -19,6 +19,7 @@
 #include <Devices.h>
 
 #include "FujiNet.h"
+#include "FujiInterfaces.h"
 
 // Control manager
 enum {
@@ -39,8 +40,29 @@ enum {
 	iBytesWritten = 6
 };
 
+// Link panel, drawn below the dialog items. The graph shows one sample
+// per second, with bytes/sec read as solid bars and written as a line.
+
+#define PANEL_HEIGHT  70                  // Added to the height of the dialog
+#define GRAPH_WIDTH   224                 // Samples shown, inside the frame
+#define GRAPH_HEIGHT  40
+#define GRAPH_SCALE   256                 // Smallest full scale, in bytes/sec
+
+static Rect           graphRect;          // Inside of the frame
+static RgnHandle      scrollRgn;
+static unsigned short readRates[GRAPH_WIDTH], writeRates[GRAPH_WIDTH];
+static short          newest;             // Index of the newest sample
+static unsigned long  graphScale;
+static struct FujiStats shownStats;       // As last drawn in the text lines
+static unsigned long  shownScale;
+static Boolean        shownConnected;
+static Boolean        shownHaveStats;
+
 // Function Prototypes
 
+static void drawPanel (DialogPtr dlg);
+static void setStatusText (Boolean connected, Boolean haveStats);
+
 static short getOwnedResId (DCtlPtr devCtlEnt, short subId) {
 	const short unitNumber = -(devCtlEnt->dCtlRefNum + 1);
 	return 0xC000 | (unitNumber << 5) | subId;
@@ -65,7 +87,22 @@ static void updateButtonState (DCtlPtr devCtlEnt) {
 static void doEvent (EventRecord *event, DCtlPtr devCtlEnt) {
 	DialogPtr dlgHit;   /* dialog for which event was generated */
 	short     itemHit;  /* item selected from dialog */
-	Boolean   isOurs = DialogSelect(event, &dlgHit, &itemHit);
+	Boolean   isOurs;
+
+	if (event->what == updateEvt) {
+		setStatusText (shownConnected, shownHaveStats);
+	}
+
+	isOurs = DialogSelect(event, &dlgHit, &itemHit);
+
+	if ((event->what == updateEvt) && ((WindowPtr) event->message == devCtlEnt->dCtlWindow)) {
+		// The panel is not a dialog item, so draw it after the items
+		GrafPtr SavedPort;
+		GetPort(&SavedPort);
+		SetPort(devCtlEnt->dCtlWindow);
+		drawPanel (devCtlEnt->dCtlWindow);
+		SetPort(SavedPort);
+	}
 
 	if (isOurs && (dlgHit == devCtlEnt->dCtlWindow)) {
 		short         type;
@@ -99,26 +136,187 @@ static void doEvent (EventRecord *event, DCtlPtr devCtlEnt) {
 	}
 }
 
-static void doRun (DialogPtr dlg, DCtlPtr devCtlEnt) {
-	unsigned long bytesRead, bytesWritten;
+/* Maps a rate to a row of the graph */
+
+static short rateToY (unsigned long rate) {
+	if (rate > graphScale) {
+		rate = graphScale;
+	}
+	return graphRect.bottom - 1 - (short) (rate * (GRAPH_HEIGHT - 1) / graphScale);
+}
+
+/* Draws the column for one sample. The write line is drawn in XOR mode so
+ * that it shows up over the read bars; each column joins the previous
+ * sample to this one with a vertical run, so no pixel is drawn twice.
+ */
+
+static void drawColumn (short x, short i) {
+	const short prev = (i + GRAPH_WIDTH - 1) % GRAPH_WIDTH;
+
+	if (readRates[i]) {
+		MoveTo (x, graphRect.bottom - 1);
+		LineTo (x, rateToY (readRates[i]));
+	}
+	PenMode (patXor);
+	MoveTo (x, rateToY (writeRates[prev]));
+	LineTo (x, rateToY (writeRates[i]));
+	PenNormal ();
+}
+
+static void drawGraph (void) {
+	Rect  frame = graphRect;
+	short x, i;
+
+	InsetRect (&frame, -1, -1);
+	FrameRect (&frame);
+	EraseRect (&graphRect);
+	for (x = graphRect.right - 1, i = newest; x >= graphRect.left; x--) {
+		drawColumn (x, i);
+		i = (i + GRAPH_WIDTH - 1) % GRAPH_WIDTH;
+	}
+}
+
+static void drawNumber (unsigned long n, ConstStr255Param suffix) {
+	Str32 str;
+	NumToString (n, str);
+	DrawString (str);
+	DrawString (suffix);
+}
+
+/* Draws the lines of text below the graph */
+
+static void drawPanelText (DialogPtr dlg) {
+	const short savedFont = dlg->txFont, savedSize = dlg->txSize;
+	Rect r;
+
+	SetRect (&r, graphRect.left - 1, graphRect.bottom + 2, graphRect.right + 1, graphRect.bottom + 28);
+	EraseRect (&r);
+	TextFont (applFont);
+	TextSize (9);
+
+	MoveTo (r.left, r.top + 10);
+	DrawString ("\pBytes/sec read (bars) and written, top: ");
+	drawNumber (graphScale, "\p");
+
+	MoveTo (r.left, r.top + 22);
+	DrawString ("\pPolled every ");
+	drawNumber (shownStats.pollTicks, "\p ticks, ");
+	drawNumber (shownStats.hist.ioErrors, "\p errors, ");
+	drawNumber (shownStats.hist.badTags, "\p bad tags");
+
+	TextFont (savedFont);
+	TextSize (savedSize);
+	shownScale = graphScale;
+}
+
+/* Adds a sample to the graph. Normally, the graph is scrolled left by one
+ * pixel and only the new column is drawn. Should the peak no longer fit,
+ * or only use a small part of the height, the scale is changed and the
+ * whole graph is drawn again. Any part of the graph scrolled out from
+ * under another window is left to the update event.
+ */
+
+static void addSample (struct FujiStats *stats) {
+	unsigned long peak = 0, scale = GRAPH_SCALE;
+	Rect  column;
+	short i;
+
+	newest = (newest + 1) % GRAPH_WIDTH;
+	readRates[newest]  = MIN (stats->hist.readRate,  0xFFFF);
+	writeRates[newest] = MIN (stats->hist.writeRate, 0xFFFF);
+
+	for (i = 0; i < GRAPH_WIDTH; i++) {
+		peak = MAX (peak, readRates[i]);
+		peak = MAX (peak, writeRates[i]);
+	}
+	while (scale < peak) {
+		scale *= 2;
+	}
+
+	if (scale != graphScale) {
+		graphScale = scale;
+		drawGraph ();
+	} else {
+		ScrollRect (&graphRect, -1, 0, scrollRgn);
+		drawColumn (graphRect.right - 1, newest);
+		SetRect (&column, graphRect.right - 1, graphRect.top, graphRect.right, graphRect.bottom);
+		InvalRgn (scrollRgn);
+		ValidRect (&column);
+	}
+}
+
+static void drawPanel (DialogPtr dlg) {
+	drawGraph ();
+	drawPanelText (dlg);
+}
+
+/* Sets the text of the status and byte count items. The text is set
+ * on every call, as applications share the ParamText strings with us.
+ */
+
+static void setStatusText (Boolean connected, Boolean haveStats) {
 	Str63 pStr1, pStr2, pStr3;
 
-	GrafPtr SavedPort;
-	GetPort(&SavedPort);
-	SetPort(dlg);
-	if (isFujiConnected()) {
+	if (connected) {
 		BlockMove("\pConnected", pStr1, 10);
 	} else {
 		BlockMove("\pNot found", pStr1, 10);
 	}
-	if (fujiSerialStats (&bytesRead, &bytesWritten)) {
-		NumToString (bytesRead,    pStr2);
-		NumToString (bytesWritten, pStr3);
+	if (haveStats) {
+		NumToString (shownStats.bytesRead,    pStr2);
+		NumToString (shownStats.bytesWritten, pStr3);
 		ParamText(pStr1, pStr2, pStr3, "\p");
 	} else {
 		ParamText(pStr1, "\p-", "\p-", "\p");
 	}
-	DrawDialog(devCtlEnt->dCtlWindow);
+}
+
+/* Updates the status and byte counts, invalidating the items only when they
+ * change, so the dialog is not redrawn as a whole every second, then adds
+ * a sample to the graph.
+ */
+
+static void doRun (DialogPtr dlg, DCtlPtr devCtlEnt) {
+	struct FujiStats stats;
+	const Boolean connected = isFujiConnected();
+	const Boolean haveStats = fujiSerialGetStats (&stats);
+
+	GrafPtr SavedPort;
+	GetPort(&SavedPort);
+	SetPort(dlg);
+
+	if (!haveStats) {
+		stats = shownStats;
+		stats.hist.readRate = stats.hist.writeRate = 0;
+	}
+
+	if ((connected != shownConnected) || (haveStats != shownHaveStats) ||
+		(stats.bytesRead != shownStats.bytesRead) ||
+		(stats.bytesWritten != shownStats.bytesWritten)) {
+		short itemType, item;
+		Handle itemHndl;
+		Rect itemRect;
+
+		for (item = iStatus; item <= iBytesWritten; item++) {
+			GetDItem (dlg, item, &itemType, &itemHndl, &itemRect);
+			InvalRect (&itemRect);
+		}
+		shownConnected          = connected;
+		shownHaveStats          = haveStats;
+		shownStats.bytesRead    = stats.bytesRead;
+		shownStats.bytesWritten = stats.bytesWritten;
+	}
+	setStatusText (connected, haveStats);
+
+	addSample (&stats);
+
+	if ((graphScale != shownScale) ||
+		(stats.pollTicks != shownStats.pollTicks) ||
+		(stats.hist.ioErrors != shownStats.hist.ioErrors) ||
+		(stats.hist.badTags != shownStats.hist.badTags)) {
+		shownStats = stats;
+		drawPanelText (dlg);
+	}
 	SetPort(SavedPort);
 }
 
@@ -145,6 +343,16 @@ static OSErr doOpen (IOParam *pb, DCtlPtr devCtlEnt ) {
 			goto error;
 		}
 		((WindowPeek)devCtlEnt->dCtlWindow)->windowKind = devCtlEnt->dCtlRefNum;
+
+		// Make room for the link panel below the dialog items
+
+		{
+			const Rect port = devCtlEnt->dCtlWindow->portRect;
+			SizeWindow (devCtlEnt->dCtlWindow, port.right, port.bottom + PANEL_HEIGHT, false);
+			SetRect (&graphRect, 11, port.bottom - 5, 11 + GRAPH_WIDTH, port.bottom - 5 + GRAPH_HEIGHT);
+			graphScale = GRAPH_SCALE;
+			scrollRgn  = NewRgn ();
+		}
 	}
 
 	fujiSerialOpen (BootDrive);
@@ -180,6 +388,7 @@ static OSErr doClose (IOParam *pb, DCtlPtr devCtlEnt) {
 	if (devCtlEnt->dCtlWindow) {
 		DisposeDialog (devCtlEnt->dCtlWindow);
 		devCtlEnt->dCtlWindow = 0;
+		DisposeRgn (scrollRgn);
 	}
 
 	return noErr;
@@ -0,0 +1,648 @@
+/****************************************************************************
+ *   mac68k-fuji-drivers (c) 2024 Marcio Teixeira                           *
+ *                                                                          *
+ *   This program is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU General Public License as published by   *
+ *   the Free Software Foundation, either version 3 of the License, or      *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   This program is distributed in the hope that it will be useful,        *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU General Public License for more details.                           *
+ *                                                                          *
+ *   To view a copy of the GNU General Public License, go to the following  *
+ *   location: <http://www.gnu.org/licenses/>.                              *
+ ****************************************************************************/
+
+/**
+ * MacTCP emulation for the ".IPP" driver.
+ *
+ * The TCP state machine does not run on the Mac. Each stream is bound
+ * to a channel on the FujiNet link and the MacTCP calls are translated
+ * into OPEN, DATA, CLOSE, ABORT and WINDOW messages on that channel;
+ * the far side (the Pico, the ESP32, or a stand-in host on Linux) does
+ * the actual networking.
+ *
+ * MacTCP lets an application have several calls outstanding on a stream,
+ * for example a receive that is pending while data is being sent. For
+ * this reason, calls are taken off the Device Manager queue as soon as
+ * they arrive and are handed to the VBL task, which owns the link. When
+ * a call finishes, its ioCompletion routine is called directly.
+ *
+ * As in MacTCP, the stream's control block is stored at the start of the
+ * receive buffer given to TCPCreate. The rest of that buffer is a ring
+ * that holds incoming data. TCPNoCopyRcv hands out pointers into the ring,
+ * which stay valid until they are returned with TCPRcvBfrReturn; the far
+ * side may only send as much data as has been advertised as free.
+ *
+ * This file generates code and is meant to be included once, from the
+ * serial driver, which provides ippComplete.
+ */
+
+#define TCP_MIN_RING_LEN    512  // Smallest usable receive ring
+#define TCP_WINDOW_UPDATE   256  // Advertise freed space in chunks this large
+
+// Connection states, as reported by TCPStatus
+
+enum {
+	tcpStateClosed      = 0,
+	tcpStateSynSent     = 6,
+	tcpStateEstablished = 8,
+	tcpStateFinWait1    = 10,
+	tcpStateCloseWait   = 14,
+	tcpStateLastAck     = 18
+};
+
+struct FujiTCPStream {
+	unsigned char      chan;
+	unsigned char      state;
+	unsigned char      pendingCmd;      // OPEN, CLOSE or ABORT waiting to be sent
+	unsigned char      rcvLoans;        // Buffers on loan through TCPNoCopyRcv
+	unsigned short     termReason;      // Non-zero once the connection was terminated
+	TCPNotifyProc      notifyProc;
+	Ptr                userDataPtr;
+	Ptr                rcvBuff;         // As given to TCPCreate
+	unsigned long      rcvBuffLen;
+	Ptr                ring;            // Receive ring, follows this structure
+	unsigned long      ringLen;
+	unsigned long      rcvIn;           // Total bytes placed in the ring
+	unsigned long      rcvOut;          // Total bytes handed to the application
+	unsigned long      rcvDone;         // Total bytes released by the application
+	unsigned long      creditOwed;      // Bytes released, but not yet advertised
+	unsigned long      rcvDeadline;     // Ticks at which a pending receive times out
+	ip_addr            remoteHost;
+	ip_addr            localHost;
+	tcp_port           remotePort;
+	tcp_port           localPort;
+	unsigned long      sendOffset;      // Bytes of the first queued send already sent
+	TCPiopb           *openPb;
+	TCPiopb           *closePb;
+	TCPiopb           *rcvPb;
+	QHdr               sendQueue;
+};
+
+// Payload of an OPEN message from the Mac
+
+struct FujiTCPOpenMsg {
+	ip_addr            remoteHost;
+	tcp_port           remotePort;
+	tcp_port           localPort;
+	unsigned short     window;
+};
+
+// Payload of an OPEN message from the far side
+
+struct FujiTCPOpenReply {
+	ip_addr            localHost;
+	tcp_port           localPort;
+};
+
+static struct FujiTCPStream *tcpFindStream (struct FujiSerData *data, StreamPtr stream) {
+	short i;
+	for (i = 0; i < MAC_FUJI_MAX_TCP; i++) {
+		if (data->tcpStreams[i] && ((StreamPtr)data->tcpStreams[i] == stream)) {
+			return data->tcpStreams[i];
+		}
+	}
+	return 0;
+}
+
+static struct FujiTCPStream *tcpFindChannel (struct FujiSerData *data, unsigned char chan) {
+	const unsigned char i = chan - MAC_FUJI_CHAN_TCP;
+	return (i < MAC_FUJI_MAX_TCP) ? data->tcpStreams[i] : 0;
+}
+
+static void tcpNotify (struct FujiTCPStream *s, unsigned short event) {
+	if (s->notifyProc) {
+		(*s->notifyProc) ((StreamPtr)s, event, s->userDataPtr, s->termReason, NULL);
+	}
+}
+
+static unsigned long tcpSendLength (TCPiopb *pb) {
+	const wdsEntry *wds = (wdsEntry*) pb->csParam.send.wdsPtr;
+	unsigned long len = 0;
+	for (; wds->length; wds++) {
+		len += wds->length;
+	}
+	return len;
+}
+
+static unsigned long tcpUnsentData (struct FujiTCPStream *s) {
+	TCPiopb *pb;
+	unsigned long len = 0;
+	for (pb = (TCPiopb*) s->sendQueue.qHead; pb; pb = *(TCPiopb**)pb) {
+		len += tcpSendLength (pb);
+	}
+	return len - s->sendOffset;
+}
+
+/* Marks bytes of the receive ring as free, so they can be advertised
+ * to the far side with a WINDOW message.
+ */
+static void tcpReleaseRing (struct FujiTCPStream *s, unsigned long count) {
+	s->rcvDone    += count;
+	s->creditOwed += count;
+}
+
+/* Carries out a TCPRcv or TCPNoCopyRcv. Returns ioInProgress if there
+ * is no data yet and more may still arrive.
+ */
+static OSErr tcpReceive (struct FujiTCPStream *s, TCPiopb *pb) {
+	if (s->rcvIn == s->rcvOut) {
+		if (s->termReason) {
+			return connectionTerminated;
+		}
+		if ((s->state == tcpStateEstablished) || (s->state == tcpStateFinWait1)) {
+			return ioInProgress;
+		}
+		return connectionClosing;
+	}
+
+	pb->csParam.receive.urgentFlag = false;
+	pb->csParam.receive.markFlag   = false;
+
+	if (pb->csCode == TCPRcv) {
+		const Ptr      dst = pb->csParam.receive.rcvBuff;
+		unsigned short len = MIN (pb->csParam.receive.rcvBuffLen, s->rcvIn - s->rcvOut);
+		unsigned short done;
+
+		for (done = 0; done < len;) {
+			const unsigned long pos   = s->rcvOut % s->ringLen;
+			const unsigned long chunk = MIN (len - done, s->ringLen - pos);
+			BlockMove (s->ring + pos, dst + done, chunk);
+			s->rcvOut += chunk;
+			done      += chunk;
+		}
+		pb->csParam.receive.rcvBuffLen = len;
+
+		// With no buffers on loan, copied data can be released right away
+
+		if (s->rcvLoans == 0) {
+			tcpReleaseRing (s, s->rcvOut - s->rcvDone);
+		}
+	} else {
+		// TCPNoCopyRcv: describe the unread data in the ring with at most
+		// two RDS entries (the ring may wrap), leaving room for the
+		// zero-length entry that terminates the list.
+
+		rdsEntry      *rds = (rdsEntry*) pb->csParam.receive.rdsPtr;
+		unsigned short i;
+
+		for (i = 0; (i + 1 < pb->csParam.receive.rdsLength) && (s->rcvIn != s->rcvOut); i++) {
+			const unsigned long pos   = s->rcvOut % s->ringLen;
+			const unsigned long chunk = MIN (MIN (s->rcvIn - s->rcvOut, s->ringLen - pos), 0x7FFF);
+			rds[i].length = chunk;
+			rds[i].ptr    = s->ring + pos;
+			s->rcvOut    += chunk;
+		}
+		rds[i].length = 0;
+		rds[i].ptr    = 0;
+		s->rcvLoans++;
+	}
+	return noErr;
+}
+
+static void tcpServiceReceive (struct FujiTCPStream *s) {
+	if (s->rcvPb) {
+		const OSErr err = tcpReceive (s, s->rcvPb);
+		if (err != ioInProgress) {
+			TCPiopb *pb = s->rcvPb;
+			s->rcvPb = 0;
+			ippComplete ((ParmBlkPtr) pb, err);
+		}
+	}
+}
+
+/* Ends the connection, failing any calls that are waiting on it. The
+ * stream itself remains valid until TCPRelease.
+ */
+static void tcpTerminate (struct FujiTCPStream *s, unsigned short reason) {
+	TCPiopb *pb;
+
+	s->state      = tcpStateClosed;
+	s->termReason = reason;
+	s->pendingCmd = 0;
+	s->sendOffset = 0;
+
+	if (s->openPb) {
+		pb = s->openPb;
+		s->openPb = 0;
+		ippComplete ((ParmBlkPtr) pb, openFailed);
+	}
+	if (s->closePb) {
+		pb = s->closePb;
+		s->closePb = 0;
+		ippComplete ((ParmBlkPtr) pb, connectionTerminated);
+	}
+	while ((pb = (TCPiopb*) s->sendQueue.qHead) != NULL) {
+		Dequeue ((QElemPtr) pb, &s->sendQueue);
+		ippComplete ((ParmBlkPtr) pb, connectionTerminated);
+	}
+	tcpServiceReceive (s);
+	tcpNotify (s, TCPTerminate);
+}
+
+/* Called by the VBL task with messages from the far side. */
+
+static void tcpMessageIn (struct FujiSerData *data, unsigned char chan, unsigned char cmd, Ptr payload, short len) {
+	struct FujiTCPStream *s = tcpFindChannel (data, chan);
+
+	if (s == 0) {
+		return;
+	}
+
+	switch (cmd) {
+		case MAC_FUJI_CMD_DATA: {
+			const unsigned long space = s->ringLen - (s->rcvIn - s->rcvDone);
+			short done;
+
+			#if SANITY_CHECK
+				if (len > space) {
+					// The far side sent more than was advertised
+					SysBeep (10);
+				}
+			#endif
+
+			len = MIN (len, space);
+			for (done = 0; done < len;) {
+				const unsigned long pos   = s->rcvIn % s->ringLen;
+				const unsigned long chunk = MIN (len - done, s->ringLen - pos);
+				BlockMove (payload + done, s->ring + pos, chunk);
+				s->rcvIn += chunk;
+				done     += chunk;
+			}
+			if (s->rcvPb == 0) {
+				tcpNotify (s, TCPDataArrival);
+			}
+			break;
+		}
+
+		case MAC_FUJI_CMD_OPEN:
+			if (len >= sizeof (struct FujiTCPOpenReply)) {
+				const struct FujiTCPOpenReply *msg = (struct FujiTCPOpenReply*) payload;
+				s->localHost       = msg->localHost;
+				s->localPort       = msg->localPort;
+				data->ippLocalHost = msg->localHost;
+			}
+			if (s->state == tcpStateSynSent) {
+				s->state = tcpStateEstablished;
+			}
+			if (s->openPb) {
+				TCPiopb *pb = s->openPb;
+				s->openPb = 0;
+				pb->csParam.open.localHost = s->localHost;
+				pb->csParam.open.localPort = s->localPort;
+				ippComplete ((ParmBlkPtr) pb, noErr);
+			}
+			break;
+
+		case MAC_FUJI_CMD_CLOSE:
+			// The remote end will send no more data
+			if (s->state == tcpStateEstablished) {
+				s->state = tcpStateCloseWait;
+			} else if ((s->state == tcpStateFinWait1) || (s->state == tcpStateLastAck)) {
+				s->state = tcpStateClosed;
+			}
+			tcpNotify (s, TCPClosing);
+			break;
+
+		case MAC_FUJI_CMD_ABORT:
+			if (s->state != tcpStateClosed) {
+				tcpTerminate (s, TCPRemoteAbort);
+			}
+			break;
+	}
+	tcpServiceReceive (s);
+}
+
+/* Called by the VBL task when the link is free. If a stream has a message
+ * to send, it is placed in the write buffer and true is returned.
+ */
+static Boolean tcpFillWriteBuffer (struct FujiSerData *data) {
+	short i;
+
+	for (i = 0; i < MAC_FUJI_MAX_TCP; i++) {
+		struct FujiTCPStream *s = data->tcpStreams[i];
+		TCPiopb *pb;
+
+		if (data->tcpAborts & (1 << i)) {
+			// A stream was released while connected
+			data->tcpAborts &= ~(1 << i);
+			data->writeData.chan   = MAC_FUJI_CHAN_TCP + i;
+			data->writeData.cmd    = MAC_FUJI_CMD_ABORT;
+			data->writeData.length = 0;
+			return true;
+		}
+
+		if (s == 0) {
+			continue;
+		}
+
+		data->writeData.chan   = s->chan;
+		data->writeData.length = 0;
+
+		if (s->pendingCmd == MAC_FUJI_CMD_OPEN) {
+			struct FujiTCPOpenMsg *msg = (struct FujiTCPOpenMsg*) data->writeData.payload;
+			const unsigned long window = MIN (s->ringLen, 0xFFFF);
+			msg->remoteHost        = s->remoteHost;
+			msg->remotePort        = s->remotePort;
+			msg->localPort         = s->localPort;
+			msg->window            = window;
+			s->creditOwed          = s->ringLen - window;
+			s->pendingCmd          = 0;
+			data->writeData.cmd    = MAC_FUJI_CMD_OPEN;
+			data->writeData.length = sizeof (struct FujiTCPOpenMsg);
+			return true;
+		}
+
+		if (s->pendingCmd == MAC_FUJI_CMD_ABORT) {
+			s->pendingCmd          = 0;
+			data->writeData.cmd    = MAC_FUJI_CMD_ABORT;
+			return true;
+		}
+
+		pb = (TCPiopb*) s->sendQueue.qHead;
+		if (pb) {
+			// Copy the next chunk of the first queued send, skipping
+			// over the part which has already gone out.
+
+			const wdsEntry *wds = (wdsEntry*) pb->csParam.send.wdsPtr;
+			unsigned long   skip = s->sendOffset;
+			short           len  = 0;
+
+			for (; wds->length && (len < NELEMENTS (data->writeData.payload)); wds++) {
+				if (skip >= wds->length) {
+					skip -= wds->length;
+				} else {
+					const short chunk = MIN (wds->length - skip, NELEMENTS (data->writeData.payload) - len);
+					BlockMove (wds->ptr + skip, data->writeData.payload + len, chunk);
+					len += chunk;
+					skip = 0;
+				}
+			}
+			data->writeData.cmd    = MAC_FUJI_CMD_DATA;
+			data->writeData.length = len;
+			return true;
+		}
+
+		if (s->pendingCmd == MAC_FUJI_CMD_CLOSE) {
+			s->pendingCmd          = 0;
+			data->writeData.cmd    = MAC_FUJI_CMD_CLOSE;
+			return true;
+		}
+
+		if ((s->creditOwed >= TCP_WINDOW_UPDATE) || (s->creditOwed && (s->rcvIn == s->rcvDone))) {
+			const unsigned short credit = MIN (s->creditOwed, 0xFFFF);
+			*(unsigned short*) data->writeData.payload = credit;
+			s->creditOwed         -= credit;
+			data->writeData.cmd    = MAC_FUJI_CMD_WINDOW;
+			data->writeData.length = sizeof (unsigned short);
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Called once the message placed by tcpFillWriteBuffer has been written */
+
+static void tcpWriteDone (struct FujiSerData *data) {
+	struct FujiTCPStream *s = tcpFindChannel (data, data->writeData.chan);
+	TCPiopb *pb;
+
+	if (s == 0) {
+		return;
+	}
+
+	if (data->writeData.cmd == MAC_FUJI_CMD_DATA) {
+		pb = (TCPiopb*) s->sendQueue.qHead;
+		if (pb) {
+			s->sendOffset += data->writeData.length;
+			if (s->sendOffset >= tcpSendLength (pb)) {
+				s->sendOffset = 0;
+				Dequeue ((QElemPtr) pb, &s->sendQueue);
+				ippComplete ((ParmBlkPtr) pb, noErr);
+			}
+		}
+	}
+	else if ((data->writeData.cmd == MAC_FUJI_CMD_CLOSE) && s->closePb) {
+		pb = s->closePb;
+		s->closePb = 0;
+		ippComplete ((ParmBlkPtr) pb, noErr);
+	}
+}
+
+/* Returns true if any stream has something to send, so the VBL task
+ * can come back for it without waiting for the next poll interval.
+ */
+static Boolean tcpWantsService (struct FujiSerData *data) {
+	short i;
+	if (data->tcpAborts) {
+		return true;
+	}
+	for (i = 0; i < MAC_FUJI_MAX_TCP; i++) {
+		const struct FujiTCPStream *s = data->tcpStreams[i];
+		if (s && (s->pendingCmd || s->sendQueue.qHead || (s->creditOwed >= TCP_WINDOW_UPDATE))) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static OSErr tcpCreate (struct FujiSerData *data, TCPiopb *pb) {
+	struct FujiTCPStream *s = (struct FujiTCPStream*) pb->csParam.create.rcvBuff;
+	char  *p;
+	short i;
+
+	if (s == 0) {
+		return invalidBufPtr;
+	}
+
+	if (pb->csParam.create.rcvBuffLen < sizeof (struct FujiTCPStream) + TCP_MIN_RING_LEN) {
+		return invalidLength;
+	}
+
+	for (i = 0; i < MAC_FUJI_MAX_TCP; i++) {
+		if ((data->tcpStreams[i] == 0) && !(data->tcpAborts & (1 << i))) {
+			break;
+		}
+	}
+	if (i == MAC_FUJI_MAX_TCP) {
+		return insufficientResources;
+	}
+
+	for (p = (char*) s; p < (char*) (s + 1); p++) {
+		*p = 0;
+	}
+	s->chan        = MAC_FUJI_CHAN_TCP + i;
+	s->state       = tcpStateClosed;
+	s->notifyProc  = pb->csParam.create.notifyProc;
+	s->userDataPtr = pb->csParam.create.userDataPtr;
+	s->rcvBuff     = pb->csParam.create.rcvBuff;
+	s->rcvBuffLen  = pb->csParam.create.rcvBuffLen;
+	s->ring        = s->rcvBuff    + sizeof (struct FujiTCPStream);
+	s->ringLen     = s->rcvBuffLen - sizeof (struct FujiTCPStream);
+
+	data->tcpStreams[i] = s;
+	pb->tcpStream = (StreamPtr) s;
+	return noErr;
+}
+
+/* Executes a MacTCP call on behalf of the VBL task. Returns ioInProgress
+ * if the call has been parked on the stream, to be completed later.
+ */
+static OSErr tcpExecute (struct FujiSerData *data, TCPiopb *pb) {
+	struct FujiTCPStream *s = 0;
+	OSErr err;
+
+	if (pb->csCode == TCPCreate) { // 30
+		// .IPP TCPCreate: Opens a TCP stream
+		return tcpCreate (data, pb);
+	}
+
+	s = tcpFindStream (data, pb->tcpStream);
+	if (s == 0) {
+		return invalidStreamPtr;
+	}
+
+	if (pb->csCode == TCPPassiveOpen) { // 31
+		// .IPP TCPPassiveOpen: Listens for incoming connections (not supported)
+		return openFailed;
+	}
+	else if (pb->csCode == TCPActiveOpen) { // 32
+		// .IPP TCPActiveOpen: Initiates an outgoing connection
+		if ((s->state != tcpStateClosed) || s->openPb) {
+			return connectionExists;
+		}
+		s->remoteHost = pb->csParam.open.remoteHost;
+		s->remotePort = pb->csParam.open.remotePort;
+		s->localPort  = pb->csParam.open.localPort;
+		s->termReason = 0;
+		s->creditOwed = 0;
+		s->rcvIn = s->rcvOut = s->rcvDone = 0;
+		s->state      = tcpStateSynSent;
+		s->pendingCmd = MAC_FUJI_CMD_OPEN;
+		s->openPb     = pb;
+		return ioInProgress;
+	}
+	else if (pb->csCode == TCPSend) { // 34
+		// .IPP TCPSend: Sends data over the connection
+		if ((s->state != tcpStateEstablished) && (s->state != tcpStateCloseWait)) {
+			return s->termReason ? connectionTerminated : connectionDoesntExist;
+		}
+		if (tcpSendLength (pb) == 0) {
+			return noErr;
+		}
+		Enqueue ((QElemPtr) pb, &s->sendQueue);
+		return ioInProgress;
+	}
+	else if ((pb->csCode == TCPNoCopyRcv) || (pb->csCode == TCPRcv)) { // 35, 37
+		// .IPP TCPNoCopyRcv: Receives data without copying
+		// .IPP TCPRcv: Receives data and copy to user buffers
+		if (s->rcvPb) {
+			return insufficientResources;
+		}
+		if ((pb->csCode == TCPNoCopyRcv) && (pb->csParam.receive.rdsLength < 2)) {
+			return invalidRDS;
+		}
+		err = tcpReceive (s, pb);
+		if (err == ioInProgress) {
+			const unsigned char timeout = pb->csParam.receive.commandTimeoutValue;
+			s->rcvPb       = pb;
+			s->rcvDeadline = timeout ? Ticks + 60L * timeout : 0;
+		}
+		return err;
+	}
+	else if (pb->csCode == TCPRcvBfrReturn) { // 36
+		// .IPP TCPRcvBfrReturn: Returns buffers from TCPNoCopyRcv
+		const rdsEntry *rds = (rdsEntry*) pb->csParam.receive.rdsPtr;
+		unsigned long len = 0;
+		if (s->rcvLoans == 0) {
+			return invalidRDS;
+		}
+		for (; rds->length; rds++) {
+			len += rds->length;
+		}
+		// Buffers are returned in the order they were lent out. Once the last
+		// one is back, anything read by TCPRcv in the meantime is freed too.
+		if (--s->rcvLoans == 0) {
+			len = s->rcvOut - s->rcvDone;
+		}
+		tcpReleaseRing (s, len);
+		return noErr;
+	}
+	else if (pb->csCode == TCPClose) { // 38
+		// .IPP TCPClose: Signals user has no more data to send on connection
+		if (s->state == tcpStateEstablished) {
+			s->state = tcpStateFinWait1;
+		} else if (s->state == tcpStateCloseWait) {
+			s->state = tcpStateLastAck;
+		} else {
+			return connectionDoesntExist;
+		}
+		s->pendingCmd = MAC_FUJI_CMD_CLOSE;
+		s->closePb    = pb;
+		return ioInProgress;
+	}
+	else if (pb->csCode == TCPAbort) { // 39
+		// .IPP TCPAbort: Terminates a connection without attempting to send all outstanding data
+		if (s->state == tcpStateClosed) {
+			return connectionDoesntExist;
+		}
+		tcpTerminate (s, TCPULPAbort);
+		s->pendingCmd = MAC_FUJI_CMD_ABORT;
+		return noErr;
+	}
+	else if (pb->csCode == TCPStatus) { // 40
+		// .IPP TCPStatus: Gather information about a specific connection
+		const unsigned long rcvFree = s->ringLen - (s->rcvIn - s->rcvDone);
+		pb->csParam.status.remoteHost      = s->remoteHost;
+		pb->csParam.status.remotePort      = s->remotePort;
+		pb->csParam.status.localHost       = s->localHost;
+		pb->csParam.status.localPort       = s->localPort;
+		pb->csParam.status.connectionState = s->state;
+		pb->csParam.status.sendWindow      = 0xFFFF;
+		pb->csParam.status.rcvWindow       = MIN (rcvFree, 0xFFFF);
+		pb->csParam.status.amtUnackedData  = MIN (tcpUnsentData (s), 0xFFFF);
+		pb->csParam.status.amtUnreadData   = MIN (s->rcvIn - s->rcvOut, 0xFFFF);
+		pb->csParam.status.userDataPtr     = s->userDataPtr;
+		return noErr;
+	}
+	else if (pb->csCode == TCPRelease) { // 42
+		// .IPP TCPRelease: Closes a TCP stream
+		if (s->state != tcpStateClosed) {
+			tcpTerminate (s, TCPULPAbort);
+			data->tcpAborts |= 1 << (s->chan - MAC_FUJI_CHAN_TCP);
+		}
+		if (s->rcvPb) {
+			TCPiopb *rcvPb = s->rcvPb;
+			s->rcvPb = 0;
+			ippComplete ((ParmBlkPtr) rcvPb, connectionTerminated);
+		}
+		data->tcpStreams[s->chan - MAC_FUJI_CHAN_TCP] = 0;
+		pb->csParam.create.rcvBuff    = s->rcvBuff;
+		pb->csParam.create.rcvBuffLen = s->rcvBuffLen;
+		return noErr;
+	}
+
+	// .IPP TCPExtendedStat and TCPGlobalInfo are not supported
+
+	return invalidStreamPtr;
+}
+
+/* Fails receives that have timed out. Called by the VBL task with the
+ * mutex held.
+ */
+static void tcpExpireReceives (struct FujiSerData *data) {
+	TCPiopb *pb;
+	short i;
+
+	for (i = 0; i < MAC_FUJI_MAX_TCP; i++) {
+		struct FujiTCPStream *s = data->tcpStreams[i];
+		if (s && s->rcvPb && s->rcvDeadline && ((long)(Ticks - s->rcvDeadline) >= 0)) {
+			pb = s->rcvPb;
+			s->rcvPb = 0;
+			ippComplete ((ParmBlkPtr) pb, commandTimeout);
+		}
+	}
+}
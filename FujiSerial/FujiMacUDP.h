@@ -0,0 +1,498 @@
+/****************************************************************************
+ *   mac68k-fuji-drivers (c) 2024 Marcio Teixeira                           *
+ *                                                                          *
+ *   This program is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU General Public License as published by   *
+ *   the Free Software Foundation, either version 3 of the License, or      *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   This program is distributed in the hope that it will be useful,        *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU General Public License for more details.                           *
+ *                                                                          *
+ *   To view a copy of the GNU General Public License, go to the following  *
+ *   location: <http://www.gnu.org/licenses/>.                              *
+ ****************************************************************************/
+
+/**
+ * MacTCP UDP emulation for the ".IPP" driver.
+ *
+ * Each UDP stream is bound to a channel on the FujiNet link. Rather than
+ * spending one floppy round trip per datagram, all the datagrams waiting
+ * on a stream are packed into a single DATA message, each one preceded by
+ * a FujiUDPHeader. The far side does the same with the datagrams it
+ * receives, so a burst of small DNS or NTP replies arrives in one block.
+ *
+ * The stream's control block is stored at the start of the receive buffer
+ * given to UDPCreate, and the rest of the buffer holds received datagrams.
+ * As in MacTCP, UDPRead returns a pointer to the datagram in that buffer,
+ * which stays valid until it is handed back with UDPBfrReturn. Datagrams
+ * that arrive while the buffer is full are dropped.
+ *
+ * This file generates code and is meant to be included once, from the
+ * serial driver, which provides ippComplete.
+ */
+
+#define UDP_MIN_RING_LEN    512  // Smallest usable receive buffer
+#define UDP_MAX_DATAGRAM    (500 - sizeof (struct FujiUDPHeader))
+
+#define UDP_EVEN(len)       (((len) + 1) & ~1)
+
+enum {
+	udpStateClosed,
+	udpStateOpening,
+	udpStateOpen
+};
+
+// A received datagram, as kept in the receive buffer. A slot with
+// a size of zero marks the point where the buffer wraps around.
+
+struct FujiUDPSlot {
+	unsigned short     size;            // Size of this slot, including data
+	Boolean            returned;        // Handed back with UDPBfrReturn
+	char               unused;
+	struct FujiUDPHeader hdr;
+};
+
+struct FujiUDPStream {
+	unsigned char      chan;
+	unsigned char      state;
+	unsigned char      sentCount;       // Writes packed into the message being sent
+	Boolean            openSent;
+	UDPNotifyProc      notifyProc;
+	Ptr                userDataPtr;
+	Ptr                rcvBuff;         // As given to UDPCreate
+	unsigned long      rcvBuffLen;
+	Ptr                ring;            // Datagram slots, follows this structure
+	unsigned long      ringLen;
+	unsigned long      head;            // Where the next slot will be placed
+	unsigned long      tail;            // Oldest slot not yet returned
+	unsigned long      next;            // Oldest slot not yet read
+	unsigned short     slots;           // Slots not yet returned
+	unsigned short     unread;          // Slots not yet read
+	unsigned long      dropped;         // Datagrams lost to a full buffer
+	unsigned long      rcvDeadline;     // Ticks at which a pending read times out
+	udp_port           localPort;
+	UDPiopb           *createPb;
+	UDPiopb           *readPb;
+	QHdr               sendQueue;
+};
+
+// Payload of an OPEN message from the far side
+
+struct FujiUDPOpenReply {
+	ip_addr            localHost;
+	udp_port           localPort;
+};
+
+#define UDP_SLOT(s,pos) ((struct FujiUDPSlot*) ((s)->ring + (pos)))
+
+// True if the slot at "pos" is where the buffer wraps around
+#define UDP_WRAPS(s,pos) (((pos) == (s)->ringLen) || (UDP_SLOT (s, pos)->size == 0))
+
+static struct FujiUDPStream *udpFindStream (struct FujiSerData *data, StreamPtr stream) {
+	short i;
+	for (i = 0; i < MAC_FUJI_MAX_UDP; i++) {
+		if (data->udpStreams[i] && ((StreamPtr)data->udpStreams[i] == stream)) {
+			return data->udpStreams[i];
+		}
+	}
+	return 0;
+}
+
+static struct FujiUDPStream *udpFindChannel (struct FujiSerData *data, unsigned char chan) {
+	const unsigned char i = chan - MAC_FUJI_CHAN_UDP;
+	return (i < MAC_FUJI_MAX_UDP) ? data->udpStreams[i] : 0;
+}
+
+static unsigned long udpSendLength (UDPiopb *pb) {
+	const wdsEntry *wds = (wdsEntry*) pb->csParam.send.wdsPtr;
+	unsigned long len = 0;
+	for (; wds->length; wds++) {
+		len += wds->length;
+	}
+	return len;
+}
+
+/* Finds room for a slot of "size" bytes in the receive buffer. Slots
+ * are never split, so that UDPRead can point straight at the data.
+ */
+static struct FujiUDPSlot *udpAllocSlot (struct FujiUDPStream *s, unsigned short size) {
+	if (s->slots == 0) {
+		s->head = s->tail = s->next = 0;
+	}
+	if (s->head >= s->tail) {
+		if (s->head + size <= s->ringLen) {
+			return UDP_SLOT (s, s->head);
+		}
+		if ((s->slots == 0) || (size >= s->tail)) {
+			return 0;
+		}
+		// Wrap around to the start of the buffer
+		if (s->head < s->ringLen) {
+			UDP_SLOT (s, s->head)->size = 0;
+		}
+		s->head = 0;
+		return UDP_SLOT (s, 0);
+	}
+	return (s->head + size < s->tail) ? UDP_SLOT (s, s->head) : 0;
+}
+
+/* Frees the slots at the tail of the buffer which have been returned */
+
+static void udpReleaseSlots (struct FujiUDPStream *s) {
+	while (s->slots) {
+		struct FujiUDPSlot *slot;
+		if (UDP_WRAPS (s, s->tail)) {
+			s->tail = 0;
+		}
+		slot = UDP_SLOT (s, s->tail);
+		if (!slot->returned) {
+			break;
+		}
+		s->tail += slot->size;
+		s->slots--;
+	}
+}
+
+/* Carries out a UDPRead. Returns ioInProgress if there is no datagram yet */
+
+static OSErr udpRead (struct FujiUDPStream *s, UDPiopb *pb) {
+	struct FujiUDPSlot *slot;
+
+	if (s->unread == 0) {
+		return ioInProgress;
+	}
+	if (UDP_WRAPS (s, s->next)) {
+		s->next = 0;
+	}
+	slot = UDP_SLOT (s, s->next);
+	s->next += slot->size;
+	s->unread--;
+
+	pb->csParam.receive.remoteHost = slot->hdr.remoteHost;
+	pb->csParam.receive.remotePort = slot->hdr.remotePort;
+	pb->csParam.receive.rcvBuff    = (Ptr) (slot + 1);
+	pb->csParam.receive.rcvBuffLen = slot->hdr.length;
+	return noErr;
+}
+
+static void udpServiceRead (struct FujiUDPStream *s) {
+	if (s->readPb && (udpRead (s, s->readPb) == noErr)) {
+		UDPiopb *pb = s->readPb;
+		s->readPb = 0;
+		ippComplete ((ParmBlkPtr) pb, noErr);
+	}
+}
+
+/* Called by the VBL task with messages from the far side. */
+
+static void udpMessageIn (struct FujiSerData *data, unsigned char chan, unsigned char cmd, Ptr payload, short len) {
+	struct FujiUDPStream *s = udpFindChannel (data, chan);
+	UDPiopb *pb;
+
+	if (s == 0) {
+		return;
+	}
+
+	switch (cmd) {
+		case MAC_FUJI_CMD_DATA: {
+			// Unpack the datagrams in the message; the headers are
+			// always on even addresses, as the 68000 requires.
+			const Ptr end = payload + len;
+			Boolean   arrived = false;
+
+			while (payload + sizeof (struct FujiUDPHeader) <= end) {
+				const struct FujiUDPHeader *hdr = (struct FujiUDPHeader*) payload;
+				const unsigned short size = sizeof (struct FujiUDPSlot) + UDP_EVEN (hdr->length);
+				struct FujiUDPSlot *slot;
+
+				if (payload + sizeof (struct FujiUDPHeader) + hdr->length > end) {
+					break;
+				}
+				slot = udpAllocSlot (s, size);
+				if (slot) {
+					slot->size     = size;
+					slot->returned = false;
+					slot->hdr      = *hdr;
+					BlockMove (payload + sizeof (struct FujiUDPHeader), (Ptr) (slot + 1), hdr->length);
+					s->head += size;
+					s->slots++;
+					s->unread++;
+					arrived = true;
+				} else {
+					s->dropped++;
+				}
+				payload += sizeof (struct FujiUDPHeader) + UDP_EVEN (hdr->length);
+			}
+			udpServiceRead (s);
+			if (arrived && s->unread && s->notifyProc) {
+				(*s->notifyProc) ((StreamPtr)s, UDPDataArrival, s->userDataPtr, NULL);
+			}
+			break;
+		}
+
+		case MAC_FUJI_CMD_OPEN:
+			// The far side has bound the port
+			if (len >= sizeof (struct FujiUDPOpenReply)) {
+				const struct FujiUDPOpenReply *msg = (struct FujiUDPOpenReply*) payload;
+				s->localPort = msg->localPort;
+				if (msg->localHost) {
+					data->ippLocalHost = msg->localHost;
+				}
+			}
+			s->state = udpStateOpen;
+			if ((pb = s->createPb) != NULL) {
+				s->createPb = 0;
+				pb->udpStream = (StreamPtr) s;
+				pb->csParam.create.localPort = s->localPort;
+				ippComplete ((ParmBlkPtr) pb, noErr);
+			}
+			break;
+
+		case MAC_FUJI_CMD_ABORT:
+			// The port could not be bound
+			if ((pb = s->createPb) != NULL) {
+				s->createPb = 0;
+				data->udpStreams[chan - MAC_FUJI_CHAN_UDP] = 0;
+				ippComplete ((ParmBlkPtr) pb, insufficientResources);
+			}
+			break;
+	}
+}
+
+/* Called by the VBL task when the link is free. If a stream has a message
+ * to send, it is placed in the write buffer and true is returned.
+ */
+static Boolean udpFillWriteBuffer (struct FujiSerData *data) {
+	short i;
+
+	for (i = 0; i < MAC_FUJI_MAX_UDP; i++) {
+		struct FujiUDPStream *s = data->udpStreams[i];
+		UDPiopb *pb;
+
+		data->writeData.chan   = MAC_FUJI_CHAN_UDP + i;
+		data->writeData.length = 0;
+
+		if (data->udpCloses & (1 << i)) {
+			// A stream was released
+			data->udpCloses &= ~(1 << i);
+			data->writeData.cmd = MAC_FUJI_CMD_CLOSE;
+			return true;
+		}
+
+		if (s == 0) {
+			continue;
+		}
+
+		if (!s->openSent) {
+			// Ask the far side to bind the local port
+			s->openSent = true;
+			*(udp_port*) data->writeData.payload = s->localPort;
+			data->writeData.cmd    = MAC_FUJI_CMD_OPEN;
+			data->writeData.length = sizeof (udp_port);
+			return true;
+		}
+
+		// Pack as many of the queued writes as will fit into one message
+
+		s->sentCount = 0;
+		for (pb = (UDPiopb*) s->sendQueue.qHead; pb; pb = *(UDPiopb**)pb) {
+			const unsigned short dgramLen = udpSendLength (pb);
+			struct FujiUDPHeader *hdr = (struct FujiUDPHeader*) (data->writeData.payload + data->writeData.length);
+			const wdsEntry *wds = (wdsEntry*) pb->csParam.send.wdsPtr;
+			Ptr dst;
+
+			if (data->writeData.length + sizeof (struct FujiUDPHeader) + dgramLen > NELEMENTS (data->writeData.payload)) {
+				break;
+			}
+			hdr->remoteHost = pb->csParam.send.remoteHost;
+			hdr->remotePort = pb->csParam.send.remotePort;
+			hdr->length     = dgramLen;
+			for (dst = (Ptr) (hdr + 1); wds->length; wds++) {
+				BlockMove (wds->ptr, dst, wds->length);
+				dst += wds->length;
+			}
+			data->writeData.length = MIN (data->writeData.length + sizeof (struct FujiUDPHeader) + UDP_EVEN (dgramLen), NELEMENTS (data->writeData.payload));
+			s->sentCount++;
+		}
+		if (s->sentCount) {
+			data->writeData.cmd = MAC_FUJI_CMD_DATA;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Called once the message placed by udpFillWriteBuffer has been written */
+
+static void udpWriteDone (struct FujiSerData *data) {
+	struct FujiUDPStream *s = udpFindChannel (data, data->writeData.chan);
+	UDPiopb *pb;
+
+	if ((s == 0) || (data->writeData.cmd != MAC_FUJI_CMD_DATA)) {
+		return;
+	}
+	for (; s->sentCount; s->sentCount--) {
+		pb = (UDPiopb*) s->sendQueue.qHead;
+		Dequeue ((QElemPtr) pb, &s->sendQueue);
+		ippComplete ((ParmBlkPtr) pb, noErr);
+	}
+}
+
+/* Returns true if any stream has something to send */
+
+static Boolean udpWantsService (struct FujiSerData *data) {
+	short i;
+	if (data->udpCloses) {
+		return true;
+	}
+	for (i = 0; i < MAC_FUJI_MAX_UDP; i++) {
+		const struct FujiUDPStream *s = data->udpStreams[i];
+		if (s && (!s->openSent || s->sendQueue.qHead)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static OSErr udpCreate (struct FujiSerData *data, UDPiopb *pb) {
+	struct FujiUDPStream *s = (struct FujiUDPStream*) pb->csParam.create.rcvBuff;
+	char  *p;
+	short i;
+
+	if (s == 0) {
+		return invalidBufPtr;
+	}
+
+	if (pb->csParam.create.rcvBuffLen < sizeof (struct FujiUDPStream) + UDP_MIN_RING_LEN) {
+		return invalidLength;
+	}
+
+	for (i = 0; i < MAC_FUJI_MAX_UDP; i++) {
+		if ((data->udpStreams[i] == 0) && !(data->udpCloses & (1 << i))) {
+			break;
+		}
+	}
+	if (i == MAC_FUJI_MAX_UDP) {
+		return insufficientResources;
+	}
+
+	for (p = (char*) s; p < (char*) (s + 1); p++) {
+		*p = 0;
+	}
+	s->chan        = MAC_FUJI_CHAN_UDP + i;
+	s->state       = udpStateOpening;
+	s->notifyProc  = pb->csParam.create.notifyProc;
+	s->userDataPtr = pb->csParam.create.userDataPtr;
+	s->localPort   = pb->csParam.create.localPort;
+	s->rcvBuff     = pb->csParam.create.rcvBuff;
+	s->rcvBuffLen  = pb->csParam.create.rcvBuffLen;
+	s->ring        = s->rcvBuff    + sizeof (struct FujiUDPStream);
+	s->ringLen     = (s->rcvBuffLen - sizeof (struct FujiUDPStream)) & ~1;
+	s->createPb    = pb;
+
+	// The call completes once the far side has bound the port
+	data->udpStreams[i] = s;
+	return ioInProgress;
+}
+
+/* Executes a MacTCP UDP call on behalf of the VBL task. Returns ioInProgress
+ * if the call has been parked on the stream, to be completed later.
+ */
+static OSErr udpExecute (struct FujiSerData *data, UDPiopb *pb) {
+	struct FujiUDPStream *s = 0;
+	OSErr err;
+
+	if (pb->csCode == UDPCreate) { // 20
+		// .IPP UDPCreate: Opens a UDP stream
+		return udpCreate (data, pb);
+	}
+	else if (pb->csCode == UDPMaxMTUSize) { // 25
+		// .IPP UDPMaxMTUSize: Returns the maximum size of an unfragmented datagram
+		pb->csParam.mtu.mtuSize = UDP_MAX_DATAGRAM;
+		return noErr;
+	}
+	else if (pb->csCode == UDPMultiCreate) { // 27
+		// .IPP UDPMultiCreate: Creates UDP connections on a consecutive series of ports (not supported)
+		return insufficientResources;
+	}
+
+	s = udpFindStream (data, pb->udpStream);
+	if ((s == 0) || (s->state != udpStateOpen)) {
+		return invalidStreamPtr;
+	}
+
+	if ((pb->csCode == UDPRead) || (pb->csCode == UDPMultiRead)) { // 21, 29
+		// .IPP UDPRead: Retreives a datagram
+		// .IPP UDPMultiRead: Receives data from a port created with the UDPMultiCreate
+		if (s->readPb) {
+			return insufficientResources;
+		}
+		err = udpRead (s, pb);
+		if (err == ioInProgress) {
+			const unsigned short timeout = pb->csParam.receive.timeOut;
+			s->readPb      = pb;
+			s->rcvDeadline = timeout ? Ticks + 60L * timeout : 0;
+		}
+		return err;
+	}
+	else if (pb->csCode == UDPBfrReturn) { // 22
+		// .IPP UDPBfrReturn: Returns receive buffer
+		struct FujiUDPSlot *slot = ((struct FujiUDPSlot*) pb->csParam.receive.rcvBuff) - 1;
+		if (((Ptr) slot < s->ring) || ((Ptr) slot >= s->ring + s->ringLen) || slot->returned) {
+			return invalidBufPtr;
+		}
+		slot->returned = true;
+		udpReleaseSlots (s);
+		return noErr;
+	}
+	else if ((pb->csCode == UDPWrite) || (pb->csCode == UDPMultiSend)) { // 23, 28
+		// .IPP UDPWrite: Sends a datagram
+		// .IPP UDPMultiSend: Sends a datagram from a specified port
+		if (udpSendLength (pb) > UDP_MAX_DATAGRAM) {
+			return invalidLength;
+		}
+		Enqueue ((QElemPtr) pb, &s->sendQueue);
+		return ioInProgress;
+	}
+	else if (pb->csCode == UDPRelease) { // 24
+		// .IPP UDPRelease: Closes a UDP stream
+		UDPiopb *qpb;
+		if (s->readPb) {
+			qpb = s->readPb;
+			s->readPb = 0;
+			ippComplete ((ParmBlkPtr) qpb, connectionTerminated);
+		}
+		while ((qpb = (UDPiopb*) s->sendQueue.qHead) != NULL) {
+			Dequeue ((QElemPtr) qpb, &s->sendQueue);
+			ippComplete ((ParmBlkPtr) qpb, connectionTerminated);
+		}
+		data->udpStreams[s->chan - MAC_FUJI_CHAN_UDP] = 0;
+		data->udpCloses |= 1 << (s->chan - MAC_FUJI_CHAN_UDP);
+		pb->csParam.create.rcvBuff    = s->rcvBuff;
+		pb->csParam.create.rcvBuffLen = s->rcvBuffLen;
+		return noErr;
+	}
+
+	// .IPP UDPStatus is not supported
+
+	return invalidStreamPtr;
+}
+
+/* Fails reads that have timed out. Called by the VBL task with the
+ * mutex held.
+ */
+static void udpExpireReads (struct FujiSerData *data) {
+	short i;
+
+	for (i = 0; i < MAC_FUJI_MAX_UDP; i++) {
+		struct FujiUDPStream *s = data->udpStreams[i];
+		if (s && s->readPb && s->rcvDeadline && ((long)(Ticks - s->rcvDeadline) >= 0)) {
+			UDPiopb *pb = s->readPb;
+			s->readPb = 0;
+			ippComplete ((ParmBlkPtr) pb, commandTimeout);
+		}
+	}
+}
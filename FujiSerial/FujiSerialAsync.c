@@ -28,13 +28,15 @@
 
 // Configuration options
 
-#define SANITY_CHECK      1 // Do additional error checking
+// The profile in FujiInterfaces.h sets SANITY_CHECK, USE_IPP_UDP, USE_IPP_TCP,
+// USE_EVENT_LOG, USE_HISTOGRAMS and USE_LED_INDICATORS
+
 #define USE_AOUT_EXTRAS   0
-#define USE_IPP_UDP       0
-#define USE_IPP_TCP       0
 
 #define VBL_TICKS         30 // Note, setting this to 15 can cause issues
 
+#define vT2CH             0x1200 // Offset of the VIA timer 2 high byte
+
 // Menubar "led" indicators
 
 #define LED_IDLE       ind_hollow
@@ -43,8 +45,17 @@
 #define LED_WRONG_TAG  ind_ring
 #define LED_ERROR      ind_cross
 
-#define VBL_WRIT_INDICATOR(symb) drawIndicatorAt (496, 1, symb);
-#define VBL_READ_INDICATOR(symb) drawIndicatorAt (496, 9, symb);
+// The indicators only record the state here; the VBL task draws them,
+// and then only when they have changed since they were last drawn.
+
+#if USE_LED_INDICATORS
+	#define VBL_WRIT_INDICATOR(symb) data->ledWrit = symb;
+	#define VBL_READ_INDICATOR(symb) data->ledRead = symb;
+	#define LED_UNKNOWN    0xFF // Forces the next draw
+#else
+	#define VBL_WRIT_INDICATOR(symb)
+	#define VBL_READ_INDICATOR(symb)
+#endif
 
 // Driver flags and prototypes
 
@@ -91,6 +102,7 @@ void main() {
 		dc.w    @DStatus  + 14                     ; status offset
 		dc.w    @DClose   + 16                     ; close offset
 		dc.b    "\p.Fuji"                          ; driver name
+		dc.w    0                                  ; room for ".Fuji2" to ".Fuji4"
 
 		// Driver Dispatch: "Inside Macintosh: Devices", p I-29
 
@@ -162,7 +174,123 @@ void main() {
 	}
 }
 
-#include "LedIndicators.h" // Don't put this above main as it genererates code
+#if USE_LED_INDICATORS
+	#include "LedIndicators.h" // Don't put this above main as it genererates code
+
+	/* Draws the menubar indicators that have changed. This is only called from
+	 * the VBL task, so the screen is written at most once per VBL interval no
+	 * matter how many transactions complete in between.
+	 */
+
+	static void drawIndicators (struct FujiSerData *data) {
+		if (data->ledWrit != data->ledWritShown) {
+			data->ledWritShown = data->ledWrit;
+			drawIndicatorAt (496, 1, data->ledWrit);
+		}
+		if (data->ledRead != data->ledReadShown) {
+			data->ledReadShown = data->ledRead;
+			drawIndicatorAt (496, 9, data->ledRead);
+		}
+	}
+#endif
+
+#if USE_IPP
+	/* Completes a MacTCP call. As with MacTCP, the completion routine is given
+	 * the parameter block both in A0 and on the stack.
+	 */
+	static void ippComplete (ParmBlkPtr pb, OSErr err) {
+		pb->ioParam.ioResult = err;
+		if (pb->ioParam.ioCompletion) {
+			asm {
+				movea.l pb,a0
+				move.l  a0,-(sp)
+				movea.l IOParam.ioCompletion(a0),a1
+				jsr     (a1)
+				addq    #4,sp
+			}
+		}
+	}
+#endif
+
+#if USE_IPP_TCP
+	#include "FujiMacTCP.h"
+#endif
+
+#if USE_IPP_UDP
+	#include "FujiMacUDP.h"
+#endif
+
+#if USE_IPP
+	/* Runs the MacTCP calls that were queued by doControl and expires calls
+	 * that have timed out. Called by the VBL task with the mutex held.
+	 */
+	static void ippRunQueue (struct FujiSerData *data) {
+		CntrlParam *pb;
+
+		while ((pb = (CntrlParam*) data->ippQueue.qHead) != NULL) {
+			OSErr err = invalidStreamPtr;
+			Dequeue ((QElemPtr) pb, &data->ippQueue);
+			#if USE_IPP_UDP
+				if (pb->csCode < TCPCreate) {
+					err = udpExecute (data, (UDPiopb*) pb);
+				}
+			#endif
+			#if USE_IPP_TCP
+				if (pb->csCode >= TCPCreate) {
+					err = tcpExecute (data, (TCPiopb*) pb);
+				}
+			#endif
+			if (err != ioInProgress) {
+				ippComplete ((ParmBlkPtr) pb, err);
+			}
+		}
+		#if USE_IPP_UDP
+			udpExpireReads (data);
+		#endif
+		#if USE_IPP_TCP
+			tcpExpireReceives (data);
+		#endif
+	}
+
+	static void ippMessageIn (struct FujiSerData *data, unsigned char chan, unsigned char cmd, Ptr payload, short len) {
+		#if USE_IPP_UDP
+			udpMessageIn (data, chan, cmd, payload, len);
+		#endif
+		#if USE_IPP_TCP
+			tcpMessageIn (data, chan, cmd, payload, len);
+		#endif
+	}
+
+	static Boolean ippFillWriteBuffer (struct FujiSerData *data) {
+		#if USE_IPP_UDP
+			if (udpFillWriteBuffer (data)) return true;
+		#endif
+		#if USE_IPP_TCP
+			if (tcpFillWriteBuffer (data)) return true;
+		#endif
+		return false;
+	}
+
+	static void ippWriteDone (struct FujiSerData *data) {
+		#if USE_IPP_UDP
+			udpWriteDone (data);
+		#endif
+		#if USE_IPP_TCP
+			tcpWriteDone (data);
+		#endif
+	}
+
+	static Boolean ippWantsService (struct FujiSerData *data) {
+		if (data->ippQueue.qHead) return true;
+		#if USE_IPP_UDP
+			if (udpWantsService (data)) return true;
+		#endif
+		#if USE_IPP_TCP
+			if (tcpWantsService (data)) return true;
+		#endif
+		return false;
+	}
+#endif
 
 /********** Completion and VBL Routines **********/
 
@@ -304,6 +432,63 @@ static struct DriverInfo *getDriverInfo (struct FujiSerData *data, short dCtlRef
 	return info;
 }
 
+/* Adds an event to the log. The log is written both from interrupts and from
+ * Read/Write calls, so an event may occasionally be lost when an interrupt
+ * lands in the middle of this; this is good enough for diagnostics. Only
+ * the high byte of the VIA timer is read, as reading the low byte would
+ * clear its interrupt flag.
+ */
+
+#if USE_EVENT_LOG
+	static void logEvent (struct FujiSerData *data, unsigned char event, unsigned char chan, short arg) {
+		struct FujiLogEvent *e = &data->log[data->logCount++ & (FUJI_LOG_SIZE - 1)];
+		e->ticks = Ticks;
+		e->timer = VIABase[vT2CH];
+		e->event = event;
+		e->chan  = chan;
+		e->arg   = arg;
+	}
+	#define LOG_EVENT(data, event, chan, arg) logEvent (data, event, chan, arg)
+#else
+	#define LOG_EVENT(data, event, chan, arg)
+#endif
+
+/* Counts a value in a log2 histogram */
+
+#if USE_HISTOGRAMS
+	static void histAdd (unsigned long *hist, unsigned long value) {
+		short bucket = 0;
+		while (value && (bucket < FUJI_HIST_BUCKETS - 1)) {
+			value >>= 1;
+			bucket++;
+		}
+		hist[bucket]++;
+	}
+
+	/* Works out the bytes per second once at least a second has gone by */
+
+	static void updateRates (struct FujiSerData *data) {
+		const unsigned long now     = Ticks;
+		const unsigned long elapsed = now - data->rateTicks;
+		if (elapsed >= 60) {
+			data->hist.readRate  = (data->bytesRead    - data->rateRead)    * 60 / elapsed;
+			data->hist.writeRate = (data->bytesWritten - data->rateWritten) * 60 / elapsed;
+			data->rateTicks      = now;
+			data->rateRead       = data->bytesRead;
+			data->rateWritten    = data->bytesWritten;
+		}
+	}
+
+	#define HIST_COUNT(data, field)  data->hist.field++
+	#define HIST_IO_START(data)      data->ioStarted = Ticks
+	#define HIST_IO_DONE(data, len)  {histAdd (data->hist.ioTicks, Ticks - data->ioStarted); \
+	                                  histAdd (data->hist.ioBytes, len);}
+#else
+	#define HIST_COUNT(data, field)
+	#define HIST_IO_START(data)
+	#define HIST_IO_DONE(data, len)
+#endif
+
 /* Wakes up all "FujiNet" drivers to give them a chance to complete queued I/O */
 
 static void wakeDriversAndReleaseMutex (struct FujiSerData *data) {
@@ -319,13 +504,38 @@ static void wakeDriversAndReleaseMutex (struct FujiSerData *data) {
 
 		if (pb) {
 			const OSErr err = doPrime (pb, dce);
+			LOG_EVENT (data, FUJI_EV_WAKEUP, ~pb->ioRefNum, err);
 			if (err != ioInProgress) {
+				#if USE_HISTOGRAMS
+					histAdd (data->hist.waitTicks, Ticks - info->pendingSince);
+				#endif
 				ioIsComplete (dce, err);
 			}
 		}
 	}
 	data->inWakeUp = false;
 	releaseVblMutex ();
+
+	#if USE_IPP
+		if (ippWantsService (data)) {
+			schedVBLTask ();
+		}
+	#endif
+}
+
+/* Returns true if there is room to take in another block of serial data.
+ * Without a receive buffer, that is only once the last block has been
+ * read out of the payload; with one, as long as a full payload will fit.
+ */
+
+static Boolean readBufferHasRoom (struct FujiSerData *data) {
+	const long unread = data->readStorage.ioReqCount - data->readStorage.ioActCount;
+	#if USE_PORT_BUFFERS
+		if (data->rxBuf) {
+			return data->rxSize - unread >= NELEMENTS(data->readData.payload);
+		}
+	#endif
+	return unread == 0;
 }
 
 static void fillReadBuffer (struct FujiSerData *data) {
@@ -333,81 +543,145 @@ static void fillReadBuffer (struct FujiSerData *data) {
 	data->conn.iopb.ioBuffer     = (Ptr) &data->readData;
 	data->conn.iopb.ioCompletion = (IOCompletionUPP) complReadIn;
 	VBL_READ_INDICATOR (LED_ASYNC_IO);
+	LOG_EVENT (data, FUJI_EV_READ_START, 0, 0);
+	HIST_IO_START (data);
 	PBReadAsync ((ParmBlkPtr)&data->conn.iopb);
 }
 
 static void fillReadBufDone (IOParam *pb) {
 	struct FujiSerData *data = (struct FujiSerData *)pb->ioMisc;
+	struct StorageSpec *rx = &data->readStorage;
 	long indicator = LED_ERROR;
 
 	if (pb->ioResult == noErr) {
 
 		if (data->readData.id == MAC_FUJI_REPLY_TAG) {
-			// The Pico will always report the total available bytes, even
-			// when the maximum message size is 500. Store the number of bytes
-			// in the read buffer in readLeft, with the overflow in readAvail.
-
-			if (data->readData.avail > NELEMENTS(data->readData.payload)) {
-				data->readExtraAvail         = data->readData.avail - NELEMENTS(data->readData.payload);
-				data->readStorage.ioReqCount = NELEMENTS(data->readData.payload);
-			} else {
-				data->readStorage.ioReqCount = data->readData.avail;
-				data->readExtraAvail         = 0;
+			const short length = MIN (data->readData.length, NELEMENTS(data->readData.payload));
+
+			HIST_IO_DONE (data, length);
+
+			if (rx->ioBuffer == data->readData.payload) {
+				rx->ioReqCount = 0;
+				rx->ioActCount = 0;
+			} else if (rx->ioActCount > 0) {
+				// Keep what is left in the receive buffer, moving it to
+				// the front so that the new payload can go after it.
+				BlockMove (rx->ioBuffer + rx->ioActCount, rx->ioBuffer, rx->ioReqCount - rx->ioActCount);
+				rx->ioReqCount -= rx->ioActCount;
+				rx->ioActCount  = 0;
 			}
-			data->readStorage.ioActCount = 0;
+			data->readExtraAvail = 0;
+
+			if (data->readData.chan == MAC_FUJI_CHAN_SERIAL) {
+				// The Pico will always report the total available bytes, even
+				// when the maximum message size is 500. Store the number of bytes
+				// in the read buffer in ioReqCount, with the overflow in readExtraAvail.
+
+				if (rx->ioBuffer != data->readData.payload) {
+					BlockMove (data->readData.payload, rx->ioBuffer + rx->ioReqCount, length);
+				}
+				rx->ioReqCount += length;
+				if (data->readData.avail > length) {
+					data->readExtraAvail = data->readData.avail - length;
+				}
+			}
+			#if USE_IPP
+				else {
+					ippMessageIn (data, data->readData.chan, data->readData.cmd, data->readData.payload, length);
+
+					// Other channels may have data waiting, so check back soon
+					schedVBLTask ();
+				}
+			#endif
 
 			indicator = LED_IDLE;
 		}
 		else {
 			indicator = LED_WRONG_TAG;
 			pb->ioResult = -1;
+			HIST_COUNT (data, badTags);
 		}
 	}
+	if (pb->ioResult != noErr) {
+		HIST_COUNT (data, ioErrors);
+	}
 	VBL_READ_INDICATOR (indicator);
+	LOG_EVENT (data, FUJI_EV_READ_DONE, data->readData.chan,
+		(pb->ioResult == noErr) ? data->readData.length : pb->ioResult);
 	wakeDriversAndReleaseMutex (data);
 }
 
-static void emptyWriteBuffer(struct FujiSerData *data) {
-	/* Figure out the source value:
-	 * -6 or -7  => 1
-	 * -8 or -9  => 2
-	 * otherwise => 3
-	 */
-	//short src = ((~devCtlEnt->dCtlRefNum) - 5) >> 1;
-	//if (src > 1) src = 3;
+/* Sends the write buffer to the FujiNet device. The channel, command
+ * and length must already have been filled in.
+ */
 
+static void flushWriteBuffer(struct FujiSerData *data) {
 	data->conn.iopb.ioMisc       = (Ptr) data;
 	data->conn.iopb.ioBuffer     = (Ptr) &data->writeData;
 	data->conn.iopb.ioCompletion = (IOCompletionUPP)complFlushOut;
 
 	data->writeData.id           = MAC_FUJI_REQUEST_TAG;
-	data->writeData.src          = 0;
-	data->writeData.dst          = 0;
 	data->writeData.reserved     = 0;
-	data->writeData.length       = data->writeStorage.ioActCount;
 
 	VBL_WRIT_INDICATOR (LED_ASYNC_IO);
+	LOG_EVENT (data, FUJI_EV_WRITE_START, data->writeData.chan, data->writeData.length);
+	HIST_IO_START (data);
 	PBWriteAsync ((ParmBlkPtr)&data->conn.iopb);
 }
 
+static void emptyWriteBuffer(struct FujiSerData *data) {
+	struct StorageSpec *tx = &data->writeStorage;
+
+	data->writeData.chan         = MAC_FUJI_CHAN_SERIAL;
+	data->writeData.cmd          = MAC_FUJI_CMD_DATA;
+	if (tx->ioBuffer == data->writeData.payload) {
+		data->writeData.length   = tx->ioActCount;
+	} else {
+		// Send as much as fits in one block, keeping the rest for the next
+		const long length = MIN (tx->ioActCount, NELEMENTS(data->writeData.payload));
+		BlockMove (tx->ioBuffer, data->writeData.payload, length);
+		BlockMove (tx->ioBuffer + length, tx->ioBuffer, tx->ioActCount - length);
+		tx->ioActCount          -= length;
+		data->writeData.length   = length;
+	}
+	flushWriteBuffer (data);
+}
+
 /* Called after an asynchronous write to the FujiNet device has completed */
 
 static void emptyWriteBufDone (IOParam *pb) {
 	struct FujiSerData *data = (struct FujiSerData *)pb->ioMisc;
 	long wrIndicator = LED_ERROR;
 
+	LOG_EVENT (data, FUJI_EV_WRITE_DONE, data->writeData.chan, pb->ioResult);
+
 	if (pb->ioResult == noErr) {
-		data->writeStorage.ioActCount = 0;
-		wrIndicator                   = LED_IDLE;
+		HIST_IO_DONE (data, data->writeData.length);
+
+		if (data->writeData.chan == MAC_FUJI_CHAN_SERIAL) {
+			// With a transmit buffer, the block was taken out of it when sent
+			if (data->writeStorage.ioBuffer == data->writeData.payload) {
+				data->writeStorage.ioActCount = 0;
+			}
+		}
+		#if USE_IPP
+			else {
+				ippWriteDone (data);
+			}
+		#endif
+		wrIndicator = LED_IDLE;
 
-		if (data->readStorage.ioActCount == data->readStorage.ioReqCount) {
+		if (readBufferHasRoom (data)) {
 			VBL_WRIT_INDICATOR (wrIndicator);
 
-			// After writing data, immediately do a read if the buffer is empty
+			// After writing data, immediately do a read if the buffer has room
 			fillReadBuffer (data);
 			return;
 		}
 	} // pb->ioResult == noErr
+	else {
+		HIST_COUNT (data, ioErrors);
+	}
 
 	VBL_WRIT_INDICATOR (wrIndicator);
 	wakeDriversAndReleaseMutex (data);
@@ -427,13 +701,33 @@ static void fujiVBLTask (VBLTask *vbl) {
 
 	vbl->vblCount    = data->vblCount;
 
+	LOG_EVENT (data, FUJI_EV_VBL, 0, 0);
+
+	#if USE_HISTOGRAMS
+		updateRates (data);
+	#endif
+
+	#if USE_LED_INDICATORS
+		drawIndicators (data);
+	#endif
+
 	if (takeVblMutex()) {
+		#if USE_IPP
+			ippRunQueue (data);
+		#endif
+
 		if (data->conn.iopb.ioResult == noErr) {
 			if (data->writeStorage.ioActCount > 0) {
 				emptyWriteBuffer(data);
 				return;
 			}
-			else if (data->readStorage.ioActCount == data->readStorage.ioReqCount) {
+			#if USE_IPP
+				else if (ippFillWriteBuffer (data)) {
+					flushWriteBuffer (data);
+					return;
+				}
+			#endif
+			else if (readBufferHasRoom (data)) {
 				fillReadBuffer (data);
 				return;
 			}
@@ -441,12 +735,15 @@ static void fujiVBLTask (VBLTask *vbl) {
 
 		wakeDriversAndReleaseMutex (data);
 	} // takeVblMutex
+	else {
+		LOG_EVENT (data, FUJI_EV_CONTENDED, 0, 0);
+	}
 }
 
 /********** Device driver routines **********/
 
 static OSErr doControl (CntrlParam *pb, DCtlEntry *devCtlEnt) {
-	//struct FujiSerData *data = *(FujiSerDataHndl)devCtlEnt->dCtlStorage;
+	struct FujiSerData *data = *(FujiSerDataHndl)devCtlEnt->dCtlStorage;
 
 	#if USE_AOUT_EXTRAS
 		if (pb->csCode == 8) {
@@ -510,77 +807,23 @@ static OSErr doControl (CntrlParam *pb, DCtlEntry *devCtlEnt) {
 			// .AOut Serial Hardware Reset
 		}
 	#endif
-	#if USE_IPP_UDP
-		if (pb->csCode == UDPCreate) { // 20
-			// .IPP UDPCreate: Opens a UDP stream
-		}
-		else if (pb->csCode == UDPRead) { // 21
-			// .IPP UDPRead: Retreives a datagram
-		}
-		else if (pb->csCode == UDPBfrReturn) { // 22
-			// .IPP UDPBfrReturn: Returns receive buffer
-		}
-		else if (pb->csCode == UDPWrite) { // 23
-			// .IPP UDPWrite: Sends a datagram
-		}
-		else if (pb->csCode == UDPRelease) { // 24
-			// .IPP UDPRelease: Closes a UDP stream
-		}
-		else if (pb->csCode == UDPMaxMTUSize) { // 25
-			// .IPP UDPMaxMTUSize: Returns the maximum size of an unfragmented datagram
+	#if USE_IPP
+		if (((pb->csCode >= UDPCreate) && (pb->csCode <= UDPMultiRead) && USE_IPP_UDP) ||  // 20-29
+			((pb->csCode >= TCPCreate) && (pb->csCode <= TCPGlobalInfo) && USE_IPP_TCP)) { // 30-43
+			// .IPP UDP and TCP calls: Take the call off the driver queue, so that more
+			// than one may be outstanding, and let the VBL task carry it out.
+			// The call is completed later by ippComplete, not by IODone.
+			pb->ioResult = ioInProgress;
+			Dequeue ((QElemPtr) pb, &devCtlEnt->dCtlQHdr);
+			devCtlEnt->dCtlFlags &= ~drvrActiveMask;
+			Enqueue ((QElemPtr) pb, &data->ippQueue);
+			schedVBLTask ();
+			return ioInProgress;
 		}
-		else if (pb->csCode == UDPMaxMTUSize) { // 26
-			// .IPP UDPStatus: Undocumented
-		}
-		else if (pb->csCode == UDPMultiCreate) { // 27
-			// .IPP UDPMultiCreate: Creates UDP connections on a consecutive series of ports
-		}
-		else if (pb->csCode == UDPMultiSend) { // 28
-			// .IPP UDPMultiSend: Sends a datagram from a specified port
-		}
-		else if (pb->csCode == UDPMultiRead) { // 29
-			// .IPP UDPMultiRead: Receives data from a port created with the UDPMultiCreate
-		}
-	#endif
-	#if USE_IPP_TCP
-		if (pb->csCode == TCPCreate) { // 30
-			// .IPP TCPCreate: Opens a TCP stream
-		}
-		else if (pb->csCode == TCPPassiveOpen) { // 31
-			// .IPP TCPPassiveOpen: Listens for incoming connections
-		}
-		else if (pb->csCode == TCPActiveOpen) { // 32
-			// .IPP TCPActiveOpen: Initiates an outgoing connection
-		}
-		else if (pb->csCode == TCPSend) { // 34
-			// .IPP TCPSend: Sends data over the connection
-		}
-		else if (pb->csCode == TCPNoCopyRcv) { // 35
-			// .IPP TCPNoCopyRcv: Receives data without copying
-		}
-		else if (pb->csCode == TCPRcvBfrReturn) { // 36
-			// .IPP TCPRcvBfrReturn: Returns buffers from TCPNoCopyRcv
-		}
-		else if (pb->csCode == TCPRcv) { // 37
-			// .IPP TCPRcv: Receives data and copy to user buffers
-		}
-		else if (pb->csCode == TCPClose) { // 38
-			// .IPP TCPClose: Signals user has no more data to send on connection
-		}
-		else if (pb->csCode == TCPAbort) { // 39
-			// .IPP TCPAbort: Terminates a connection without attempting to send all outstanding data
-		}
-		else if (pb->csCode == TCPStatus) { // 40
-			// .IPP TCPStatus: Gather information about a specific connection
-		}
-		else if (pb->csCode == TCPExtendedStat) { // 41
-			// .IPP TCPExtendedStat: Undocumented
-		}
-		else if (pb->csCode == TCPRelease) { // 42
-			// .IPP TCPRelease: Closes a TCP stream
-		}
-		else if (pb->csCode == TCPGlobalInfo) { // 43
-			// .IPP TCPGlobalInfo: Retreive TCP parameters
+		else if (pb->csCode == ipctlGetAddr) { // 15
+			// .IPP ipctlGetAddr: Returns our IP address, as last reported by the far side
+			((GetAddrParamBlock*) pb)->ourAddress = data->ippLocalHost;
+			((GetAddrParamBlock*) pb)->ourNetMask = 0;
 		}
 	#endif
 
@@ -618,6 +861,35 @@ static OSErr doStatus (CntrlParam *pb, DCtlEntry *devCtlEnt) {
 			// .AOut Serial Driver Version
 		}
 	#endif
+	#if USE_HISTOGRAMS
+		else if (pb->csCode == FUJI_CS_STATS) {
+
+			// Copy the byte counts and histograms to the caller's buffer
+
+			struct FujiStats *stats = *(struct FujiStats **) &pb->csParam[0];
+			stats->bytesRead    = data->bytesRead;
+			stats->bytesWritten = data->bytesWritten;
+			stats->pollTicks    = data->vblCount;
+			stats->hist         = data->hist;
+		}
+	#endif
+	#if USE_EVENT_LOG
+		else if (pb->csCode == FUJI_CS_EVENT_LOG) {
+
+			// Copy the most recent events, oldest first, to the caller's buffer
+
+			struct FujiLogEvent *dst = *(struct FujiLogEvent **) &pb->csParam[0];
+			const unsigned long count = data->logCount;
+			const short n = MIN (count, FUJI_LOG_SIZE);
+			short i;
+
+			for (i = 0; i < n; i++) {
+				dst[i] = data->log[(count - n + i) & (FUJI_LOG_SIZE - 1)];
+			}
+			pb->csParam[2] = n;
+			*(unsigned long *) &pb->csParam[3] = count;
+		}
+	#endif
 	//HUnlock (data->fuji);
 	//HUnlock (devCtlEnt->dCtlStorage);
 	//HUnlock ((Handle)devCtlEnt->dCtlDriver);
@@ -665,7 +937,7 @@ static void bufferCopy (struct StorageSpec *src, struct StorageSpec *dst) {
 	}
 
 	#if SANITY_CHECK
-		if (dstLeft > 500) {
+		if (dstLeft > FUJI_PORT_BUF_MAX) {
 			SysBeep(10);
 			dstLeft = 0;
 		}
@@ -700,7 +972,12 @@ static OSErr doPrime (IOParam *pb, DCtlEntry *devCtlEnt) {
 				dst = &data->writeStorage;
 			}
 			if (src) {
+				const long before = pb->ioActCount;
 				bufferCopy (src, dst);
+				if (pb->ioActCount != before) {
+					LOG_EVENT (data, (cmd == aWrCmd) ? FUJI_EV_COPY_IN : FUJI_EV_COPY_OUT,
+						~pb->ioRefNum, pb->ioActCount - before);
+				}
 			}
 			if (pb->ioActCount == pb->ioReqCount) {
 				err = noErr;
@@ -716,12 +993,19 @@ static OSErr doPrime (IOParam *pb, DCtlEntry *devCtlEnt) {
 			releaseVblMutex();
 		}
 	} // data->inWakeUp || takeVblMutex()
+	else {
+		LOG_EVENT (data, FUJI_EV_CONTENDED, ~pb->ioRefNum, 1);
+	}
 
 	if (err == ioInProgress) {
 		// Make a record that we are suspended so we can get awoken
 		struct DriverInfo *info = getDriverInfo (data, pb->ioRefNum);
 		info->pendingDce = devCtlEnt;
 		info->pendingPb  = pb;
+		if (!data->inWakeUp) {
+			info->pendingSince = Ticks;
+			LOG_EVENT (data, FUJI_EV_SUSPEND, ~pb->ioRefNum, pb->ioReqCount - pb->ioActCount);
+		}
 		schedVBLTask();
 	}
 
@@ -759,6 +1043,11 @@ static OSErr doOpen (IOParam *pb, DCtlEntry *dce) {
 		data->vblCount = VBL_TICKS;
 	}
 
+	#if USE_LED_INDICATORS
+		data->ledReadShown = LED_UNKNOWN;
+		data->ledWritShown = LED_UNKNOWN;
+	#endif
+
 	data->readStorage.ioBuffer    = data->readData.payload;
 	data->readStorage.ioReqCount  = 0;
 	data->readStorage.ioActCount  = 0;
@@ -767,6 +1056,17 @@ static OSErr doOpen (IOParam *pb, DCtlEntry *dce) {
 	data->writeStorage.ioReqCount = NELEMENTS(data->writeData.payload);
 	data->writeStorage.ioActCount = 0;
 
+	#if USE_PORT_BUFFERS
+		// Use the serial buffers allocated when the port was redirected
+		if (data->rxBuf) {
+			data->readStorage.ioBuffer    = data->rxBuf;
+		}
+		if (data->txBuf) {
+			data->writeStorage.ioBuffer   = data->txBuf;
+			data->writeStorage.ioReqCount = data->txSize;
+		}
+	#endif
+
 	fujiStartVBL (dce);
 
 	return noErr;
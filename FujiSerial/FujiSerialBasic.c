@@ -83,6 +83,7 @@ void main() {
 		dc.w    @DStatus  + 14                     ; status offset
 		dc.w    @DClose   + 16                     ; close offset
 		dc.b    "\p.Fuji"                          ; driver name
+		dc.w    0                                  ; room for ".Fuji2" to ".Fuji4"
 
 		// Driver Dispatch: "Inside Macintosh: Devices", p I-29
 
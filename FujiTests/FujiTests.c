@@ -75,6 +75,15 @@ static OSErr openFujiNet() {
 	return err;
 }
 
+static OSErr openFujiNetOnDrive() {
+	short drive;
+	OSErr err;
+	printf("Drive number: ");
+	scanf("%d", &drive);
+	err = fujiSerialOpen (drive); CHECK_ERR;
+	return err;
+}
+
 static OSErr printUnitTable() {
 	short i, lines = 0;
 	Handle *table = (Handle*) UTableBase;
@@ -132,8 +141,22 @@ static OSErr printUnitTable() {
 	}
 }
 
+/* Prints a log2 histogram as a row of counts, one per bucket */
+
+static void printHistogram (const char *title, const unsigned long *hist) {
+	short i;
+	printf("%-16s", title);
+	for (i = 0; i < FUJI_HIST_BUCKETS; i++) {
+		printf(" %5ld", hist[i]);
+	}
+	printf("\n");
+}
+
 static OSErr printDriverStatus() {
 	unsigned long bytesRead, bytesWritten;
+	struct FujiStats stats;
+	long codeBytes, dataBytes;
+	short i;
 
 	printf("\n");
 	printf("Fuji status:          %s\n", isFujiConnected()       ? "connected" : "not connected");
@@ -148,8 +171,26 @@ static OSErr printDriverStatus() {
 			printf("Magic sector:         %ld\n", (*data)->conn.iopb.ioPosOffset / 512);
 		}
 
+		fujiSerialHeapUsage (&codeBytes, &dataBytes);
+		printf("Build profile:        %d\n", FUJI_PROFILE);
+		printf("System heap used:     %ld bytes of code, %ld bytes of data\n", codeBytes, dataBytes);
+
 		printf("Total bytes read:     %ld\n", bytesRead);
 		printf("Total bytes written:  %ld\n", bytesWritten);
+
+		if (fujiSerialGetStats (&stats)) {
+			printf("Bytes/sec read:       %ld\n", stats.hist.readRate);
+			printf("Bytes/sec written:    %ld\n\n", stats.hist.writeRate);
+
+			printf("%-16s", "Up to:");
+			for (i = 0; i < FUJI_HIST_BUCKETS - 1; i++) {
+				printf(" %5ld", (1L << i) - 1);
+			}
+			printf("  more\n");
+			printHistogram ("Block I/O ticks:", stats.hist.ioTicks);
+			printHistogram ("Block bytes:",     stats.hist.ioBytes);
+			printHistogram ("Suspended ticks:", stats.hist.waitTicks);
+		}
 	} else {
 		printf("Cannot get status\n");
 	}
@@ -179,6 +220,79 @@ static OSErr setVBLFrequency() {
 	}
 }
 
+/* Saves the driver event log to "FujiNet.log" on the default volume, for
+ * analysis with "mac_ndev_log" on the Linux host. The file holds a small
+ * header followed by the events, oldest first, exactly as the driver
+ * stores them.
+ */
+
+static OSErr dumpEventLog() {
+	#if USE_EVENT_LOG
+		if (isFujiModemRedirected()) {
+			OSErr err;
+			short sInputRefNum, fRefNum;
+			CntrlParam pb;
+			long count;
+			struct {
+				OSType         id;
+				short          version;
+				short          eventSize;
+				short          events;
+				unsigned long  logged;
+			} header;
+			struct FujiLogEvent *log = (struct FujiLogEvent *) NewPtr (FUJI_LOG_SIZE * sizeof (struct FujiLogEvent));
+
+			if (log == NULL) {
+				printf("Not enough memory\n");
+				return memFullErr;
+			}
+
+			err = OpenDriver(MODEM_IN__NAME, &sInputRefNum); ON_ERROR(goto done);
+
+			pb.ioCRefNum = sInputRefNum;
+			pb.csCode    = FUJI_CS_EVENT_LOG;
+			*(struct FujiLogEvent **) &pb.csParam[0] = log;
+			err = PBStatusSync ((ParmBlkPtr)&pb);
+			CloseDriver(sInputRefNum);
+			ON_ERROR(goto done);
+
+			header.id        = 'FLOG';
+			header.version   = 1;
+			header.eventSize = sizeof (struct FujiLogEvent);
+			header.events    = pb.csParam[2];
+			header.logged    = *(unsigned long *) &pb.csParam[3];
+
+			err = Create("\pFujiNet.log", 0, MAC_FUJI_CREATOR, 'BINA');
+			if (err == dupFNErr) err = noErr;
+			ON_ERROR(goto done);
+
+			err = FSOpen("\pFujiNet.log", 0, &fRefNum); ON_ERROR(goto done);
+			err = SetEOF(fRefNum, 0);
+			if (err == noErr) {
+				count = sizeof (header);
+				err = FSWrite(fRefNum, &count, &header);
+			}
+			if (err == noErr) {
+				count = header.events * sizeof (struct FujiLogEvent);
+				err = FSWrite(fRefNum, &count, log);
+			}
+			FSClose(fRefNum);
+			ON_ERROR(goto done);
+
+			printf("Saved %d of %lu events to \"FujiNet.log\"\n", header.events, header.logged);
+
+		done:
+			DisposePtr ((Ptr) log);
+			return err;
+		} else {
+			printf("Please connect to the FujiNet and redirect the serial port first\n");
+		}
+	#else
+		printf("The event log is disabled (USE_EVENT_LOG)\n");
+	#endif
+	return noErr;
+}
+
 static OSErr testFujiWrite() {
 	short sFujiRefNum;
 	ParamBlockRec pb;
@@ -285,6 +399,8 @@ static OSErr drvrHelp() {
 	printf("6: Test serial throughput with blocking I/O\n");
 	printf("7: Test serial throughput with non-blocking I/O\n");
 	printf("8: Set VBL frequency\n");
+	printf("9: Echo serial data (for mac_ndev_traffic)\n");
+	printf("a: Save driver event log (for mac_ndev_log)\n");
 	printf("q: Main menu\n");
 	return noErr;
 }
@@ -299,6 +415,8 @@ static OSErr drvrChoice(char mode) {
 		case '6': testSerialThroughput (false); break;
 		case '7': testSerialThroughput (true); break;
 		case '8': setVBLFrequency(); break;
+		case '9': testSerialEcho(); break;
+		case 'a': dumpEventLog(); break;
 		default: -1;
 	}
 	return noErr;
@@ -323,6 +441,7 @@ static OSErr fujiHelp() {
 	printf("2: Test Fuji direct write\n");
 	printf("3: Test floppy port read/write\n");
 	printf("4: Test floppy port throughput\n");
+	printf("5: Open FujiNet device on another drive\n");
 	printf("q: Main menu\n");
 	return noErr;
 }
@@ -333,13 +452,15 @@ static OSErr fujiChoice(char mode) {
 		case '2': testFujiWrite(); break;
 		case '3': testFloppyLoopback(); break;
 		case '4': testFloppyThroughput(); break;
+		case '5': openFujiNetOnDrive(); break;
 		default: -1;
 	}
 	return noErr;
 }
 
 static OSErr mtcpHelp() {
-	printf("1: Basic MacTCP test\n");
+	printf("1: MacTCP echo throughput test\n");
+	printf("2: MacTCP UDP packets per second test\n");
 	printf("q: Main menu\n");
 	return noErr;
 }
@@ -347,6 +468,7 @@ static OSErr mtcpHelp() {
 static OSErr mtcpChoice(char mode) {
 	switch(mode) {
 		case '1': testBasicTCP(); break;
+		case '2': testUDPThroughput(); break;
 		default: -1;
 	}
 	return noErr;
@@ -23,8 +23,10 @@ void printThroughput(long bytesTransfered, long timeElapsed);
 OSErr chooseDrive (void);
 
 OSErr testBasicTCP (void);
+OSErr testUDPThroughput (void);
 OSErr testSerialDriver (void);
 OSErr testSerialThroughput (Boolean useSerGet);
+OSErr testSerialEcho (void);
 OSErr testFloppyLoopback (void);
 OSErr testFloppyThroughput (void);
 OSErr readSectorAndTags (void);
\ No newline at end of file
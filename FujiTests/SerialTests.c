@@ -339,4 +339,66 @@ error:
 	KillIO(sOutputRefNum);
 	CloseDriver(sInputRefNum);
 	CloseDriver(sOutputRefNum);
-}
\ No newline at end of file
+}
+
+/* Echoes back everything received on the modem port, so that traffic
+ * generated on the Linux side (linux/mac_ndev_traffic) can make the full
+ * round trip through the Pico and the Mac. Runs until the mouse button
+ * is pressed.
+ */
+
+OSErr testSerialEcho() {
+	long availBytes, bytesEchoed = 0, startTicks;
+	short sInputRefNum, sOutputRefNum;
+	ParamBlockRec pb;
+	Handle gInputBufHandle;
+	OSErr err;
+	unsigned char msg[kMesgBufSIze];
+
+	err = OpenDriver("\p.AOut",  &sOutputRefNum); CHECK_ERR;
+	err = OpenDriver("\p.AIn",   &sInputRefNum); CHECK_ERR;
+
+	gInputBufHandle = NewHandle(kInputBufSIze);
+	HLock(gInputBufHandle);
+	err = SerSetBuf(sInputRefNum, *gInputBufHandle, kInputBufSIze); CHECK_ERR;
+
+	flushSerialInput(sInputRefNum);
+
+	printf("Echoing serial data, press the mouse button to stop\n");
+
+	startTicks = Ticks;
+	while (!Button()) {
+		err = SerGetBuf(sInputRefNum, &availBytes); ON_ERROR(goto error);
+		if (availBytes == 0) {
+			continue;
+		}
+		if (availBytes > kMesgBufSIze) {
+			availBytes = kMesgBufSIze;
+		}
+
+		pb.ioParam.ioRefNum = sInputRefNum;
+		pb.ioParam.ioBuffer  = (Ptr) msg;
+		pb.ioParam.ioReqCount = availBytes;
+		pb.ioParam.ioCompletion = 0;
+		pb.ioParam.ioVRefNum = 0;
+		pb.ioParam.ioPosMode = 0;
+		err = PBRead(&pb, false); ON_ERROR(goto error);
+
+		pb.ioParam.ioRefNum = sOutputRefNum;
+		pb.ioParam.ioReqCount = pb.ioParam.ioActCount;
+		err = PBWrite(&pb, false); ON_ERROR(goto error);
+		bytesEchoed += pb.ioParam.ioActCount;
+	}
+
+	printf("Echoed %ld bytes ... ", bytesEchoed);
+	printThroughput (2 * bytesEchoed, Ticks - startTicks);
+
+error:
+	SerSetBuf(sInputRefNum, *gInputBufHandle, 0);
+	DisposeHandle(gInputBufHandle);
+
+	KillIO(sOutputRefNum);
+	CloseDriver(sInputRefNum);
+	CloseDriver(sOutputRefNum);
+	return err;
+}
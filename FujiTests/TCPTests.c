@@ -15,6 +15,8 @@
  *   location: <http://www.gnu.org/licenses/>.                              *
  ****************************************************************************/
 
+#include <stdio.h>
+#include <string.h>
 #include <MacTCP.h>
 
 #include "FujiTests.h"
@@ -31,12 +33,180 @@ Boolean GiveTime(short sleepTime) {
 	return true;
 }
 
+static void askForEchoServer (unsigned long *remoteHost, unsigned short *remotePort) {
+	short a, b, c, d;
+	printf("Echo server IP address: ");
+	scanf("%hd.%hd.%hd.%hd", &a, &b, &c, &d);
+	printf("Echo server port: ");
+	scanf("%hu", remotePort);
+	*remoteHost = ((unsigned long)a << 24) | ((unsigned long)b << 16) | ((unsigned long)c << 8) | d;
+}
+
+/* Connects to a TCP echo server (such as one reached through the
+ * linux/mac_ndev_bridge daemon) and measures the round trip
+ * throughput for a range of message sizes.
+ */
+
+#define kTCPBufSize  8192
+#define kTCPMesgSize 1536
+
 OSErr testBasicTCP (void) {
-	unsigned long stream;
+	unsigned long stream, remoteHost;
+	long bytesRead, bytesWritten, startTicks, endTicks;
+	unsigned short remotePort, len;
+	short i, j;
 	OSErr err;
+	static char msg[kTCPMesgSize], reply[kTCPMesgSize];
+
+	askForEchoServer (&remoteHost, &remotePort);
 
+	DEBUG_STAGE("Initializing network");
 	err = InitNetwork (); CHECK_ERR;
 
-	err = CreateStream (&stream, 1024); CHECK_ERR;
-	err = ReleaseStream (stream); CHECK_ERR;
-}
\ No newline at end of file
+	err = CreateStream (&stream, kTCPBufSize); CHECK_ERR;
+
+	DEBUG_STAGE("Opening connection");
+	err = OpenConnection (stream, remoteHost, remotePort, 20); ON_ERROR(goto error);
+
+	for (i = 0; i < 10; i++) {
+		const short messageSize = (3 << i) >> 1;
+
+		for (j = 0; j < messageSize; j++) {
+			msg[j] = 'a' + (j % 26);
+		}
+
+		bytesRead = bytesWritten = 0;
+		startTicks = endTicks = Ticks;
+
+		// Send data for 20 seconds, waiting for each message to be echoed
+
+		while (endTicks - startTicks < 1200) {
+			err = SendData (stream, msg, messageSize, false); ON_ERROR(goto close);
+			bytesWritten += messageSize;
+
+			for (j = 0; j < messageSize; j += len) {
+				len = messageSize - j;
+				err = RecvData (stream, reply + j, &len, true); ON_ERROR(goto close);
+			}
+			bytesRead += messageSize;
+
+			if (memcmp (msg, reply, messageSize)) {
+				printf("Data verification error in %d byte message\n", messageSize);
+				goto close;
+			}
+			endTicks = Ticks;
+		}
+
+		printf("%4d byte messages: out: %6ld ; in %6ld ... ", messageSize, bytesWritten, bytesRead);
+		printThroughput (bytesRead + bytesWritten, endTicks - startTicks);
+	}
+
+close:
+	CloseConnection (stream);
+error:
+	ReleaseStream (stream);
+	return err;
+}
+
+/* Sends bursts of small datagrams to a UDP echo server (such as
+ * linux/mac_ndev_udp_echo) and counts the replies. Writes issued
+ * together are packed into a single block by the driver, so the
+ * packet rate should rise with the burst size.
+ */
+
+#define kUDPBufSize   4096
+#define kUDPMaxBurst  16
+#define kUDPMesgSize  32
+
+OSErr testUDPThroughput (void) {
+	unsigned long remoteHost, packets, startTicks, endTicks;
+	unsigned short remotePort;
+	short ippRefNum, burst, i;
+	StreamPtr stream;
+	Ptr rcvBuff;
+	OSErr err;
+	static UDPiopb   pb, sendPb[kUDPMaxBurst];
+	static wdsEntry  wds[kUDPMaxBurst][2];
+	static char      msg[kUDPMesgSize];
+
+	askForEchoServer (&remoteHost, &remotePort);
+
+	DEBUG_STAGE("Opening MacTCP driver");
+	err = OpenDriver ("\p.IPP", &ippRefNum); CHECK_ERR;
+
+	rcvBuff = NewPtr (kUDPBufSize);
+	if (rcvBuff == NULL) {
+		printf("Not enough memory\n");
+		return memFullErr;
+	}
+
+	pb.ioCRefNum                 = ippRefNum;
+	pb.csCode                     = UDPCreate;
+	pb.csParam.create.rcvBuff     = rcvBuff;
+	pb.csParam.create.rcvBuffLen  = kUDPBufSize;
+	pb.csParam.create.notifyProc  = NULL;
+	pb.csParam.create.localPort   = 0;
+	pb.csParam.create.userDataPtr = NULL;
+	err = PBControl ((ParmBlkPtr) &pb, false); ON_ERROR(goto done);
+	stream = pb.udpStream;
+
+	printf("Bound to local port %u\n", pb.csParam.create.localPort);
+
+	for (i = 0; i < kUDPMesgSize; i++) {
+		msg[i] = 'a' + (i % 26);
+	}
+
+	for (burst = 1; burst <= kUDPMaxBurst; burst <<= 1) {
+		packets    = 0;
+		startTicks = endTicks = Ticks;
+
+		// Send bursts for 20 seconds, waiting for all the echoes of each one
+
+		while (endTicks - startTicks < 1200) {
+			for (i = 0; i < burst; i++) {
+				wds[i][0].length               = kUDPMesgSize;
+				wds[i][0].ptr                  = msg;
+				wds[i][1].length               = 0;
+				sendPb[i].ioCRefNum            = ippRefNum;
+				sendPb[i].ioCompletion         = NULL;
+				sendPb[i].csCode               = UDPWrite;
+				sendPb[i].udpStream            = stream;
+				sendPb[i].csParam.send.remoteHost = remoteHost;
+				sendPb[i].csParam.send.remotePort = remotePort;
+				sendPb[i].csParam.send.wdsPtr     = (Ptr) wds[i];
+				sendPb[i].csParam.send.checkSum   = true;
+				PBControl ((ParmBlkPtr) &sendPb[i], true);
+			}
+			for (i = 0; i < burst; i++) {
+				while (sendPb[i].ioResult > 0);
+				err = sendPb[i].ioResult; ON_ERROR(goto release);
+			}
+			for (i = 0; i < burst; i++) {
+				pb.csCode                  = UDPRead;
+				pb.udpStream               = stream;
+				pb.csParam.receive.timeOut = 2;
+				err = PBControl ((ParmBlkPtr) &pb, false);
+				if (err == commandTimeout) {
+					printf("Lost a datagram\n");
+					break;
+				}
+				ON_ERROR(goto release);
+				packets++;
+
+				pb.csCode = UDPBfrReturn;
+				err = PBControl ((ParmBlkPtr) &pb, false); ON_ERROR(goto release);
+			}
+			endTicks = Ticks;
+		}
+
+		printf("Bursts of %2d: %5ld packets/sec\n", burst, (endTicks == startTicks) ? 0 : packets * 60 / (endTicks - startTicks));
+	}
+
+release:
+	pb.csCode    = UDPRelease;
+	pb.udpStream = stream;
+	PBControl ((ParmBlkPtr) &pb, false);
+done:
+	DisposePtr (rcvBuff);
+	return err;
+}
@@ -0,0 +1,700 @@
+/* Host bridge daemon for a Pico connected via USB.
+ *
+ * The Pico must be built with MAC_NDEV_USB_SERIAL_TEST and
+ * MAC_NDEV_USB_FRAMING set, so that everything it forwards from the Mac
+ * is tagged with a channel (see "mac_ndev_link.h"). This daemon takes the
+ * frames apart and connects each channel to an endpoint on this host:
+ *
+ *   - Serial channels can be exposed as a pseudo-terminal, which terminal
+ *     programs can open like a modem, or as a TCP listener.
+ *   - TCP channels (8-11) carry the Mac's MacTCP streams. The Mac sends
+ *     OPEN, DATA, CLOSE, ABORT and WINDOW messages and the daemon makes
+ *     the actual connections.
+ *   - UDP channels (16-19) carry MacTCP UDP streams. Datagrams received on
+ *     the bound port are packed several to a frame, so that a burst of them
+ *     reaches the Mac in as few floppy round trips as possible.
+ *
+ * Everything runs from one epoll loop. All descriptors are non-blocking and
+ * have an output queue; data queued while handling a batch of events is
+ * written out in one go once the batch is done, so many small frames to
+ * the Pico cost a single write() rather than one write() and tcdrain() each.
+ *
+ * Usage: mac_ndev_bridge [-d tty | -u usb] [-p chan[:link]] [-l chan:port] [-e chan]
+ *
+ *   -d tty          USB serial device of the Pico (default: /dev/ttyS3)
+ *   -u usb          Data interface of a Pico built with MAC_NDEV_USB_VENDOR,
+ *                   as "vid:pid" or a "/dev/bus/usb" node (see "mac_ndev_usbfs.h")
+ *   -p chan[:link]  Expose a serial channel as a PTY, optionally symlinked
+ *   -l chan:port    Expose a serial channel as a TCP listener on a port
+ *   -e chan         Echo data on a serial channel back to the Mac
+ *
+ * With no -p, -l or -e option, the serial channel is exposed as a PTY.
+ */
+
+#define TERMINAL        "/dev/ttyS3"
+#define MAX_QUEUED      65536   // Stop reading endpoints when the Pico falls this far behind
+#define MAX_EVENTS      32
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "mac_ndev_link.h"
+#include "mac_ndev_usbfs.h"
+
+/************************** Non-blocking descriptors *************************/
+
+enum FdKind {
+    KIND_TTY,
+    KIND_LISTEN,
+    KIND_SERIAL,
+    KIND_TCP,
+    KIND_UDP
+};
+
+static int epfd;
+
+/* A non-blocking descriptor registered with epoll, along with the data
+ * waiting to be written to it.
+ */
+struct Endpoint {
+    int         fd     = -1;
+    uint32_t    events = 0;     // Events currently registered with epoll
+    std::string out;
+
+    void attach(int newFd, FdKind kind, int index) {
+        fd     = newFd;
+        events = 0;
+        out.clear();
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        struct epoll_event ev = {};
+        ev.data.u64 = (uint64_t(kind) << 32) | uint32_t(index);
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+
+    void detach() {
+        if (fd >= 0) {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+            close(fd);
+        }
+        fd     = -1;
+        events = 0;
+        out.clear();
+    }
+
+    // Changes the events we are interested in, if they are different
+    void want(uint32_t wanted, FdKind kind, int index) {
+        if (fd < 0 || wanted == events) return;
+        struct epoll_event ev = {};
+        ev.events   = wanted;
+        ev.data.u64 = (uint64_t(kind) << 32) | uint32_t(index);
+        epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+        events = wanted;
+    }
+
+    // Writes as much of the queue as the descriptor will take; returns
+    // false on a hard error.
+    bool flush() {
+        while (!out.empty()) {
+            ssize_t n = ::send(fd, out.data(), out.size(), MSG_NOSIGNAL);
+            if (n < 0 && errno == ENOTSOCK) {
+                n = ::write(fd, out.data(), out.size());
+            }
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return true;
+                return false;
+            }
+            out.erase(0, n);
+        }
+        return true;
+    }
+};
+
+/******************************* The USB link ********************************/
+
+static Endpoint    tty;
+static FrameReader reader;
+
+static void queue_frame(uint8_t chan, uint8_t cmd, const uint8_t *payload, uint16_t len) {
+    const uint8_t hdr[MAC_NDEV_FRAME_LEN] = {chan, cmd, uint8_t(len >> 8), uint8_t(len)};
+    tty.out.append((const char*)hdr, MAC_NDEV_FRAME_LEN);
+    tty.out.append((const char*)payload, len);
+}
+
+// Splits data from an endpoint into DATA frames
+
+static void queue_data(uint8_t chan, const uint8_t *data, size_t len) {
+    while (len) {
+        const uint16_t n = std::min<size_t>(len, MAC_NDEV_MAX_PAYLOAD);
+        queue_frame(chan, MAC_NDEV_CMD_DATA, data, n);
+        data += n;
+        len  -= n;
+    }
+}
+
+static bool link_congested() {
+    return tty.out.size() > MAX_QUEUED;
+}
+
+/****************************** Serial channels ******************************/
+
+enum SerialMode {
+    SERIAL_PTY,
+    SERIAL_LISTEN,
+    SERIAL_ECHO
+};
+
+struct SerialChannel {
+    uint8_t     chan;
+    SerialMode  mode;
+    std::string link;           // Symlink to the PTY, if requested
+    int         port;           // TCP port, in listen mode
+    Endpoint    listener;
+    Endpoint    conn;           // PTY master or accepted client
+};
+
+static std::vector<SerialChannel> serial;
+
+static SerialChannel *find_serial(uint8_t chan) {
+    for (auto &s : serial) {
+        if (s.chan == chan) return &s;
+    }
+    return NULL;
+}
+
+static bool open_pty(SerialChannel &s, int index) {
+    const int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0) {
+        printf("Error creating PTY: %s\n", strerror(errno));
+        return false;
+    }
+    struct termios tio;
+    tcgetattr(fd, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(fd, TCSANOW, &tio);
+
+    const char *name = ptsname(fd);
+    if (!s.link.empty()) {
+        unlink(s.link.c_str());
+        if (symlink(name, s.link.c_str()) < 0) {
+            printf("Error creating link %s: %s\n", s.link.c_str(), strerror(errno));
+        }
+    }
+    printf("Channel %d: %s%s%s\n", s.chan, name, s.link.empty() ? "" : " -> ", s.link.c_str());
+
+    // Keep a slave descriptor open, so the master does not see a hangup
+    // every time a terminal program closes the port.
+    open(name, O_RDWR | O_NOCTTY);
+    s.conn.attach(fd, KIND_SERIAL, index);
+    return true;
+}
+
+static bool open_listener(SerialChannel &s, int index) {
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    const int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr = {};
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port        = htons(s.port);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        printf("Error listening on port %d: %s\n", s.port, strerror(errno));
+        return false;
+    }
+    printf("Channel %d: listening on port %d\n", s.chan, s.port);
+    s.listener.attach(fd, KIND_LISTEN, index);
+    s.listener.want(EPOLLIN, KIND_LISTEN, index);
+    return true;
+}
+
+static void serial_accept(int index) {
+    SerialChannel &s = serial[index];
+    const int fd = accept(s.listener.fd, NULL, NULL);
+    if (fd < 0) return;
+    if (s.conn.fd >= 0) {
+        // Only one client at a time may use a port
+        const char *busy = "Port in use\r\n";
+        write(fd, busy, strlen(busy));
+        close(fd);
+        return;
+    }
+    const int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    printf("Channel %d: client connected\n", s.chan);
+    s.conn.attach(fd, KIND_SERIAL, index);
+}
+
+static void serial_readable(int index) {
+    SerialChannel &s = serial[index];
+    uint8_t buf[4096];
+    const ssize_t n = ::read(s.conn.fd, buf, sizeof(buf));
+    if (n > 0) {
+        queue_data(s.chan, buf, n);
+    } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+        if (s.mode == SERIAL_LISTEN) {
+            printf("Channel %d: client disconnected\n", s.chan);
+            s.conn.detach();
+        }
+    }
+}
+
+static void serial_data_in(uint8_t chan, const uint8_t *data, uint16_t len) {
+    SerialChannel *s = find_serial(chan);
+    if (!s) {
+        printf("Channel %d: no endpoint, dropping %d bytes\n", chan, len);
+        return;
+    }
+    if (s->mode == SERIAL_ECHO) {
+        queue_data(chan, data, len);
+    } else if (s->conn.fd >= 0 && s->conn.out.size() < MAX_QUEUED) {
+        // When nobody has the PTY open, data piles up; drop it past a limit
+        s->conn.out.append((const char*)data, len);
+    }
+}
+
+/******************************** TCP channels *******************************/
+
+struct TcpChannel {
+    Endpoint    ep;
+    bool        connecting   = false;
+    bool        remoteClosed = false; // Remote end sent FIN, already reported
+    bool        localClosed  = false; // Mac sent CLOSE, shut down once drained
+    bool        shutDown     = false;
+    uint32_t    credit       = 0;     // Bytes the Mac can still accept
+};
+
+static TcpChannel tcp[MAC_NDEV_MAX_TCP];
+
+/* Finds the address used to reach the outside world, which the Mac will
+ * use as its own. No packets are sent by connecting a UDP socket.
+ */
+static uint32_t local_address() {
+    uint32_t host = 0;
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(0x08080808);
+    addr.sin_port        = htons(53);
+    if (fd >= 0 && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+        socklen_t addrlen = sizeof(addr);
+        getsockname(fd, (struct sockaddr*)&addr, &addrlen);
+        host = ntohl(addr.sin_addr.s_addr);
+    }
+    if (fd >= 0) close(fd);
+    return host;
+}
+
+static void queue_open_reply(uint8_t chan, uint32_t host, uint16_t port) {
+    const uint8_t reply[6] = {
+        uint8_t(host >> 24), uint8_t(host >> 16), uint8_t(host >> 8), uint8_t(host),
+        uint8_t(port >> 8), uint8_t(port)
+    };
+    queue_frame(chan, MAC_NDEV_CMD_OPEN, reply, sizeof(reply));
+}
+
+static void tcp_drop(int i, bool reset) {
+    TcpChannel &c = tcp[i];
+    if (reset && c.ep.fd >= 0) {
+        struct linger lg = {1, 0};
+        setsockopt(c.ep.fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    }
+    c.ep.detach();
+    c.connecting = c.remoteClosed = c.localClosed = c.shutDown = false;
+    c.credit = 0;
+}
+
+static void tcp_abort(int i, const char *why) {
+    printf("TCP %d: %s\n", i, why);
+    tcp_drop(i, true);
+    queue_frame(MAC_NDEV_CHAN_TCP + i, MAC_NDEV_CMD_ABORT, NULL, 0);
+}
+
+static void tcp_open(int i, const uint8_t *msg, uint16_t len) {
+    if (len < 10) {
+        tcp_abort(i, "Short OPEN message");
+        return;
+    }
+    tcp_drop(i, true);
+
+    TcpChannel &c = tcp[i];
+    struct sockaddr_in addr = {};
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(CHARS_TO_UINT32(msg[0], msg[1], msg[2], msg[3]));
+    addr.sin_port        = htons(CHARS_TO_UINT16(msg[4], msg[5]));
+
+    printf("TCP %d: Connecting to %s:%d\n", i, inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+
+    const int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        tcp_abort(i, strerror(errno));
+        return;
+    }
+    const int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    c.ep.attach(fd, KIND_TCP, i);
+    c.credit = CHARS_TO_UINT16(msg[8], msg[9]);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        tcp_abort(i, strerror(errno));
+        return;
+    }
+    c.connecting = true;
+}
+
+static void tcp_connected(int i) {
+    TcpChannel &c = tcp[i];
+    int err = 0;
+    socklen_t errlen = sizeof(err);
+    getsockopt(c.ep.fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+    if (err) {
+        tcp_abort(i, strerror(err));
+        return;
+    }
+    c.connecting = false;
+
+    struct sockaddr_in local = {};
+    socklen_t addrlen = sizeof(local);
+    getsockname(c.ep.fd, (struct sockaddr*)&local, &addrlen);
+
+    printf("TCP %d: Connected\n", i);
+    queue_open_reply(MAC_NDEV_CHAN_TCP + i, ntohl(local.sin_addr.s_addr), ntohs(local.sin_port));
+}
+
+static void tcp_readable(int i) {
+    TcpChannel &c = tcp[i];
+    uint8_t buf[4 * MAC_NDEV_MAX_PAYLOAD];
+    const ssize_t n = recv(c.ep.fd, buf, std::min<uint32_t>(c.credit, sizeof(buf)), 0);
+    if (n > 0) {
+        c.credit -= n;
+        queue_data(MAC_NDEV_CHAN_TCP + i, buf, n);
+    } else if (n == 0) {
+        printf("TCP %d: Remote end closed\n", i);
+        c.remoteClosed = true;
+        queue_frame(MAC_NDEV_CHAN_TCP + i, MAC_NDEV_CMD_CLOSE, NULL, 0);
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        tcp_abort(i, strerror(errno));
+    }
+}
+
+static void tcp_frame(int i, const FrameReader &f) {
+    TcpChannel &c = tcp[i];
+    switch (f.cmd) {
+        case MAC_NDEV_CMD_OPEN:
+            tcp_open(i, f.payload, f.len);
+            break;
+        case MAC_NDEV_CMD_DATA:
+            if (c.ep.fd >= 0) c.ep.out.append((const char*)f.payload, f.len);
+            break;
+        case MAC_NDEV_CMD_CLOSE:
+            c.localClosed = true;
+            break;
+        case MAC_NDEV_CMD_ABORT:
+            if (c.ep.fd >= 0) printf("TCP %d: Aborted by Mac\n", i);
+            tcp_drop(i, true);
+            break;
+        case MAC_NDEV_CMD_WINDOW:
+            if (f.len >= 2) c.credit += CHARS_TO_UINT16(f.payload[0], f.payload[1]);
+            break;
+    }
+}
+
+/******************************** UDP channels *******************************/
+
+static Endpoint udp[MAC_NDEV_MAX_UDP];
+
+static void udp_open(int i, const uint8_t *msg, uint16_t len) {
+    const uint8_t chan = MAC_NDEV_CHAN_UDP + i;
+    udp[i].detach();
+
+    struct sockaddr_in addr = {};
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port        = htons(len >= 2 ? CHARS_TO_UINT16(msg[0], msg[1]) : 0);
+
+    const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        printf("UDP %d: Cannot bind port %d: %s\n", i, ntohs(addr.sin_port), strerror(errno));
+        if (fd >= 0) close(fd);
+        queue_frame(chan, MAC_NDEV_CMD_ABORT, NULL, 0);
+        return;
+    }
+    socklen_t addrlen = sizeof(addr);
+    getsockname(fd, (struct sockaddr*)&addr, &addrlen);
+    udp[i].attach(fd, KIND_UDP, i);
+
+    printf("UDP %d: Bound to port %d\n", i, ntohs(addr.sin_port));
+    queue_open_reply(chan, local_address(), ntohs(addr.sin_port));
+}
+
+// Sends each of the datagrams packed into a DATA message
+
+static void udp_send(int i, const uint8_t *msg, uint16_t len) {
+    while (len >= MAC_NDEV_UDP_HDR_LEN) {
+        const uint16_t dgramLen = CHARS_TO_UINT16(msg[6], msg[7]);
+        if (MAC_NDEV_UDP_HDR_LEN + dgramLen > len) {
+            printf("UDP %d: Truncated datagram\n", i);
+            return;
+        }
+        struct sockaddr_in addr = {};
+        addr.sin_family      = AF_INET;
+        addr.sin_addr.s_addr = htonl(CHARS_TO_UINT32(msg[0], msg[1], msg[2], msg[3]));
+        addr.sin_port        = htons(CHARS_TO_UINT16(msg[4], msg[5]));
+        if (sendto(udp[i].fd, msg + MAC_NDEV_UDP_HDR_LEN, dgramLen, 0, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            printf("UDP %d: Error from sendto: %s\n", i, strerror(errno));
+        }
+        const uint16_t padded = std::min<int>(MAC_NDEV_UDP_HDR_LEN + ((dgramLen + 1) & ~1), len);
+        msg += padded;
+        len -= padded;
+    }
+}
+
+// Packs as many waiting datagrams as will fit into each frame to the Mac
+
+static void udp_readable(int i) {
+    uint8_t frame[MAC_NDEV_MAX_PAYLOAD];
+    uint16_t len = 0;
+    for (;;) {
+        uint8_t dgram[MAC_NDEV_MAX_PAYLOAD];
+        struct sockaddr_in addr = {};
+        socklen_t addrlen = sizeof(addr);
+
+        // Peek first, so a datagram which does not fit is left for the next frame
+        const ssize_t n = recvfrom(udp[i].fd, dgram, sizeof(dgram), MSG_PEEK | MSG_TRUNC, (struct sockaddr*)&addr, &addrlen);
+        if (n < 0) break;
+        if (n > MAC_NDEV_MAX_PAYLOAD - MAC_NDEV_UDP_HDR_LEN) {
+            printf("UDP %d: Dropping %zd byte datagram\n", i, n);
+            recv(udp[i].fd, dgram, sizeof(dgram), 0);
+            continue;
+        }
+        if (len + MAC_NDEV_UDP_HDR_LEN + n > MAC_NDEV_MAX_PAYLOAD) {
+            queue_frame(MAC_NDEV_CHAN_UDP + i, MAC_NDEV_CMD_DATA, frame, len);
+            len = 0;
+        }
+        recv(udp[i].fd, dgram, sizeof(dgram), 0);
+
+        const uint32_t host = ntohl(addr.sin_addr.s_addr);
+        const uint16_t port = ntohs(addr.sin_port);
+        uint8_t *hdr = frame + len;
+        hdr[0] = host >> 24; hdr[1] = host >> 16; hdr[2] = host >> 8; hdr[3] = host;
+        hdr[4] = port >> 8;  hdr[5] = port;
+        hdr[6] = n >> 8;     hdr[7] = n;
+        memcpy(hdr + MAC_NDEV_UDP_HDR_LEN, dgram, n);
+        len = std::min<int>(len + MAC_NDEV_UDP_HDR_LEN + ((n + 1) & ~1), MAC_NDEV_MAX_PAYLOAD);
+    }
+    if (len) {
+        queue_frame(MAC_NDEV_CHAN_UDP + i, MAC_NDEV_CMD_DATA, frame, len);
+    }
+}
+
+static void udp_frame(int i, const FrameReader &f) {
+    switch (f.cmd) {
+        case MAC_NDEV_CMD_OPEN:
+            udp_open(i, f.payload, f.len);
+            break;
+        case MAC_NDEV_CMD_DATA:
+            if (udp[i].fd >= 0) udp_send(i, f.payload, f.len);
+            break;
+        case MAC_NDEV_CMD_CLOSE:
+            if (udp[i].fd >= 0) printf("UDP %d: Closed\n", i);
+            udp[i].detach();
+            break;
+    }
+}
+
+/********************************* Main loop *********************************/
+
+static void tty_readable() {
+    uint8_t buf[4096];
+    const ssize_t n = ::read(tty.fd, buf, std::min(sizeof(buf), reader.space()));
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EINTR) return;
+        printf("Error from read: %s\n", strerror(errno));
+        exit(-1);
+    }
+    if (n == 0) {
+        printf("The Pico has gone away\n");
+        exit(-1);
+    }
+    reader.add(buf, n);
+    while (reader.next()) {
+        const FrameReader &f = reader;
+        if (f.chan >= MAC_NDEV_CHAN_UDP && f.chan < MAC_NDEV_CHAN_UDP + MAC_NDEV_MAX_UDP) {
+            udp_frame(f.chan - MAC_NDEV_CHAN_UDP, f);
+        } else if (f.chan >= MAC_NDEV_CHAN_TCP && f.chan < MAC_NDEV_CHAN_TCP + MAC_NDEV_MAX_TCP) {
+            tcp_frame(f.chan - MAC_NDEV_CHAN_TCP, f);
+        } else if (f.cmd == MAC_NDEV_CMD_DATA) {
+            serial_data_in(f.chan, f.payload, f.len);
+        }
+    }
+}
+
+/* Writes out everything that was queued while handling the last batch of
+ * events, then updates which events each descriptor should wait for.
+ */
+static void flush_all() {
+    if (!tty.flush()) {
+        printf("Error writing to the Pico: %s\n", strerror(errno));
+        exit(-1);
+    }
+    tty.want(EPOLLIN | (tty.out.empty() ? 0u : uint32_t(EPOLLOUT)), KIND_TTY, 0);
+
+    const uint32_t rd = link_congested() ? 0u : uint32_t(EPOLLIN);
+
+    for (size_t i = 0; i < serial.size(); i++) {
+        SerialChannel &s = serial[i];
+        if (s.conn.fd < 0) continue;
+        if (!s.conn.flush()) {
+            s.conn.out.clear();
+        }
+        s.conn.want(rd | (s.conn.out.empty() ? 0u : uint32_t(EPOLLOUT)), KIND_SERIAL, i);
+    }
+    for (int i = 0; i < MAC_NDEV_MAX_TCP; i++) {
+        TcpChannel &c = tcp[i];
+        if (c.ep.fd < 0) continue;
+        if (c.connecting) {
+            c.ep.want(EPOLLOUT, KIND_TCP, i);
+            continue;
+        }
+        if (!c.ep.flush()) {
+            tcp_abort(i, strerror(errno));
+            continue;
+        }
+        if (c.localClosed && c.ep.out.empty() && !c.shutDown) {
+            shutdown(c.ep.fd, SHUT_WR);
+            c.shutDown = true;
+        }
+        if (c.shutDown && c.remoteClosed) {
+            printf("TCP %d: Closed\n", i);
+            tcp_drop(i, false);
+            continue;
+        }
+        const uint32_t in = (c.remoteClosed || !c.credit) ? 0 : rd;
+        c.ep.want(in | (c.ep.out.empty() ? 0u : uint32_t(EPOLLOUT)), KIND_TCP, i);
+    }
+    for (int i = 0; i < MAC_NDEV_MAX_UDP; i++) {
+        udp[i].want(rd, KIND_UDP, i);
+    }
+}
+
+static void usage() {
+    printf("Usage: mac_ndev_bridge [-d tty | -u usb] [-p chan[:link]] [-l chan:port] [-e chan]\n");
+    exit(-1);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *portname = TERMINAL;
+    const char *usbname  = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        const std::string opt = argv[i];
+        if (i + 1 >= argc) usage();
+        const std::string arg = argv[++i];
+        const size_t colon = arg.find(':');
+        SerialChannel s = {};
+        s.chan = atoi(arg.c_str());
+        if (opt == "-d") {
+            portname = argv[i];
+            continue;
+        } else if (opt == "-u") {
+            usbname = argv[i];
+            continue;
+        } else if (opt == "-p") {
+            s.mode = SERIAL_PTY;
+            if (colon != std::string::npos) s.link = arg.substr(colon + 1);
+        } else if (opt == "-l" && colon != std::string::npos) {
+            s.mode = SERIAL_LISTEN;
+            s.port = atoi(arg.c_str() + colon + 1);
+        } else if (opt == "-e") {
+            s.mode = SERIAL_ECHO;
+        } else {
+            usage();
+        }
+        if (s.chan >= MAC_NDEV_CHAN_TCP) {
+            printf("Channel %d is reserved for MacTCP\n", s.chan);
+            return -1;
+        }
+        serial.push_back(s);
+    }
+    if (serial.empty()) {
+        SerialChannel s = {};
+        s.chan = MAC_NDEV_CHAN_SERIAL;
+        s.mode = SERIAL_PTY;
+        serial.push_back(s);
+    }
+
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    signal(SIGPIPE, SIG_IGN);
+    epfd = epoll_create1(0);
+
+    int fd;
+    if (usbname) {
+        fd = open_usbfs_link(usbname);
+        if (fd < 0) return -1;
+    } else {
+        fd = open(portname, O_RDWR | O_NOCTTY);
+        if (fd < 0) {
+            printf("Error opening %s: %s\n", portname, strerror(errno));
+            return -1;
+        }
+        /*baudrate 115200, 8 bits, no parity, 1 stop bit */
+        set_interface_attribs(fd, B115200);
+    }
+    tty.attach(fd, KIND_TTY, 0);
+
+    for (size_t i = 0; i < serial.size(); i++) {
+        SerialChannel &s = serial[i];
+        if (s.mode == SERIAL_PTY    && !open_pty(s, i))      return -1;
+        if (s.mode == SERIAL_LISTEN && !open_listener(s, i)) return -1;
+        if (s.mode == SERIAL_ECHO)  printf("Channel %d: echo\n", s.chan);
+    }
+
+    flush_all();
+
+    do {
+        struct epoll_event events[MAX_EVENTS];
+        const int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            printf("Error from epoll_wait: %s\n", strerror(errno));
+            return -1;
+        }
+        for (int e = 0; e < n; e++) {
+            const FdKind   kind  = FdKind(events[e].data.u64 >> 32);
+            const int      i     = int(events[e].data.u64 & 0xFFFFFFFF);
+            const uint32_t ready = events[e].events;
+
+            switch (kind) {
+                case KIND_TTY:
+                    if (ready & EPOLLIN) tty_readable();
+                    break;
+                case KIND_LISTEN:
+                    serial_accept(i);
+                    break;
+                case KIND_SERIAL:
+                    if (serial[i].conn.fd >= 0 && (ready & (EPOLLIN | EPOLLHUP | EPOLLERR))) serial_readable(i);
+                    break;
+                case KIND_TCP:
+                    if (tcp[i].ep.fd < 0) break;
+                    if (tcp[i].connecting) {
+                        tcp_connected(i);
+                    } else if (tcp[i].credit && (ready & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                        tcp_readable(i);
+                    }
+                    break;
+                case KIND_UDP:
+                    if (udp[i].fd >= 0) udp_readable(i);
+                    break;
+            }
+        }
+        flush_all();
+    } while (1);
+}
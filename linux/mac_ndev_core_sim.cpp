@@ -0,0 +1,330 @@
+/* Host simulation of the two-core split of the Pico's serial data path.
+ *
+ * This builds "pico/mac_ndev.h" on the Linux host with MAC_NDEV_CORE1 set,
+ * so that the FIFO and the USB link are looked after by a loop on "core 1",
+ * here a thread of its own, while the main thread plays core 0: it makes
+ * the reads and writes of the magic sector the Mac would make through the
+ * DCD protocol. A third thread plays the USB host.
+ *
+ *   - The Mac and the USB host each send the other a numbered byte stream
+ *     on the serial channel. Both ends check that every byte arrives, once
+ *     and in order, so a race between the cores shows up as a data error.
+ *   - TinyUSB is replaced by a queue in each direction, with every call
+ *     into it taking "-u" microseconds, as a stand-in for the time the USB
+ *     stack takes on the Pico.
+ *   - The time core 0 spends on each magic sector access is measured. With
+ *     the split, it should stay at the cost of copying a block, whatever
+ *     the USB stack costs, where it used to include the USB work too.
+ *
+ * Built with "-DMAC_NDEV_CORE1=0", the same test runs with everything on
+ * core 0, as before, for comparison.
+ *
+ * Usage: mac_ndev_core_sim [-n sectors] [-u us] [-r bytes/s] [-v]
+ *
+ *   -n sectors  Magic sector reads and writes by the Mac (default: 20000)
+ *   -u us       Time taken by each call into the USB stack (default: 20)
+ *   -r bytes/s  Rate at which the USB host sends (default: 200000)
+ *   -v          Show the messages printed by the Pico code
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Stand-ins for the parts of the Pico SDK used by "mac_ndev.h" */
+
+#define MIN(a,b)            ((a) < (b) ? (a) : (b))
+
+static bool verbose = false;
+
+#define MAC_NDEV_HOST_SIM   1
+#ifndef MAC_NDEV_CORE1
+#define MAC_NDEV_CORE1      1
+#endif
+#define UART_ID             0
+
+static uint32_t time_us_32() {return 0x5A5A;}
+static void tight_loop_contents() {std::this_thread::yield();}
+#define mac_ndev_barrier()  std::atomic_thread_fence(std::memory_order_seq_cst)
+
+#if MAC_NDEV_CORE1
+static std::mutex poolLock;
+#define mac_ndev_pool_init()
+#define mac_ndev_pool_lock()    poolLock.lock()
+#define mac_ndev_pool_unlock()  poolLock.unlock()
+
+static void multicore_launch_core1(void (*entry)()) {
+    std::thread(entry).detach();
+}
+#endif
+
+// The disk path is not used here, but must build
+
+static void uart_putc_raw(int, char) {}
+static bool uart_is_readable(int) {return false;}
+static char uart_getc(int) {return 0;}
+static void mac_ndev_uart_rx_start(uint8_t *, uint16_t) {}
+static void mac_ndev_uart_rx_wait() {}
+static void mac_ndev_uart_tx_start(const uint8_t *, uint16_t) {}
+static bool mac_ndev_uart_tx_busy() {return false;}
+
+/* TinyUSB, as a queue in each direction between the Pico and the host */
+
+static double      usbCallUs = 20;
+static std::mutex  usbLock;
+static std::string usbToPico, usbToHost;
+
+static void usbCall() {
+    const auto until = std::chrono::steady_clock::now() + std::chrono::nanoseconds(long(usbCallUs * 1000));
+    while (std::chrono::steady_clock::now() < until) {}
+}
+
+static uint32_t tud_cdc_available() {
+    usbCall();
+    std::lock_guard<std::mutex> guard(usbLock);
+    return usbToPico.size();
+}
+
+static uint32_t tud_cdc_read(void *buf, uint32_t len) {
+    usbCall();
+    std::lock_guard<std::mutex> guard(usbLock);
+    len = std::min<size_t>(len, usbToPico.size());
+    memcpy(buf, usbToPico.data(), len);
+    usbToPico.erase(0, len);
+    return len;
+}
+
+static uint32_t tud_cdc_write(const void *buf, uint32_t len) {
+    usbCall();
+    std::lock_guard<std::mutex> guard(usbLock);
+    usbToHost.append((const char *) buf, len);
+    return len;
+}
+
+static uint32_t tud_cdc_write_flush() {usbCall(); return 0;}
+static bool     tud_cdc_connected() {return true;}
+
+static int pico_printf(const char *fmt, ...) {
+    if (!verbose) return 0;
+    va_list ap;
+    va_start(ap, fmt);
+    const int n = vprintf(fmt, ap);
+    va_end(ap);
+    return n;
+}
+
+#define printf pico_printf
+#include "../pico/mac_ndev.h"
+#undef printf
+
+#include "mac_ndev_link.h"
+
+#define NEGATIVE_LBA  0x007FFFFF
+#define DRIVE         0
+#define HEADER_LEN    12
+#define MAX_PAYLOAD   500
+
+using Clock = std::chrono::steady_clock;
+
+static double usSince(Clock::time_point t) {
+    return std::chrono::duration<double, std::micro>(Clock::now() - t).count();
+}
+
+// Checks that a numbered byte stream arrives complete and in order
+
+struct StreamCheck {
+    uint64_t next   = 0;
+    uint64_t errors = 0;
+
+    void check(const uint8_t *data, size_t len) {
+        for (size_t i = 0; i < len; i++, next++) {
+            if (data[i] != uint8_t(next * 7 + next / 251) && errors++ < 10) {
+                ::printf("Data error at byte %llu of the stream\n", (unsigned long long) next);
+            }
+        }
+    }
+};
+
+static void fillStream(uint64_t &next, uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i++, next++) data[i] = uint8_t(next * 7 + next / 251);
+}
+
+/* The USB host: sends frames on the serial channel at a steady rate, and
+ * checks the frames coming back.
+ */
+struct Host {
+    double             rate;
+    uint64_t           toSend;
+    uint64_t           sent = 0;
+    StreamCheck        received;
+    std::atomic<bool>  stop{false};
+    FrameReader        reader;
+
+    void run() {
+        const auto start = Clock::now();
+        while (!stop) {
+            const uint64_t due = std::min<uint64_t>(toSend, usSince(start) * rate / 1e6);
+            if (sent < due) {
+                uint8_t frame[MAC_NDEV_FRAME_LEN + MAX_PAYLOAD];
+                const uint16_t len = std::min<uint64_t>(MAX_PAYLOAD, due - sent);
+                frame[0] = MAC_NDEV_CHAN_SERIAL;
+                frame[1] = MAC_NDEV_CMD_DATA;
+                frame[2] = len >> 8;
+                frame[3] = len & 0xFF;
+                fillStream(sent, frame + MAC_NDEV_FRAME_LEN, len);
+                std::lock_guard<std::mutex> guard(usbLock);
+                usbToPico.append((const char *) frame, MAC_NDEV_FRAME_LEN + len);
+            }
+            std::string in;
+            {
+                std::lock_guard<std::mutex> guard(usbLock);
+                in.swap(usbToHost);
+            }
+            const uint8_t *p = (const uint8_t *) in.data();
+            size_t         n = in.size();
+            while (n) {
+                const size_t chunk = std::min(n, reader.space());
+                reader.add(p, chunk);
+                p += chunk;
+                n -= chunk;
+                while (reader.next()) {
+                    if (reader.chan == MAC_NDEV_CHAN_SERIAL && reader.cmd == MAC_NDEV_CMD_DATA) {
+                        received.check(reader.payload, reader.len);
+                    }
+                }
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
+};
+
+struct Latency {
+    std::vector<double> samples;
+
+    void add(double us) {samples.push_back(us);}
+
+    void print(const char *what) {
+        if (samples.empty()) return;
+        std::sort(samples.begin(), samples.end());
+        double total = 0;
+        for (double s : samples) total += s;
+        auto pct = [&](double p) {return samples[std::min(samples.size() - 1, size_t(p * samples.size()))];};
+        ::printf("  %-20s %8zu %9.1f %9.1f %9.1f %9.1f\n", what, samples.size(),
+            total / samples.size(), pct(0.50), pct(0.99), samples.back());
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    unsigned sectors = 20000;
+    double   rate    = 200000;
+
+    for (int i = 1; i < argc; i++) {
+        const std::string opt = argv[i];
+        if (opt == "-n" && i + 1 < argc) {
+            sectors = atoi(argv[++i]);
+        } else if (opt == "-u" && i + 1 < argc) {
+            usbCallUs = atof(argv[++i]);
+        } else if (opt == "-r" && i + 1 < argc) {
+            rate = atof(argv[++i]);
+        } else if (opt == "-v") {
+            verbose = true;
+        } else {
+            ::printf("Usage: mac_ndev_core_sim [-n sectors] [-u us] [-r bytes/s] [-v]\n");
+            return -1;
+        }
+    }
+
+    // The Mac sends as much as it reads, half a block per write on average
+    Host host;
+    host.rate   = rate;
+    host.toSend = uint64_t(sectors) * MAX_PAYLOAD / 4;
+    std::thread hostThread(&Host::run, &host);
+
+    StreamCheck received;
+    uint64_t    macSent = 0, macToSend = host.toSend;
+    Latency     readTime, writeTime;
+    uint8_t     tags[20] = {0}, block[512];
+
+    ::printf("Core 0 time per magic sector access, %s, %.0f us per USB call:\n",
+        MAC_NDEV_CORE1 ? "with the USB link on core 1" : "all on core 0", usbCallUs);
+
+    // The Mac's first read of the negative LBA sets up the connection
+    const auto start = Clock::now();
+    for (unsigned i = 0; i < sectors || received.next < host.toSend || host.received.next < macToSend; i++) {
+        if (usSince(start) > 60e6) {
+            ::printf("Timed out with %llu of %llu bytes to the Mac and %llu of %llu to the host\n",
+                (unsigned long long) received.next, (unsigned long long) host.toSend,
+                (unsigned long long) host.received.next, (unsigned long long) macToSend);
+            break;
+        }
+
+        // Write a block, when there is something left to send
+        if (macSent < macToSend) {
+            const uint16_t len = std::min<uint64_t>(macToSend - macSent, 1 + (i * 37) % MAX_PAYLOAD);
+            memset(block, 0, sizeof(block));
+            memcpy(block, "NDEV", 4);
+            block[4] = MAC_NDEV_CHAN_SERIAL;
+            block[5] = MAC_NDEV_CMD_DATA;
+            block[6] = len >> 8;
+            block[7] = len & 0xFF;
+            fillStream(macSent, block + HEADER_LEN, len);
+            const auto t = Clock::now();
+            not_mac_ndev_write(DRIVE, NEGATIVE_LBA, tags, block);
+            writeTime.add(usSince(t));
+        }
+
+        // Read a block
+        const auto t = Clock::now();
+        not_mac_ndev_read(DRIVE, NEGATIVE_LBA, tags, block);
+        readTime.add(usSince(t));
+        if (memcmp(block, "FUJI", 4) != 0) {
+            ::printf("Bad reply tag\n");
+            return 1;
+        }
+        if (block[4] == MAC_NDEV_CHAN_SERIAL && block[5] == MAC_NDEV_CMD_DATA) {
+            received.check(block + HEADER_LEN, CHARS_TO_UINT16(block[8], block[9]));
+        }
+
+        // The DCD transfer of a sector takes a few milliseconds; leave the
+        // other threads some of that time
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+    const double elapsed = usSince(start) / 1e6;
+
+    host.stop = true;
+    hostThread.join();
+
+    ::printf("                         count   avg (us)  p50 (us)  p99 (us)  max (us)\n");
+    readTime.print("Magic sector read");
+    writeTime.print("Magic sector write");
+    ::printf("\nBytes to the Mac %llu, to the host %llu, in %.1f s\n",
+        (unsigned long long) received.next, (unsigned long long) host.received.next, elapsed);
+    #if MAC_NDEV_CORE1
+        ::printf("Reads with no block ready: %lu; writes which waited for core 1: %lu\n",
+            (unsigned long) mac_ndev_empty_reads, (unsigned long) mac_ndev_ring_stalls);
+    #endif
+
+    bool failed = false;
+    if (received.errors || host.received.errors) {
+        ::printf("%llu data errors on the way to the Mac, %llu on the way to the host\n",
+            (unsigned long long) received.errors, (unsigned long long) host.received.errors);
+        failed = true;
+    }
+    if (received.next != host.toSend || host.received.next != macToSend) {
+        ::printf("Not all the data arrived\n");
+        failed = true;
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,528 @@
+/* Host simulation of the DCD disk I/O path on the Pico.
+ *
+ * This builds "pico/mac_ndev.h" on the Linux host and drives it the way
+ * the patched dcd_read() and dcd_write() loops in "command.c.patch" do,
+ * with the ESP32 replaced by a disk image in memory behind a simulated
+ * UART. It is used to check and size the sector cache, read-ahead and
+ * write-behind queue:
+ *
+ *   - Every sector read back is compared with what the Mac last wrote to
+ *     it, so a stale cache entry or read-ahead buffer after a write, or a
+ *     read which misses a write still in the queue, shows up as a data
+ *     error. Once the queue is flushed, the ESP32's disk image must match.
+ *   - The Mac's handshake and serial traffic go through the magic sector
+ *     and the negative LBA, which must never end up in the cache.
+ *   - The workload is run once for each cache size, with and without
+ *     read-ahead, printing the hit rate and the time the reads would take.
+ *   - A long sequential read shows the time per sector, which with
+ *     read-ahead should come close to the larger of the UART and floppy
+ *     times rather than their sum. The same goes for a sequential write,
+ *     with write-behind, compared with waiting for each sector.
+ *   - A write refused by a read-only disk must be reported on the next
+ *     read or write of the disk.
+ *   - Once "mac_ndev_disk_changed" is called for a swapped disk, none of
+ *     the old disk's sectors may be returned.
+ *
+ * The workload is made up to look like a Finder session: most reads go to
+ * a small set of hot sectors (the catalog and extents B-trees and the
+ * volume bitmap), with runs of file reads, some of them repeated, some
+ * writes, and serial I/O through the magic sector in between.
+ *
+ * Times are worked out on a simulated clock rather than measured. The
+ * ESP32 takes "-e" microseconds to answer each 'R' or 'W', one at a time,
+ * while sending a sector to the Mac takes "-f" microseconds, during which
+ * a DMA transfer to or from the ESP32 may carry on. The defaults are estimates,
+ * for a 512 byte sector over a 921600 baud UART plus the ESP32 storage
+ * access, and for the DCD floppy transfer.
+ *
+ * Usage: mac_ndev_disk_sim [-c sizes] [-n ops] [-s seed] [-e us] [-f us] [-v]
+ *
+ *   -c sizes  Comma-separated cache sizes in sectors (default: 0,8,16,...,256)
+ *   -n ops    Disk operations in the workload (default: 20000)
+ *   -s seed   Seed for the workload (default: 1)
+ *   -e us     ESP32 round trip per sector (default: 6000)
+ *   -f us     Floppy transfer per sector (default: 3000)
+ *   -v        Show the messages printed by the Pico code
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/* Stand-ins for the parts of the Pico SDK used by "mac_ndev.h" */
+
+#define MIN(a,b)            ((a) < (b) ? (a) : (b))
+
+static bool verbose = false;
+
+#define MAC_NDEV_HOST_SIM   1
+#define UART_ID             0
+#define BAUD_RATE           921600
+
+static double simNow = 0;           // Simulated clock, in microseconds
+
+static uint32_t tud_cdc_available() {return 0;}
+static uint32_t tud_cdc_read(void *, uint32_t) {return 0;}
+static uint32_t tud_cdc_write(const void *, uint32_t len) {return len;}
+static uint32_t tud_cdc_write_flush() {return 0;}
+static bool     tud_cdc_connected() {return true;}
+static uint32_t time_us_32() {return uint32_t(simNow) | 1;}
+static void     tight_loop_contents() {}
+
+static void uart_putc_raw(int, char c);
+static bool uart_is_readable(int);
+static char uart_getc(int);
+static void mac_ndev_uart_rx_start(uint8_t *buf, uint16_t len);
+static void mac_ndev_uart_rx_wait();
+static void mac_ndev_uart_tx_start(const uint8_t *buf, uint16_t len);
+static bool mac_ndev_uart_tx_busy();
+
+static int pico_printf(const char *fmt, ...) {
+    if (!verbose) return 0;
+    va_list ap;
+    va_start(ap, fmt);
+    const int n = vprintf(fmt, ap);
+    va_end(ap);
+    return n;
+}
+
+#define MAC_NDEV_CACHE_SECTORS 256
+#define MAC_NDEV_WRITE_BEHIND  1
+#define printf pico_printf
+#include "../pico/mac_ndev.h"
+#undef printf
+
+#define DISK_SECTORS  1600      // 800K floppy image
+#define MAGIC_SECTOR  1200      // Sector of "FujiNet.ndev", picked by the handshake
+#define NEGATIVE_LBA  0x007FFFFF
+#define DRIVE         0
+#define HOT_SECTORS   48        // Catalog, extents and bitmap
+#define KNOCK_SEQ     {0,70,85,74,73}
+
+// The ESP32, as seen by the Pico over the UART
+
+struct Esp32 {
+    std::vector<uint8_t> disk;
+    double               espUs;
+    unsigned long        reads  = 0;
+    unsigned long        writes = 0;
+    bool                 readOnly = false;
+    uint8_t              cmd[4];
+    int                  cmdLen = 0;
+    bool                 replying = false;   // A sector is on its way back
+    bool                 receiving = false;  // Waiting for the data of a 'W'
+    uint32_t             cmdSector = 0;
+    double               busyUntil = 0;      // When the last request is answered
+    double               dmaDone   = 0;      // When the DMA in progress completes
+    char                 answer    = 0;      // The answer to a 'W', once it is due
+    double               answerAt  = 0;
+
+    Esp32(double esp) : disk(DISK_SECTORS * 512), espUs(esp) {
+        for (size_t i = 0; i < disk.size(); i++) disk[i] = uint8_t(i * 7 + i / 512);
+    }
+
+    // Receives a byte of an 'R' or 'W' command sent by the Pico
+    void receive(uint8_t c) {
+        cmd[cmdLen++] = c;
+        if (cmdLen == 4) {
+            cmdLen    = 0;
+            cmdSector = (cmd[1] << 16) | (cmd[2] << 8) | cmd[3];
+            if (cmd[0] == 'R') {
+                reads++;
+                replying  = true;
+                busyUntil = std::max(simNow, busyUntil) + espUs;
+            } else if (cmd[0] == 'W') {
+                receiving = true;
+            }
+        }
+    }
+
+    // Receives the sector following a 'W'
+    void write(const uint8_t *buf) {
+        writes++;
+        receiving = false;
+        if (!readOnly) {
+            memcpy(&disk[(cmdSector % DISK_SECTORS) * 512], buf, 512);
+        }
+        answer   = readOnly ? 'e' : 'w';
+        answerAt = busyUntil = std::max(simNow, busyUntil) + espUs;
+    }
+};
+
+static Esp32 *esp32;
+
+static void uart_putc_raw(int, char c) {
+    esp32->receive(c);
+}
+
+// Only the answers to 'W' come through here; sectors are read by DMA
+static bool uart_is_readable(int) {
+    if (!esp32->answer) return false;
+    if (simNow >= esp32->answerAt) return true;
+    simNow += 10;       // Time passes while the Pico polls
+    return false;
+}
+
+static char uart_getc(int) {
+    const char c = esp32->answer;
+    esp32->answer = 0;
+    return c;
+}
+
+static void mac_ndev_uart_tx_start(const uint8_t *buf, uint16_t len) {
+    if (!esp32->receiving || len != 512) {
+        ::printf("Transmit started without a write request\n");
+        exit(1);
+    }
+    esp32->write(buf);
+}
+
+static bool mac_ndev_uart_tx_busy() {
+    return false;
+}
+
+static void mac_ndev_uart_rx_start(uint8_t *buf, uint16_t len) {
+    if (!esp32->replying || len != 512) {
+        ::printf("Receive started without a sector request\n");
+        exit(1);
+    }
+    esp32->replying = false;
+    esp32->dmaDone  = esp32->busyUntil;
+    memcpy(buf, &esp32->disk[(esp32->cmdSector % DISK_SECTORS) * 512], 512);
+}
+
+static void mac_ndev_uart_rx_wait() {
+    simNow = std::max(simNow, esp32->dmaDone);
+}
+
+struct Sim {
+    Esp32         esp;
+    std::vector<uint8_t> expected;  // The disk as the Mac has written it
+    double        floppyUs;
+    bool          syncWrites = false;  // Flush the queue after every write
+    double        readUs  = 0;      // Simulated time spent in dcd_read()
+    double        writeUs = 0;      // Simulated time spent in dcd_write()
+    unsigned long sectorsRead = 0, errors = 0, refused = 0;
+    uint32_t      stamp = 0;        // Changes the data written each time
+
+    Sim(double espUs, double floppy) : esp(espUs), expected(esp.disk), floppyUs(floppy) {
+        esp32  = &esp;
+        simNow = 0;
+    }
+
+    // Follows the loop in the patched dcd_read()
+    void dcd_read(uint32_t sector, int count) {
+        const double start = simNow;
+        for (int i = 0; i < count; i++) {
+            uint8_t payload[538] = {0};
+            if (not_mac_ndev_read(DRIVE, sector, &payload[6], &payload[26])) {
+                mac_ndev_disk_read(DRIVE, sector, &payload[26]);
+                if (mac_ndev_disk_status(DRIVE)) refused++;
+                sectorsRead++;
+                checkData(sector, &payload[26]);
+            }
+            sector++;
+            mac_ndev_disk_read_ahead(DRIVE, sector, i + 1 < count);
+            simNow += floppyUs;
+        }
+        readUs += simNow - start;
+    }
+
+    // Follows the patched dcd_write(), one sector per call
+    void dcd_write(uint32_t sector, uint8_t *payload) {
+        const double start = simNow;
+        if (not_mac_ndev_write(DRIVE, sector, &payload[6], &payload[26])) {
+            mac_ndev_disk_write(DRIVE, sector, &payload[26]);
+            if (syncWrites) mac_ndev_disk_flush();
+            if (mac_ndev_disk_status(DRIVE)) refused++;
+        }
+        simNow += floppyUs;
+        writeUs += simNow - start;
+    }
+
+    void writeData(uint32_t sector) {
+        uint8_t payload[538] = {0};
+        for (int i = 0; i < 512; i++) payload[26 + i] = uint8_t(stamp + i);
+        stamp++;
+        dcd_write(sector, payload);
+        if (sector < DISK_SECTORS) memcpy(&expected[sector * 512], &payload[26], 512);
+    }
+
+    void checkData(uint32_t sector, const uint8_t *data) {
+        if (sector >= DISK_SECTORS) return;
+        if (memcmp(data, &expected[sector * 512], 512) != 0) {
+            if (errors++ < 10) ::printf("Data error on sector %u\n", sector);
+        }
+    }
+
+    // Flushes the queue; the ESP32 must then have every sector the Mac wrote
+    unsigned long flushAndCompare() {
+        mac_ndev_disk_flush();
+        unsigned long n = 0;
+        for (uint32_t sector = 0; sector < DISK_SECTORS; sector++) {
+            if (sector == MAGIC_SECTOR) continue;
+            if (memcmp(&esp.disk[sector * 512], &expected[sector * 512], 512) != 0) n++;
+        }
+        return n;
+    }
+
+    // The knock sequence, then the write and read of the magic sector
+    void handshake() {
+        const int knock[] = KNOCK_SEQ;
+        for (int sector : knock) dcd_read(sector, 1);
+
+        uint8_t payload[538] = {0};
+        for (int i = 0; i < 512; i++) payload[26 + i] = "NDEV"[i & 3];
+        dcd_write(MAGIC_SECTOR, payload);
+        dcd_read(MAGIC_SECTOR, 1);
+    }
+
+    // A serial block out to the FujiNet and a poll for data coming back
+    void serialIO(uint32_t sector) {
+        uint8_t payload[538] = {0};
+        memcpy(&payload[26], "NDEV", 4);
+        dcd_write(sector, payload);
+        dcd_read(sector, 1);
+    }
+};
+
+static void resetPico() {
+    memset(mac_ndev_conns, 0, sizeof(mac_ndev_conns));
+    memset(mac_ndev_chan_owner, 0, sizeof(mac_ndev_chan_owner));
+    memset(mac_ndev_cache, 0, sizeof(mac_ndev_cache));
+    memset(&mac_ndev_read_ahead, 0, sizeof(mac_ndev_read_ahead));
+    memset(&mac_ndev_write_queue, 0, sizeof(mac_ndev_write_queue));
+    mac_ndev_writes_queued  = 0;
+    mac_ndev_writes_merged  = 0;
+    mac_ndev_writes_stalled = 0;
+    mac_ndev_read_ahead_hits   = 0;
+    mac_ndev_read_ahead_unused = 0;
+    mac_ndev_cache_clock  = 0;
+    mac_ndev_cache_hits   = 0;
+    mac_ndev_cache_misses = 0;
+}
+
+static void runWorkload(Sim &sim, unsigned ops, unsigned seed) {
+    std::mt19937 rng(seed);
+    auto pick = [&](uint32_t n) {return uint32_t(rng() % n);};
+    std::vector<std::pair<uint32_t, int>> recentFiles;
+
+    sim.handshake();
+    sim.dcd_read(NEGATIVE_LBA, 1);          // The Mac probes the negative LBA too
+
+    for (unsigned op = 0; op < ops; op++) {
+        const uint32_t what = pick(100);
+        if (what < 40) {
+            // B-tree lookups favour the first few nodes
+            const uint32_t node = std::min(pick(HOT_SECTORS), pick(HOT_SECTORS));
+            sim.dcd_read(2 + node, 1);
+        } else if (what < 65) {
+            // A file read
+            const int      count = 1 + pick(16);
+            const uint32_t start = HOT_SECTORS + 2 + pick(DISK_SECTORS - HOT_SECTORS - 20);
+            if (start <= MAGIC_SECTOR && start + count > MAGIC_SECTOR) continue;
+            sim.dcd_read(start, count);
+            recentFiles.push_back({start, count});
+            if (recentFiles.size() > 8) recentFiles.erase(recentFiles.begin());
+        } else if (what < 75) {
+            // Reading a file again, as when relaunching an application
+            if (recentFiles.empty()) continue;
+            const auto &file = recentFiles[pick(recentFiles.size())];
+            sim.dcd_read(file.first, file.second);
+        } else if (what < 85) {
+            // Writes, to the B-trees or to a file
+            const int      count = 1 + pick(4);
+            const uint32_t start = pick(2) ? 2 + pick(HOT_SECTORS) : HOT_SECTORS + 2 + pick(DISK_SECTORS - HOT_SECTORS - 8);
+            if (start <= MAGIC_SECTOR && start + count > MAGIC_SECTOR) continue;
+            for (int i = 0; i < count; i++) sim.writeData(start + i);
+            // Often read straight back, while the writes are still queued
+            if (pick(2)) sim.dcd_read(start, count);
+        } else if (what < 95) {
+            sim.serialIO(MAGIC_SECTOR);
+        } else {
+            sim.serialIO(NEGATIVE_LBA);
+        }
+    }
+}
+
+// Neither the magic sector nor the negative LBA may ever be in the cache
+static unsigned long specialSectorsCached() {
+    unsigned long n = 0;
+    for (const auto &entry : mac_ndev_cache) {
+        if (entry.valid && (entry.sector == MAGIC_SECTOR || entry.sector == NEGATIVE_LBA)) n++;
+    }
+    return n;
+}
+
+// Reads the disk from start to end in reads of "count" sectors
+static double sequentialRead(double espUs, double floppyUs, int count, bool readAhead) {
+    resetPico();
+    mac_ndev_cache_size    = 0;
+    mac_ndev_read_ahead_on = readAhead;
+
+    Sim sim(espUs, floppyUs);
+    const int sectors = (MAGIC_SECTOR / count) * count;
+    for (int sector = 0; sector < sectors; sector += count) {
+        sim.dcd_read(sector, count);
+    }
+    if (sim.errors) {
+        printf("  %lu sectors read back did not match the disk\n", sim.errors);
+        exit(1);
+    }
+    return sim.readUs / sectors;
+}
+
+// Writes "sectors" from start to end in writes of "count" sectors
+static double sequentialWrite(double espUs, double floppyUs, int count, bool sync) {
+    resetPico();
+    mac_ndev_cache_size = 0;
+
+    Sim sim(espUs, floppyUs);
+    sim.syncWrites = sync;
+    const int sectors = (MAGIC_SECTOR / count) * count;
+    for (int sector = 0; sector < sectors; sector += count) {
+        for (int i = 0; i < count; i++) sim.writeData(sector + i);
+        simNow += floppyUs;     // The Mac reads the status between writes
+    }
+    const double start = simNow;
+    if (sim.flushAndCompare()) {
+        printf("  The disk did not match what was written\n");
+        exit(1);
+    }
+    return (sim.writeUs + simNow - start) / sectors;
+}
+
+// A write refused by a read-only disk is reported on the next read or write
+static bool readOnlyReported() {
+    resetPico();
+    Sim sim(1000, 1000);
+    sim.esp.readOnly = true;
+    sim.writeData(100);
+    mac_ndev_disk_flush();
+    const unsigned long before = sim.refused;
+    sim.dcd_read(50, 1);
+    const unsigned long onRead = sim.refused;
+    sim.writeData(101);
+    mac_ndev_disk_flush();
+    sim.writeData(102);
+    mac_ndev_disk_flush();
+    return (before == 0) && (onRead == 1) && (sim.refused == 2);
+}
+
+// Nothing read from a disk is returned once it has been swapped for another
+static bool diskSwapSeen() {
+    resetPico();
+    mac_ndev_cache_size = MAC_NDEV_CACHE_SECTORS;
+    Sim sim(1000, 1000);
+    sim.dcd_read(10, 8);
+    for (size_t i = 0; i < sim.esp.disk.size(); i++) sim.esp.disk[i] ^= 0x5A;
+    sim.expected = sim.esp.disk;
+    mac_ndev_disk_changed(DRIVE);
+    sim.dcd_read(10, 8);
+    return sim.errors == 0;
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<int> sizes = {0, 8, 16, 32, 64, 128, 256};
+    unsigned ops = 20000, seed = 1;
+    double espUs = 6000, floppyUs = 3000;
+
+    for (int i = 1; i < argc; i++) {
+        const std::string opt = argv[i];
+        if (opt == "-c" && i + 1 < argc) {
+            sizes.clear();
+            std::stringstream list(argv[++i]);
+            std::string item;
+            while (std::getline(list, item, ',')) sizes.push_back(atoi(item.c_str()));
+        } else if (opt == "-n" && i + 1 < argc) {
+            ops = atoi(argv[++i]);
+        } else if (opt == "-s" && i + 1 < argc) {
+            seed = atoi(argv[++i]);
+        } else if (opt == "-e" && i + 1 < argc) {
+            espUs = atof(argv[++i]);
+        } else if (opt == "-f" && i + 1 < argc) {
+            floppyUs = atof(argv[++i]);
+        } else if (opt == "-v") {
+            verbose = true;
+        } else {
+            printf("Usage: mac_ndev_disk_sim [-c sizes] [-n ops] [-s seed] [-e us] [-f us] [-v]\n");
+            return -1;
+        }
+    }
+
+    printf("Sequential reads, per sector (ESP32 %.2f ms, floppy %.2f ms):\n", espUs / 1000, floppyUs / 1000);
+    for (int count : {1, 8, 32}) {
+        printf("  %2d sectors per read: %6.2f ms without read-ahead, %6.2f ms with\n", count,
+            sequentialRead(espUs, floppyUs, count, false) / 1000,
+            sequentialRead(espUs, floppyUs, count, true) / 1000);
+    }
+    printf("\nSequential writes, per sector:\n");
+    for (int count : {1, 8, 32}) {
+        printf("  %2d sectors per write: %6.2f ms waiting for the ESP32, %6.2f ms with write-behind\n", count,
+            sequentialWrite(espUs, floppyUs, count, true) / 1000,
+            sequentialWrite(espUs, floppyUs, count, false) / 1000);
+    }
+    printf("\n");
+
+    if (!readOnlyReported()) {
+        printf("A refused write was not reported on the next read or write\n");
+        return 1;
+    }
+
+    if (!diskSwapSeen()) {
+        printf("Sectors of a swapped disk were still returned\n");
+        return 1;
+    }
+
+    printf("Cache size    Read-ahead      Hits    Misses   Hit rate  ESP32 reads  RA hits   Read time  Speedup\n");
+
+    double baseline = 0;
+    bool   failed   = false;
+    for (int size : sizes) {
+        if (size < 0 || size > MAC_NDEV_CACHE_SECTORS) {
+            printf("Cache size must be 0 to %d sectors\n", MAC_NDEV_CACHE_SECTORS);
+            return -1;
+        }
+        for (bool readAhead : {false, true}) {
+            resetPico();
+            mac_ndev_cache_size    = size;
+            mac_ndev_read_ahead_on = readAhead;
+
+            Sim sim(espUs, floppyUs);
+            runWorkload(sim, ops, seed);
+
+            const unsigned long lookups = mac_ndev_cache_hits + mac_ndev_cache_misses;
+            if (baseline == 0) baseline = sim.readUs;
+            printf("%4d (%3d KB)  %-10s %9lu %9lu %9.1f%% %12lu %8lu %9.2f s %7.2fx\n",
+                size, size / 2, readAhead ? "on" : "off",
+                (unsigned long) mac_ndev_cache_hits, (unsigned long) mac_ndev_cache_misses,
+                lookups ? mac_ndev_cache_hits * 100.0 / lookups : 0, sim.esp.reads,
+                (unsigned long) mac_ndev_read_ahead_hits,
+                sim.readUs / 1e6, sim.readUs ? baseline / sim.readUs : 0);
+
+            if (sim.errors) {
+                printf("  %lu of %lu sectors read back did not match the disk\n", sim.errors, sim.sectorsRead);
+                failed = true;
+            }
+            if (const unsigned long n = sim.flushAndCompare()) {
+                printf("  %lu sectors on the ESP32 did not match what the Mac wrote\n", n);
+                failed = true;
+            }
+            if (specialSectorsCached()) {
+                printf("  The magic sector or negative LBA was cached\n");
+                failed = true;
+            }
+        }
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,652 @@
+/* Stand-in for the ESP32 end of the Pico's UART link.
+ *
+ * The Pico passes disk sectors and serial data on to the ESP32 with the
+ * protocol described at the top of "pico/mac_ndev.h", but FujiNet has no
+ * code for the serial side of it. This program speaks the ESP32's side
+ * over a serial port wired to the Pico, or over a PTY for a Pico built on
+ * the host (see "mac_ndev_esp_harness.cpp"):
+ *
+ *   - 'R' and 'W' read and write 512 byte sectors of a disk image, which
+ *     is updated in place unless writes are refused with "-r".
+ *   - 'S' messages carry serial channel data, with replies of up to 500
+ *     bytes when the Pico asks for data.
+ *   - With "-f", the SLIP frames of MAC_NDEV_ESP_FRAMING are used instead
+ *     of 'S', for any channel, with the credits and "bytes waiting" frames.
+ *
+ * On this side, channels are connected to local endpoints:
+ *
+ *   - "-x" makes a PTY which carries every channel in the frames used on
+ *     the Pico's USB link (see "mac_ndev_link.h"), so that the tools made
+ *     for that link, such as "mac_ndev_traffic" and "mac_ndev_bridge",
+ *     work unchanged through the ESP32 path.
+ *   - "-l" connects the data of one channel to a TCP listener.
+ *
+ * Once a second, the commands and bytes handled in that second are shown.
+ *
+ * Usage: mac_ndev_esp32 [-d tty | -p link] [-b baud] [-i image] [-r] [-f]
+ *                       [-x link] [-l chan:port] [-s us] [-v]
+ *
+ *   -d tty        Serial port wired to the Pico's UART
+ *   -p link       Otherwise, make a PTY for the Pico, symlinked at "link"
+ *   -b baud       Baud rate of the serial port, as BAUD_RATE on the Pico (default: 115200)
+ *   -i image      Disk image (default: an empty 800K disk, in memory)
+ *   -r            Refuse writes, as for a read-only disk
+ *   -f            Framed mode, for a Pico built with MAC_NDEV_ESP_FRAMING
+ *   -x link       Exchange channel frames on a PTY, symlinked at "link"
+ *   -l chan:port  Connect the data of a channel to a TCP listener
+ *   -s us         Time taken to read or write each sector (default: 0)
+ *   -v            Show each command
+ */
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "mac_ndev_link.h"
+
+#define SECTOR_LEN      512
+#define DEFAULT_SECTORS 1600    // 800K floppy
+#define MAX_QUEUED      65536   // Stop reading endpoints when the Pico falls this far behind
+#define ESP_WINDOW      2000    // Credit each side starts out with, in framed mode
+#define ESP_FRAMES      7       // Data frames the Pico has blocks for, in framed mode
+
+#define SLIP_END        0xC0
+#define SLIP_ESC        0xDB
+#define SLIP_ESC_END    0xDC
+#define SLIP_ESC_ESC    0xDD
+
+struct Options {
+    const char *portname = nullptr;
+    const char *ptyLink  = nullptr;
+    const char *image    = nullptr;
+    const char *hostLink = nullptr;
+    int         baud     = 115200;
+    bool        readOnly = false;
+    bool        framed   = false;
+    unsigned    sectorUs = 0;
+    bool        verbose  = false;
+} opt;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static speed_t baud_to_speed(int baud) {
+    switch (baud) {
+        case 9600:    return B9600;
+        case 19200:   return B19200;
+        case 38400:   return B38400;
+        case 57600:   return B57600;
+        case 115200:  return B115200;
+        case 230400:  return B230400;
+        case 460800:  return B460800;
+        case 921600:  return B921600;
+        case 1000000: return B1000000;
+        case 2000000: return B2000000;
+        default:      return 0;
+    }
+}
+
+// Makes a PTY and returns the master; the slave is kept open and raw
+
+static int open_pty(const char *link, const char *what) {
+    const int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0) {
+        printf("Error creating PTY: %s\n", strerror(errno));
+        return -1;
+    }
+    const char *name = ptsname(fd);
+    struct termios tio;
+    const int slave = open(name, O_RDWR | O_NOCTTY);
+    tcgetattr(slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+    if (link) {
+        unlink(link);
+        if (symlink(name, link) < 0) {
+            printf("Error creating link %s: %s\n", link, strerror(errno));
+        }
+    }
+    printf("%s: %s%s%s\n", what, name, link ? " -> " : "", link ? link : "");
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+/*********************************** Disk ************************************/
+
+struct Disk {
+    std::vector<uint8_t> data;
+    int                  fd = -1;
+
+    bool open(const char *path) {
+        if (!path) {
+            data.assign(DEFAULT_SECTORS * SECTOR_LEN, 0);
+            return true;
+        }
+        fd = ::open(path, opt.readOnly ? O_RDONLY : O_RDWR);
+        if (fd < 0) {
+            printf("Error opening %s: %s\n", path, strerror(errno));
+            return false;
+        }
+        const off_t len = lseek(fd, 0, SEEK_END);
+        data.resize(len - len % SECTOR_LEN);
+        if (pread(fd, data.data(), data.size(), 0) != ssize_t(data.size())) {
+            printf("Error reading %s: %s\n", path, strerror(errno));
+            return false;
+        }
+        printf("Disk image %s: %zu sectors%s\n", path, data.size() / SECTOR_LEN, opt.readOnly ? ", read-only" : "");
+        return true;
+    }
+
+    uint32_t sectors() const {return data.size() / SECTOR_LEN;}
+
+    void read(uint32_t sector, uint8_t *buf) {
+        if (sector < sectors()) {
+            memcpy(buf, &data[sector * SECTOR_LEN], SECTOR_LEN);
+        } else {
+            memset(buf, 0, SECTOR_LEN);
+        }
+    }
+
+    bool write(uint32_t sector, const uint8_t *buf) {
+        if (opt.readOnly || sector >= sectors()) return false;
+        memcpy(&data[sector * SECTOR_LEN], buf, SECTOR_LEN);
+        if (fd >= 0 && pwrite(fd, buf, SECTOR_LEN, off_t(sector) * SECTOR_LEN) != SECTOR_LEN) {
+            printf("Error writing sector %u: %s\n", sector, strerror(errno));
+            return false;
+        }
+        return true;
+    }
+};
+
+static Disk disk;
+
+/********************************* Channels **********************************/
+
+struct Frame {
+    uint8_t     chan;
+    uint8_t     cmd;
+    std::string data;
+};
+
+// A channel connected to a TCP listener with "-l"
+
+struct Listener {
+    uint8_t     chan;
+    int         port;
+    int         listenFd = -1;
+    int         fd       = -1;
+    std::string out;
+};
+
+static std::vector<Listener> listeners;
+static std::deque<Frame>     toPico;            // Data for the Pico, in order
+static size_t                toPicoBytes = 0;
+static int                   hostFd = -1;        // "-x" PTY
+static std::string           hostOut;
+static FrameReader           hostReader;
+
+static Listener *find_listener(uint8_t chan) {
+    for (auto &l : listeners) {
+        if (l.chan == chan) return &l;
+    }
+    return nullptr;
+}
+
+// Queues data for the Pico, merging it with the last frame when it can
+
+static void queue_for_pico(uint8_t chan, uint8_t cmd, const uint8_t *data, size_t len) {
+    do {
+        if (cmd == MAC_NDEV_CMD_DATA && !toPico.empty() && toPico.back().chan == chan &&
+            toPico.back().cmd == MAC_NDEV_CMD_DATA && toPico.back().data.size() < MAC_NDEV_MAX_PAYLOAD) {
+            Frame &last = toPico.back();
+            const size_t n = std::min(len, MAC_NDEV_MAX_PAYLOAD - last.data.size());
+            last.data.append((const char *) data, n);
+            data += n;
+            len  -= n;
+            toPicoBytes += n;
+            continue;
+        }
+        const size_t n = std::min<size_t>(len, MAC_NDEV_MAX_PAYLOAD);
+        toPico.push_back({chan, cmd, std::string((const char *) data, n)});
+        data += n;
+        len  -= n;
+        toPicoBytes += n;
+    } while (len);
+}
+
+// Passes on what the Pico sent on a channel
+
+static void deliver_to_host(uint8_t chan, uint8_t cmd, const uint8_t *data, size_t len) {
+    Listener *l = find_listener(chan);
+    if (l && cmd == MAC_NDEV_CMD_DATA) {
+        if (l->fd >= 0) l->out.append((const char *) data, len);
+    } else if (hostFd >= 0) {
+        const uint8_t hdr[MAC_NDEV_FRAME_LEN] = {chan, cmd, uint8_t(len >> 8), uint8_t(len & 0xFF)};
+        hostOut.append((const char *) hdr, MAC_NDEV_FRAME_LEN);
+        hostOut.append((const char *) data, len);
+    } else if (opt.verbose) {
+        printf("Dropping %zu bytes from the Pico on channel %d\n", len, chan);
+    }
+}
+
+static size_t host_queued() {
+    size_t n = hostOut.size();
+    for (auto &l : listeners) n += l.out.size();
+    return n;
+}
+
+/********************************* The Pico **********************************/
+
+static int         uartFd = -1;
+static std::string uartOut;
+
+struct Stats {
+    unsigned long reads = 0, writes = 0, refused = 0, messages = 0;
+    unsigned long bytesIn = 0, bytesOut = 0, dataIn = 0, dataOut = 0;
+} stats, lastStats;
+
+static void slip_append(std::string &out, const uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] == SLIP_END) {
+            out += char(SLIP_ESC);
+            out += char(SLIP_ESC_END);
+        } else if (data[i] == SLIP_ESC) {
+            out += char(SLIP_ESC);
+            out += char(SLIP_ESC_ESC);
+        } else {
+            out += char(data[i]);
+        }
+    }
+}
+
+static void send_frame(const uint8_t *hdr, size_t hdrLen, const uint8_t *data = nullptr, size_t len = 0) {
+    uartOut += char(SLIP_END);
+    slip_append(uartOut, hdr, hdrLen);
+    if (len) slip_append(uartOut, data, len);
+    uartOut += char(SLIP_END);
+}
+
+/* Framed mode: the Pico's credit, in bytes and frames, what we owe it, and
+ * the bytes waiting that it was last told about, for each channel.
+ */
+static long     credit = ESP_WINDOW;
+static long     frameCredit = ESP_FRAMES;
+static unsigned owed   = 0;
+static uint16_t toldWaiting[256];
+
+static void answer_read(uint32_t sector) {
+    uint8_t buf[SECTOR_LEN];
+    if (opt.sectorUs) usleep(opt.sectorUs);
+    disk.read(sector, buf);
+    stats.reads++;
+    if (opt.framed) {
+        const uint8_t type = 'r';
+        send_frame(&type, 1, buf, SECTOR_LEN);
+    } else {
+        uartOut.append((const char *) buf, SECTOR_LEN);
+    }
+    if (opt.verbose) printf("R %u\n", sector);
+}
+
+static void answer_write(uint32_t sector, const uint8_t *buf) {
+    if (opt.sectorUs) usleep(opt.sectorUs);
+    const bool ok = disk.write(sector, buf);
+    stats.writes++;
+    if (!ok) stats.refused++;
+    const uint8_t answer = ok ? 'w' : 'e';
+    if (opt.framed) {
+        send_frame(&answer, 1);
+    } else {
+        uartOut += char(answer);
+    }
+    if (opt.verbose) printf("W %u%s\n", sector, ok ? "" : " refused");
+}
+
+// An 'S' message; the reply takes up to 500 bytes of serial channel data
+
+static void answer_message(uint16_t flgLen, const uint8_t *payload, uint16_t len) {
+    stats.messages++;
+    stats.dataIn += len;
+    if (len) deliver_to_host(MAC_NDEV_CHAN_SERIAL, MAC_NDEV_CMD_DATA, payload, len);
+    if (flgLen & 0x8000) {
+        std::string reply;
+        while (!toPico.empty() && reply.size() < MAC_NDEV_MAX_PAYLOAD) {
+            Frame &f = toPico.front();
+            if (f.chan != MAC_NDEV_CHAN_SERIAL || f.cmd != MAC_NDEV_CMD_DATA) {
+                printf("Dropping data for channel %d; the 'S' protocol only has the serial channel\n", f.chan);
+                toPicoBytes -= f.data.size();
+                toPico.pop_front();
+                continue;
+            }
+            const size_t n = std::min(f.data.size(), MAC_NDEV_MAX_PAYLOAD - reply.size());
+            reply.append(f.data, 0, n);
+            f.data.erase(0, n);
+            toPicoBytes -= n;
+            if (f.data.empty()) toPico.pop_front();
+        }
+        uartOut += char(reply.size() >> 8);
+        uartOut += char(reply.size() & 0xFF);
+        uartOut += reply;
+        stats.dataOut += reply.size();
+    }
+    if (opt.verbose) printf("S %d%s, replied\n", len, (flgLen & 0x8000) ? " + request" : "");
+}
+
+// A frame from the Pico, in framed mode
+
+static void handle_frame(const uint8_t *f, size_t len) {
+    if (len == 0) return;
+    if (f[0] == 'D' && len >= 3 && len - 3 <= MAC_NDEV_MAX_PAYLOAD) {
+        stats.dataIn += len - 3;
+        owed += MAC_NDEV_FRAME_LEN + len - 3;
+        deliver_to_host(f[1], f[2], f + 3, len - 3);
+        if (opt.verbose) printf("D chan %d, cmd %d, %zu bytes\n", f[1], f[2], len - 3);
+    } else if (f[0] == 'C' && len == 4) {
+        credit += CHARS_TO_UINT16(f[1], f[2]);
+        frameCredit += f[3];
+    } else {
+        printf("Bad frame from the Pico (type %d, %zu bytes)\n", f[0], len);
+    }
+}
+
+/* Takes apart the bytes from the Pico. Outside of a frame, 'R', 'W' and
+ * 'S' are followed by a fixed or given number of bytes.
+ */
+struct Parser {
+    std::vector<uint8_t> buf;
+    bool inFrame = false, escaped = false;
+
+    void add(uint8_t c) {
+        if (inFrame) {
+            if (c == SLIP_END) {
+                handle_frame(buf.data(), buf.size());
+                buf.clear();
+                inFrame = false;
+            } else if (c == SLIP_ESC) {
+                escaped = true;
+            } else {
+                if (escaped) c = (c == SLIP_ESC_END) ? SLIP_END : (c == SLIP_ESC_ESC) ? SLIP_ESC : c;
+                escaped = false;
+                buf.push_back(c);
+            }
+            return;
+        }
+        if (buf.empty() && c == SLIP_END && opt.framed) {
+            inFrame = true;
+            return;
+        }
+        buf.push_back(c);
+        const size_t n = buf.size();
+        switch (buf[0]) {
+            case 'R':
+                if (n == 4) {
+                    answer_read((buf[1] << 16) | (buf[2] << 8) | buf[3]);
+                    buf.clear();
+                }
+                break;
+            case 'W':
+                if (n == 4 + SECTOR_LEN) {
+                    answer_write((buf[1] << 16) | (buf[2] << 8) | buf[3], &buf[4]);
+                    buf.clear();
+                }
+                break;
+            case 'S':
+                if (n >= 3) {
+                    const uint16_t flgLen = CHARS_TO_UINT16(buf[1], buf[2]);
+                    const uint16_t len    = flgLen & 0x01FF;
+                    if (len > MAC_NDEV_MAX_PAYLOAD) {
+                        printf("Bad 'S' length %d\n", len);
+                        buf.clear();
+                    } else if (n == 3u + len) {
+                        answer_message(flgLen, &buf[3], len);
+                        buf.clear();
+                    }
+                }
+                break;
+            default:
+                printf("Unknown command byte %02x from the Pico\n", buf[0]);
+                buf.clear();
+        }
+    }
+};
+
+static Parser parser;
+
+/* Framed mode: pushes data frames to the Pico while it has credit, tells
+ * it about the rest, and returns credit for what has been passed on.
+ */
+static void push_to_pico() {
+    while (!toPico.empty() && frameCredit && credit >= long(MAC_NDEV_FRAME_LEN + toPico.front().data.size())) {
+        Frame &f = toPico.front();
+        const uint8_t hdr[3] = {'D', f.chan, f.cmd};
+        send_frame(hdr, 3, (const uint8_t *) f.data.data(), f.data.size());
+        credit -= MAC_NDEV_FRAME_LEN + f.data.size();
+        frameCredit--;
+        toPicoBytes -= f.data.size();
+        stats.dataOut += f.data.size();
+        toPico.pop_front();
+    }
+    unsigned waiting[256] = {0};
+    for (auto &f : toPico) {
+        if (f.cmd == MAC_NDEV_CMD_DATA) waiting[f.chan] += f.data.size();
+    }
+    for (int chan = 0; chan < 256; chan++) {
+        const uint16_t w = std::min(waiting[chan], 0xFFFFu);
+        if (w != toldWaiting[chan]) {
+            const uint8_t hdr[4] = {'A', uint8_t(chan), uint8_t(w >> 8), uint8_t(w & 0xFF)};
+            send_frame(hdr, 4);
+            toldWaiting[chan] = w;
+        }
+    }
+    if (owed && host_queued() < MAX_QUEUED) {
+        const uint16_t n = std::min(owed, 0xFFFFu);
+        const uint8_t hdr[4] = {'C', uint8_t(n >> 8), uint8_t(n & 0xFF), 0};
+        send_frame(hdr, 4);
+        owed -= n;
+    }
+}
+
+/********************************* Endpoints *********************************/
+
+static int listen_on(int port) {
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    const int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr = {};
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port        = htons(port);
+    if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        printf("Error listening on port %d: %s\n", port, strerror(errno));
+        return -1;
+    }
+    return fd;
+}
+
+// Writes as much of "out" as "fd" will take; returns false on a hard error
+
+static bool flush_out(int fd, std::string &out) {
+    while (!out.empty()) {
+        const ssize_t n = ::write(fd, out.data(), out.size());
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+        out.erase(0, n);
+    }
+    return true;
+}
+
+static void usage() {
+    printf("Usage: mac_ndev_esp32 [-d tty | -p link] [-b baud] [-i image] [-r] [-f]\n"
+           "                      [-x link] [-l chan:port] [-s us] [-v]\n");
+    exit(-1);
+}
+
+int main(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg == "-r") {
+            opt.readOnly = true;
+        } else if (arg == "-f") {
+            opt.framed = true;
+        } else if (arg == "-v") {
+            opt.verbose = true;
+        } else if (i + 1 >= argc) {
+            usage();
+        } else if (arg == "-d") {
+            opt.portname = argv[++i];
+        } else if (arg == "-p") {
+            opt.ptyLink = argv[++i];
+        } else if (arg == "-b") {
+            opt.baud = atoi(argv[++i]);
+        } else if (arg == "-i") {
+            opt.image = argv[++i];
+        } else if (arg == "-x") {
+            opt.hostLink = argv[++i];
+        } else if (arg == "-s") {
+            opt.sectorUs = atoi(argv[++i]);
+        } else if (arg == "-l") {
+            Listener l;
+            unsigned chan;
+            if (sscanf(argv[++i], "%u:%d", &chan, &l.port) != 2 || chan > 255) usage();
+            l.chan = chan;
+            listeners.push_back(l);
+        } else {
+            usage();
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    if (!disk.open(opt.image)) return -1;
+
+    if (opt.portname) {
+        uartFd = open(opt.portname, O_RDWR | O_NOCTTY | O_NONBLOCK);
+        if (uartFd < 0) {
+            printf("Error opening %s: %s\n", opt.portname, strerror(errno));
+            return -1;
+        }
+        if (!baud_to_speed(opt.baud)) {
+            printf("Unsupported baud rate %d\n", opt.baud);
+            return -1;
+        }
+        set_interface_attribs(uartFd, baud_to_speed(opt.baud));
+        tcflush(uartFd, TCIOFLUSH);
+    } else {
+        uartFd = open_pty(opt.ptyLink, "Pico UART");
+        if (uartFd < 0) return -1;
+    }
+    if (opt.hostLink) {
+        hostFd = open_pty(opt.hostLink, "Channel frames");
+        if (hostFd < 0) return -1;
+    }
+    for (auto &l : listeners) {
+        l.listenFd = listen_on(l.port);
+        if (l.listenFd < 0) return -1;
+        printf("Channel %d: listening on port %d\n", l.chan, l.port);
+    }
+    if (!opt.hostLink && listeners.empty()) {
+        printf("No -x or -l option; channel data from the Pico will be dropped\n");
+    }
+    printf("Speaking the %s protocol\n", opt.framed ? "framed" : "'S' message");
+
+    double lastReport = now();
+    for (;;) {
+        if (opt.framed) push_to_pico();
+
+        std::vector<struct pollfd> fds;
+        const bool roomForPico = toPicoBytes < MAX_QUEUED;
+        fds.push_back({uartFd, short(POLLIN | (uartOut.empty() ? 0 : POLLOUT)), 0});
+        if (hostFd >= 0) {
+            fds.push_back({hostFd, short((roomForPico ? POLLIN : 0) | (hostOut.empty() ? 0 : POLLOUT)), 0});
+        }
+        for (auto &l : listeners) {
+            if (l.fd >= 0) {
+                fds.push_back({l.fd, short((roomForPico ? POLLIN : 0) | (l.out.empty() ? 0 : POLLOUT)), 0});
+            } else {
+                fds.push_back({l.listenFd, POLLIN, 0});
+            }
+        }
+        poll(fds.data(), fds.size(), 100);
+
+        // The Pico
+        uint8_t buf[4096];
+        ssize_t n;
+        while ((n = read(uartFd, buf, sizeof(buf))) > 0) {
+            stats.bytesIn += n;
+            for (ssize_t i = 0; i < n; i++) parser.add(buf[i]);
+        }
+        if (!uartOut.empty()) {
+            const size_t before = uartOut.size();
+            flush_out(uartFd, uartOut);
+            stats.bytesOut += before - uartOut.size();
+        }
+
+        // The "-x" PTY
+        if (hostFd >= 0) {
+            while (roomForPico && hostReader.space() && (n = read(hostFd, buf, std::min(sizeof(buf), hostReader.space()))) > 0) {
+                hostReader.add(buf, n);
+                while (hostReader.next()) {
+                    queue_for_pico(hostReader.chan, hostReader.cmd, hostReader.payload, hostReader.len);
+                }
+            }
+            flush_out(hostFd, hostOut);
+        }
+
+        // The "-l" listeners
+        for (auto &l : listeners) {
+            if (l.fd < 0) {
+                l.fd = accept(l.listenFd, NULL, NULL);
+                if (l.fd >= 0) {
+                    fcntl(l.fd, F_SETFL, fcntl(l.fd, F_GETFL) | O_NONBLOCK);
+                    printf("Channel %d: connected\n", l.chan);
+                }
+                continue;
+            }
+            bool closed = false;
+            while (roomForPico) {
+                n = read(l.fd, buf, sizeof(buf));
+                if (n <= 0) {
+                    closed = (n == 0) || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+                    break;
+                }
+                queue_for_pico(l.chan, MAC_NDEV_CMD_DATA, buf, n);
+            }
+            if (closed || !flush_out(l.fd, l.out)) {
+                printf("Channel %d: disconnected\n", l.chan);
+                close(l.fd);
+                l.fd = -1;
+                l.out.clear();
+            }
+        }
+
+        const double t = now();
+        if (t - lastReport >= 1.0) {
+            if (stats.bytesIn != lastStats.bytesIn || stats.bytesOut != lastStats.bytesOut) {
+                printf("R %lu, W %lu (%lu refused), S %lu; UART in %.1f KB/s, out %.1f KB/s; data in %.1f KB/s, out %.1f KB/s\n",
+                    stats.reads - lastStats.reads, stats.writes - lastStats.writes,
+                    stats.refused - lastStats.refused, stats.messages - lastStats.messages,
+                    (stats.bytesIn - lastStats.bytesIn) / 1024.0 / (t - lastReport),
+                    (stats.bytesOut - lastStats.bytesOut) / 1024.0 / (t - lastReport),
+                    (stats.dataIn - lastStats.dataIn) / 1024.0 / (t - lastReport),
+                    (stats.dataOut - lastStats.dataOut) / 1024.0 / (t - lastReport));
+                fflush(stdout);
+            }
+            lastStats  = stats;
+            lastReport = t;
+        }
+    }
+    return 0;
+}
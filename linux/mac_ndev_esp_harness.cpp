@@ -0,0 +1,358 @@
+/* Host build of the Pico's ESP32 link, for testing with "mac_ndev_esp32".
+ *
+ * This builds "pico/mac_ndev.h" on the Linux host with both test modes
+ * off, so that it talks to the ESP32, and connects its UART to the PTY
+ * made by "mac_ndev_esp32". The main loop plays the Mac:
+ *
+ *   - It reads the negative LBA over and over, as the serial driver polls
+ *     the Pico, and writes back whatever serial data arrives, as the "Echo
+ *     serial data" test in FujiTests does. Traffic sent in through the
+ *     stand-in, for instance by "mac_ndev_traffic", then comes back to it.
+ *   - In between, it reads runs of disk sectors, which are compared with
+ *     the disk image, and with "-w" writes some as well.
+ *
+ * The UART is replaced by the PTY: DMA transfers complete as the bytes
+ * come in, and what is sent is written straight away. "-f" sets how long
+ * each sector takes to go over the floppy cable.
+ *
+ * Built with "-DMAC_NDEV_ESP_FRAMING=1", it speaks the framed protocol,
+ * for use with "mac_ndev_esp32 -f".
+ *
+ * Usage: mac_ndev_esp_harness [-d tty] [-i image] [-t seconds] [-f us] [-n] [-w] [-v]
+ *
+ *   -d tty      PTY of the ESP32 stand-in, as given to its "-p" (default: /tmp/mac_ndev_esp32)
+ *   -i image    The stand-in's disk image (default: an empty 800K disk)
+ *   -t seconds  Stop after this long (default: run until interrupted)
+ *   -f us       Floppy transfer time per sector (default: 2000)
+ *   -n          No disk I/O, only serial data
+ *   -w          Write disk sectors too; they go to the stand-in's image
+ *   -v          Show the messages printed by the Pico code
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+/* Stand-ins for the parts of the Pico SDK used by "mac_ndev.h" */
+
+#define MIN(a,b)            ((a) < (b) ? (a) : (b))
+
+static bool verbose = false;
+
+#define MAC_NDEV_HOST_SIM        1
+#define MAC_NDEV_LOOPBACK_TEST   0
+#define MAC_NDEV_USB_SERIAL_TEST 0
+#define UART_ID                  0
+#define BAUD_RATE                115200
+
+static uint32_t time_us_32() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint32_t(ts.tv_sec * 1000000ull + ts.tv_nsec / 1000);
+}
+
+/* The UART, as the PTY. Bytes which arrive while a DMA receive is going
+ * on go into its buffer, as they would on the Pico; the rest wait in
+ * "rxQueue" to be read a byte at a time.
+ */
+
+static int         uartFd = -1;
+static std::string rxQueue;
+static uint8_t    *dmaBuf = nullptr;
+static uint16_t    dmaLen = 0, dmaGot = 0;
+
+static bool write_all(const uint8_t *buf, size_t len) {
+    while (len) {
+        const ssize_t n = write(uartFd, buf, len);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                struct pollfd p = {uartFd, POLLOUT, 0};
+                poll(&p, 1, 10);
+                continue;
+            }
+            ::printf("Error writing to the UART: %s\n", strerror(errno));
+            exit(1);
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static void pump(int timeoutMs = 0) {
+    if (timeoutMs) {
+        struct pollfd p = {uartFd, POLLIN, 0};
+        poll(&p, 1, timeoutMs);
+    }
+    uint8_t buf[4096];
+    ssize_t n;
+    while ((n = read(uartFd, buf, sizeof(buf))) > 0) {
+        rxQueue.append((const char *) buf, n);
+    }
+    if (dmaBuf && dmaGot < dmaLen && !rxQueue.empty()) {
+        const size_t k = std::min<size_t>(rxQueue.size(), dmaLen - dmaGot);
+        memcpy(dmaBuf + dmaGot, rxQueue.data(), k);
+        rxQueue.erase(0, k);
+        dmaGot += k;
+    }
+}
+
+static void tight_loop_contents() {pump(1);}
+
+static void uart_putc_raw(int, char c) {write_all((const uint8_t *) &c, 1);}
+
+#if !MAC_NDEV_ESP_FRAMING
+static bool uart_is_readable(int) {
+    if (rxQueue.empty()) pump();
+    return !rxQueue.empty();
+}
+
+static char uart_getc(int) {
+    while (rxQueue.empty()) pump(1);
+    const char c = rxQueue[0];
+    rxQueue.erase(0, 1);
+    return c;
+}
+
+static void mac_ndev_uart_rx_start(uint8_t *buf, uint16_t len) {
+    dmaBuf = buf;
+    dmaLen = len;
+    dmaGot = 0;
+    pump();
+}
+
+static void mac_ndev_uart_rx_wait() {
+    while (dmaGot < dmaLen) pump(1);
+    dmaBuf = nullptr;
+}
+
+static uint16_t mac_ndev_uart_rx_count() {
+    pump();
+    return dmaGot;
+}
+
+static void mac_ndev_uart_rx_abort() {dmaBuf = nullptr;}
+#endif
+
+static void mac_ndev_uart_tx_start(const uint8_t *buf, uint16_t len) {write_all(buf, len);}
+static bool mac_ndev_uart_tx_busy() {return false;}
+
+#if MAC_NDEV_ESP_FRAMING
+static int mac_ndev_uart_ring_get() {
+    if (rxQueue.empty()) pump();
+    if (rxQueue.empty()) return -1;
+    const uint8_t c = rxQueue[0];
+    rxQueue.erase(0, 1);
+    return c;
+}
+#endif
+
+static int pico_printf(const char *fmt, ...) {
+    if (!verbose) return 0;
+    va_list ap;
+    va_start(ap, fmt);
+    const int n = vprintf(fmt, ap);
+    va_end(ap);
+    return n;
+}
+
+#define printf pico_printf
+#include "../pico/mac_ndev.h"
+#undef printf
+
+#include "mac_ndev_link.h"
+
+#define NEGATIVE_LBA    0x007FFFFF
+#define DRIVE           0
+#define HEADER_LEN      12
+#define DEFAULT_SECTORS 1600
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct Stats {
+    unsigned long polls = 0, echoed = 0, sectorsRead = 0, sectorsWritten = 0;
+    unsigned long errors = 0, refused = 0;
+} stats, lastStats;
+
+static std::vector<uint8_t> expected;      // The disk as the Mac has written it
+static unsigned             floppyUs = 2000;
+
+static void floppy_transfer() {
+    if (floppyUs) usleep(floppyUs);
+}
+
+// Follows the loop in the patched dcd_read()
+
+static void dcd_read(uint32_t sector, int count) {
+    for (int i = 0; i < count; i++) {
+        uint8_t payload[538] = {0};
+        if (not_mac_ndev_read(DRIVE, sector, &payload[6], &payload[26])) {
+            mac_ndev_disk_read(DRIVE, sector, &payload[26]);
+            if (mac_ndev_disk_status(DRIVE)) stats.refused++;
+            stats.sectorsRead++;
+            if (sector < expected.size() / 512 && memcmp(&payload[26], &expected[sector * 512], 512) != 0) {
+                if (stats.errors++ < 10) ::printf("Data error on sector %u\n", sector);
+            }
+        }
+        sector++;
+        mac_ndev_disk_read_ahead(DRIVE, sector, i + 1 < count);
+        floppy_transfer();
+    }
+}
+
+// Follows the patched dcd_write(), one sector per call
+
+static void dcd_write(uint32_t sector, const uint8_t *data) {
+    uint8_t payload[538] = {0};
+    memcpy(&payload[26], data, 512);
+    if (not_mac_ndev_write(DRIVE, sector, &payload[6], &payload[26])) {
+        mac_ndev_disk_write(DRIVE, sector, &payload[26]);
+        if (mac_ndev_disk_status(DRIVE)) stats.refused++;
+        stats.sectorsWritten++;
+        if (sector < expected.size() / 512) memcpy(&expected[sector * 512], data, 512);
+    }
+    floppy_transfer();
+}
+
+/* A poll of the negative LBA; any serial data which comes back is written
+ * back to it, as an echo on the Mac would.
+ */
+static void serial_echo() {
+    uint8_t payload[538] = {0};
+    uint8_t *block = &payload[26];
+    not_mac_ndev_read(DRIVE, NEGATIVE_LBA, &payload[6], block);
+    floppy_transfer();
+    stats.polls++;
+    if (memcmp(block, "FUJI", 4) != 0) {
+        if (stats.errors++ < 10) ::printf("Bad reply tag on the negative LBA\n");
+        return;
+    }
+    const uint16_t len = CHARS_TO_UINT16(block[8], block[9]);
+    if (block[4] != MAC_NDEV_CHAN_SERIAL || block[5] != MAC_NDEV_CMD_DATA || len == 0) {
+        return;
+    }
+    uint8_t out[538] = {0};
+    memcpy(&out[26], "NDEV", 4);
+    out[26 + 4] = MAC_NDEV_CHAN_SERIAL;
+    out[26 + 5] = MAC_NDEV_CMD_DATA;
+    out[26 + 6] = len >> 8;
+    out[26 + 7] = len & 0xFF;
+    memcpy(&out[26 + HEADER_LEN], block + HEADER_LEN, len);
+    not_mac_ndev_write(DRIVE, NEGATIVE_LBA, &out[6], &out[26]);
+    floppy_transfer();
+    stats.echoed += len;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *portname = "/tmp/mac_ndev_esp32";
+    const char *image    = nullptr;
+    double      duration = 0;
+    bool        diskIO   = true;
+    bool        writes   = false;
+
+    for (int i = 1; i < argc; i++) {
+        const std::string opt = argv[i];
+        if (opt == "-d" && i + 1 < argc) {
+            portname = argv[++i];
+        } else if (opt == "-i" && i + 1 < argc) {
+            image = argv[++i];
+        } else if (opt == "-t" && i + 1 < argc) {
+            duration = atof(argv[++i]);
+        } else if (opt == "-f" && i + 1 < argc) {
+            floppyUs = atoi(argv[++i]);
+        } else if (opt == "-n") {
+            diskIO = false;
+        } else if (opt == "-w") {
+            writes = true;
+        } else if (opt == "-v") {
+            verbose = true;
+        } else {
+            ::printf("Usage: mac_ndev_esp_harness [-d tty] [-i image] [-t seconds] [-f us] [-n] [-w] [-v]\n");
+            return -1;
+        }
+    }
+
+    if (image) {
+        FILE *f = fopen(image, "rb");
+        if (!f) {
+            ::printf("Error opening %s: %s\n", image, strerror(errno));
+            return -1;
+        }
+        uint8_t buf[512];
+        while (fread(buf, 1, 512, f) == 512) expected.insert(expected.end(), buf, buf + 512);
+        fclose(f);
+    } else {
+        expected.assign(DEFAULT_SECTORS * 512, 0);
+    }
+    const uint32_t sectors = expected.size() / 512;
+
+    uartFd = open(portname, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (uartFd < 0) {
+        ::printf("Error opening %s: %s\n", portname, strerror(errno));
+        return -1;
+    }
+    set_interface_attribs(uartFd, B115200);
+
+    ::printf("Playing the Mac through the Pico's %s ESP32 link on %s\n",
+        MAC_NDEV_ESP_FRAMING ? "framed" : "'S' message", portname);
+
+    std::mt19937 rng(1);
+    auto pick = [&](uint32_t n) {return uint32_t(rng() % n);};
+    uint8_t data[512];
+    uint32_t stamp = 0;
+
+    const double start = now();
+    double lastReport = start;
+    for (;;) {
+        serial_echo();
+
+        if (diskIO && sectors > 32 && pick(4) == 0) {
+            if (writes && pick(4) == 0) {
+                const uint32_t sector = pick(sectors);
+                for (int i = 0; i < 512; i++) data[i] = uint8_t(stamp + i * 3);
+                stamp++;
+                dcd_write(sector, data);
+                if (pick(2)) dcd_read(sector, 1);
+            } else {
+                const int count = 1 + pick(16);
+                dcd_read(pick(sectors - count), count);
+            }
+        }
+
+        const double t = now();
+        if (t - lastReport >= 1.0) {
+            ::printf("Polls %lu, echoed %.1f KB/s; sectors read %lu, written %lu; data errors %lu\n",
+                stats.polls - lastStats.polls, (stats.echoed - lastStats.echoed) / 1024.0 / (t - lastReport),
+                stats.sectorsRead - lastStats.sectorsRead, stats.sectorsWritten - lastStats.sectorsWritten,
+                stats.errors);
+            fflush(stdout);
+            lastStats  = stats;
+            lastReport = t;
+        }
+        if (duration && t - start >= duration) break;
+    }
+
+    // Every queued write must have made it to the stand-in's image
+    mac_ndev_disk_flush();
+    if (stats.refused) ::printf("%lu writes were refused\n", stats.refused);
+    ::printf("Total: %lu polls, %lu bytes echoed, %lu sectors read, %lu written, %lu data errors\n",
+        stats.polls, stats.echoed, stats.sectorsRead, stats.sectorsWritten, stats.errors);
+    return stats.errors ? 1 : 0;
+}
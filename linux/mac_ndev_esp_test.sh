@@ -0,0 +1,89 @@
+#!/bin/sh
+#
+# Load tests of the Pico's ESP32 link, through the "mac_ndev_esp32" stand-in.
+#
+# Starts the stand-in and, unless a serial port wired to a real Pico is
+# given, the host build of the Pico code in "mac_ndev_esp_harness", then
+# runs "mac_ndev_traffic" through them in each of its modes, appending the
+# results of every step to a CSV file. With a real Pico, the Mac must be
+# running the "Echo serial data" test in FujiTests.
+#
+# The tools are looked for in $BIN (default: the current directory), with
+# the harness built as "mac_ndev_esp_harness" or, for "-f", as
+# "mac_ndev_esp_harness_framed" (with -DMAC_NDEV_ESP_FRAMING=1).
+#
+# Usage: mac_ndev_esp_test.sh [-f] [-d tty] [-b baud] [-o file.csv] [-t seconds]
+#
+#   -f          Framed mode (MAC_NDEV_ESP_FRAMING)
+#   -d tty      Serial port wired to a real Pico, instead of the harness
+#   -b baud     Baud rate of the serial port (default: 115200)
+#   -o file     CSV file for the results (default: esp_test.csv)
+#   -t seconds  Duration of each step (default: 5)
+
+BIN=${BIN:-.}
+FRAMED=
+PORT=
+BAUD=115200
+CSV=esp_test.csv
+STEP=5
+TMP=$(mktemp -d)
+
+while getopts "fd:b:o:t:" opt; do
+    case $opt in
+        f) FRAMED=-f ;;
+        d) PORT=$OPTARG ;;
+        b) BAUD=$OPTARG ;;
+        o) CSV=$OPTARG ;;
+        t) STEP=$OPTARG ;;
+        *) sed -n 's/^# Usage: /Usage: /p' "$0"; exit 1 ;;
+    esac
+done
+
+cleanup() {
+    kill $PIDS 2>/dev/null
+    rm -rf "$TMP"
+}
+trap cleanup EXIT INT TERM
+
+# A scratch copy of an empty 800K disk, which the harness also writes to
+dd if=/dev/zero of="$TMP/disk.img" bs=512 count=1600 2>/dev/null
+
+if [ -n "$PORT" ]; then
+    "$BIN/mac_ndev_esp32" $FRAMED -d "$PORT" -b "$BAUD" -i "$TMP/disk.img" -x "$TMP/host" > "$TMP/esp32.log" &
+    PIDS=$!
+    sleep 1
+else
+    "$BIN/mac_ndev_esp32" $FRAMED -p "$TMP/uart" -i "$TMP/disk.img" -x "$TMP/host" > "$TMP/esp32.log" &
+    PIDS=$!
+    sleep 1
+    HARNESS="$BIN/mac_ndev_esp_harness"
+    [ -n "$FRAMED" ] && HARNESS="${HARNESS}_framed"
+    "$HARNESS" -d "$TMP/uart" -i "$TMP/disk.img" -w > "$TMP/harness.log" &
+    PIDS="$PIDS $!"
+fi
+
+# Echoes still on their way back from an overloaded step would be counted
+# against the next one, so leave the link a moment to drain in between
+traffic() {
+    "$BIN/mac_ndev_traffic" -d "$TMP/host" -t "$STEP" -o "$CSV" "$@"
+    sleep 5
+}
+
+echo "== Throughput curve, 64 byte messages"
+traffic -m rate -r 25:1600 -s 64
+echo "== Throughput curve, full blocks"
+traffic -m rate -r 25:400 -s 500
+echo "== Bursts"
+traffic -m burst -b 32 -i 250 -s 200
+echo "== Request/response"
+traffic -m rr -w 1 -s 64
+traffic -m rr -w 8 -s 64
+
+echo "== ESP32 stand-in"
+tail -n 3 "$TMP/esp32.log"
+if [ -z "$PORT" ]; then
+    echo "== Harness"
+    tail -n 3 "$TMP/harness.log"
+    grep -q "Data error\|Bad reply" "$TMP/harness.log" && exit 1
+fi
+exit 0
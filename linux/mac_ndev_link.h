@@ -0,0 +1,164 @@
+/* Helpers shared by the Linux tools that talk to the Pico over USB.
+ *
+ * When MAC_NDEV_USB_FRAMING is set in "pico/mac_ndev.h", everything sent
+ * through the USB port is wrapped in frames which tell which channel the
+ * data is for:
+ *
+ *           +---------------+--------------+------------------+
+ *           | No. of bytes  | Type [Value] | Description      |
+ *           +---------------+--------------+------------------+
+ *           | 1             | U8           | channel          |
+ *           | 1             | U8           | command          |
+ *           | 2             | U16          | payload length   |
+ *           | 0 to 500      | U8[]         | payload          |
+ *           +---------------+--------------+------------------+
+ *
+ * The channel and command numbers match those in "FujiInterfaces.h".
+ */
+
+#pragma once
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define MAC_NDEV_FRAME_LEN    4
+#define MAC_NDEV_MAX_PAYLOAD  500
+
+#define MAC_NDEV_CHAN_SERIAL  0
+#define MAC_NDEV_CHAN_TCP     8   // First channel used for TCP streams
+#define MAC_NDEV_MAX_TCP      4   // Maximum number of TCP streams
+#define MAC_NDEV_CHAN_UDP     16  // First channel used for UDP streams
+#define MAC_NDEV_MAX_UDP      4   // Maximum number of UDP streams
+
+/* On UDP channels, a DATA payload holds one or more datagrams, each one
+ * preceded by this header and padded to an even length.
+ */
+
+#define MAC_NDEV_UDP_HDR_LEN  8   // U32 host, U16 port, U16 length
+
+enum {
+    MAC_NDEV_CMD_DATA,            // Payload is channel data
+    MAC_NDEV_CMD_OPEN,            // Mac: connect; Fuji: connection established
+    MAC_NDEV_CMD_CLOSE,           // Mac: done sending; Fuji: remote closed
+    MAC_NDEV_CMD_ABORT,           // Connection reset or failed
+    MAC_NDEV_CMD_WINDOW           // Mac: receive buffer space freed
+};
+
+// The Mac is big-endian, so multi-byte values are sent in network order
+
+#define CHARS_TO_UINT16(a,b) ((uint16_t(uint8_t(a)) << 8) | uint8_t(b))
+#define CHARS_TO_UINT32(a,b,c,d) ((uint32_t(CHARS_TO_UINT16(a,b)) << 16) | CHARS_TO_UINT16(c,d))
+
+inline int set_interface_attribs(int fd, int speed)
+{
+    struct termios tty;
+
+    if (tcgetattr(fd, &tty) < 0) {
+        printf("Error from tcgetattr: %s\n", strerror(errno));
+        return -1;
+    }
+
+    cfsetospeed(&tty, (speed_t)speed);
+    cfsetispeed(&tty, (speed_t)speed);
+
+    tty.c_cflag |= (CLOCAL | CREAD);    /* ignore modem controls */
+    tty.c_cflag &= ~CSIZE;
+    tty.c_cflag |= CS8;         /* 8-bit characters */
+    tty.c_cflag &= ~PARENB;     /* no parity bit */
+    tty.c_cflag &= ~CSTOPB;     /* only need 1 stop bit */
+    tty.c_cflag &= ~CRTSCTS;    /* no hardware flowcontrol */
+
+    /* setup for non-canonical mode */
+    tty.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON);
+    tty.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+    tty.c_oflag &= ~OPOST;
+
+    /* fetch bytes as they become available */
+    tty.c_cc[VMIN] = 1;
+    tty.c_cc[VTIME] = 1;
+
+    if (tcsetattr(fd, TCSANOW, &tty) != 0) {
+        printf("Error from tcsetattr: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* Writes all of "len" bytes, retrying on short writes */
+
+inline bool write_fully(int fd, const uint8_t *buf, size_t len)
+{
+    while (len) {
+        ssize_t n = ::write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            printf("Error from write: %s\n", strerror(errno));
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+inline bool write_frame(int fd, uint8_t chan, uint8_t cmd, const uint8_t *payload, uint16_t len)
+{
+    uint8_t frame[MAC_NDEV_FRAME_LEN + MAC_NDEV_MAX_PAYLOAD];
+    if (len > MAC_NDEV_MAX_PAYLOAD) {
+        printf("Frame too long for channel %d: %d\n", chan, len);
+        return false;
+    }
+    frame[0] = chan;
+    frame[1] = cmd;
+    frame[2] = len >> 8;
+    frame[3] = len & 0xFF;
+    if (len) memcpy(frame + MAC_NDEV_FRAME_LEN, payload, len);
+    return write_fully(fd, frame, MAC_NDEV_FRAME_LEN + len);
+}
+
+/* Collects bytes read from the USB port and splits them into frames */
+
+class FrameReader {
+    public:
+        uint8_t  chan;
+        uint8_t  cmd;
+        uint16_t len;
+        uint8_t  payload[MAC_NDEV_MAX_PAYLOAD];
+
+        // Adds data to the buffer; returns false if it is full
+        bool add(const uint8_t *data, size_t n) {
+            if (fill + n > sizeof(buf)) return false;
+            memcpy(buf + fill, data, n);
+            fill += n;
+            return true;
+        }
+
+        size_t space() const {return sizeof(buf) - fill;}
+
+        // Extracts the next complete frame, if there is one
+        bool next() {
+            if (fill < MAC_NDEV_FRAME_LEN) return false;
+            const uint16_t n = CHARS_TO_UINT16(buf[2], buf[3]);
+            if (n > MAC_NDEV_MAX_PAYLOAD) {
+                printf("Invalid frame length %d, discarding input\n", n);
+                fill = 0;
+                return false;
+            }
+            if (fill < size_t(MAC_NDEV_FRAME_LEN + n)) return false;
+            chan = buf[0];
+            cmd  = buf[1];
+            len  = n;
+            memcpy(payload, buf + MAC_NDEV_FRAME_LEN, n);
+            fill -= MAC_NDEV_FRAME_LEN + n;
+            memmove(buf, buf + MAC_NDEV_FRAME_LEN + n, fill);
+            return true;
+        }
+
+    private:
+        uint8_t buf[4 * (MAC_NDEV_FRAME_LEN + MAC_NDEV_MAX_PAYLOAD)];
+        size_t  fill = 0;
+};
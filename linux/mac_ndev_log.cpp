@@ -0,0 +1,273 @@
+/* Analyzer for the event log kept by the FujiNet async driver.
+ *
+ * The log is saved on the Mac by the "Save driver event log" command in
+ * FujiTests, which writes a file named "FujiNet.log". Copy that file to
+ * the Linux host and run this tool on it to find out where the time goes
+ * between a Read or Write call and the block I/O that carries it out.
+ *
+ * The file is big-endian, with a header followed by the events, oldest
+ * first, as laid out in "FujiInterfaces.h":
+ *
+ *           +---------------+--------------+------------------------+
+ *           | No. of bytes  | Type [Value] | Description            |
+ *           +---------------+--------------+------------------------+
+ *           | 4             | OSType       | 'FLOG'                 |
+ *           | 2             | U16          | version [1]            |
+ *           | 2             | U16          | size of an event [10]  |
+ *           | 2             | U16          | events in the file     |
+ *           | 4             | U32          | events ever logged     |
+ *           +---------------+--------------+------------------------+
+ *
+ *           +---------------+--------------+------------------------+
+ *           | 4             | U32          | ticks                  |
+ *           | 2             | S16          | argument               |
+ *           | 1             | U8           | event                  |
+ *           | 1             | U8           | channel or unit number |
+ *           | 1             | U8           | VIA timer 2 high byte  |
+ *           | 1             | U8           | unused                 |
+ *           +---------------+--------------+------------------------+
+ *
+ * The Mac has no cycle counter, so times come from the tick count, with
+ * events within the same tick spaced out using the VIA timer, whose high
+ * byte counts down every 0.33 ms. The Sony driver also uses this timer,
+ * so the spacing within a tick is approximate.
+ *
+ * Usage: mac_ndev_log [-t] FujiNet.log
+ *
+ *   -t       Print every event, with its time and the time since the last
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <string>
+#include <vector>
+
+#define TICK_MS   (1000.0 / 60.15)
+#define TIMER_MS  (256 / 783.36)     // Time for the VIA timer high byte to count down by one
+#define IN_PROGRESS  1               // ioInProgress
+
+enum {
+    EV_VBL = 1,
+    EV_CONTENDED,
+    EV_READ_START,
+    EV_READ_DONE,
+    EV_WRITE_START,
+    EV_WRITE_DONE,
+    EV_SUSPEND,
+    EV_WAKEUP,
+    EV_COPY_IN,
+    EV_COPY_OUT
+};
+
+static const char *eventNames[] = {
+    "?", "vbl", "contended", "read start", "read done", "write start",
+    "write done", "suspend", "wakeup", "copy in", "copy out"
+};
+
+struct Event {
+    double   ms;         // Time since the first event
+    uint32_t ticks;
+    int16_t  arg;
+    uint8_t  event;
+    uint8_t  chan;
+    uint8_t  timer;
+};
+
+static const char *eventName(uint8_t event) {
+    return event < std::size(eventNames) ? eventNames[event] : "?";
+}
+
+static uint16_t be16(const uint8_t *p) {return (p[0] << 8) | p[1];}
+static uint32_t be32(const uint8_t *p) {return (uint32_t(be16(p)) << 16) | be16(p + 2);}
+
+/* Works out the time of each event. Events in a later tick start at the
+ * beginning of that tick; events in the same tick are spaced out by the
+ * change in the timer, but never past the end of the tick.
+ */
+static void computeTimes(std::vector<Event> &events) {
+    double sub = 0;
+    for (size_t i = 0; i < events.size(); i++) {
+        Event &e = events[i];
+        if (i && e.ticks == events[i - 1].ticks) {
+            sub += uint8_t(events[i - 1].timer - e.timer) * TIMER_MS;
+            sub  = std::min(sub, TICK_MS * 0.99);
+        } else {
+            sub = 0;
+        }
+        e.ms = (e.ticks - events[0].ticks) * TICK_MS + sub;
+    }
+}
+
+struct Latency {
+    std::vector<double> samples;
+
+    void add(double ms) {samples.push_back(ms);}
+
+    void print(const char *what) {
+        if (samples.empty()) {
+            printf("  %-32s        -\n", what);
+            return;
+        }
+        std::sort(samples.begin(), samples.end());
+        double total = 0;
+        for (double s : samples) total += s;
+        auto pct = [&](double p) {return samples[std::min(samples.size() - 1, size_t(p * samples.size()))];};
+        printf("  %-32s %8zu %9.2f %9.2f %9.2f %9.2f\n", what, samples.size(),
+            total / samples.size(), pct(0.50), pct(0.99), samples.back());
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    const char *filename = nullptr;
+    bool timeline = false;
+
+    for (int i = 1; i < argc; i++) {
+        const std::string opt = argv[i];
+        if (opt == "-t") {
+            timeline = true;
+        } else if (opt[0] != '-' && !filename) {
+            filename = argv[i];
+        } else {
+            filename = nullptr;
+            break;
+        }
+    }
+    if (!filename) {
+        printf("Usage: mac_ndev_log [-t] FujiNet.log\n");
+        return -1;
+    }
+
+    std::ifstream file(filename, std::ios::binary);
+    const std::vector<uint8_t> buf((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (!file.good() && !file.eof()) {
+        printf("Error reading %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    if (buf.size() < 14 || memcmp(buf.data(), "FLOG", 4) != 0 || be16(&buf[4]) != 1) {
+        printf("%s is not a FujiNet event log\n", filename);
+        return -1;
+    }
+
+    const size_t   size   = be16(&buf[6]);
+    const size_t   count  = be16(&buf[8]);
+    const uint32_t logged = be32(&buf[10]);
+    if (size < 10 || buf.size() < 14 + count * size) {
+        printf("%s is truncated\n", filename);
+        return -1;
+    }
+
+    std::vector<Event> events;
+    for (size_t i = 0; i < count; i++) {
+        const uint8_t *p = &buf[14 + i * size];
+        events.push_back({0, be32(p), int16_t(be16(p + 4)), p[6], p[7], p[8]});
+    }
+    if (events.empty()) {
+        printf("No events logged\n");
+        return 0;
+    }
+    computeTimes(events);
+
+    printf("%zu of %u events, spanning %.1f ms\n\n", events.size(), logged, events.back().ms);
+
+    // Pair up the events to measure the latencies
+
+    Latency writeToStart, writeToDone, blockRead, blockWrite, suspended, vblInterval;
+    std::map<int, double> suspendedAt;      // By unit number
+    std::vector<double>   copiedIn;         // Serial data not yet sent to the FujiNet
+    std::vector<double>   sending;          // Serial data in the block being written
+    double readStart = -1, writeStart = -1, lastVbl = -1;
+    unsigned long counts[std::size(eventNames)] = {};
+    unsigned long bytesIn = 0, bytesOut = 0, readErrors = 0, writeErrors = 0;
+
+    const Event *prev = nullptr;
+    for (const Event &e : events) {
+        if (timeline) {
+            printf("%10.2f ms %+8.2f  %-12s chan %3d  arg %6d\n", e.ms,
+                prev ? e.ms - prev->ms : 0, eventName(e.event), e.chan, e.arg);
+        }
+        prev = &e;
+        counts[e.event < std::size(eventNames) ? e.event : 0]++;
+
+        switch (e.event) {
+            case EV_VBL:
+                if (lastVbl >= 0) vblInterval.add(e.ms - lastVbl);
+                lastVbl = e.ms;
+                break;
+            case EV_READ_START:
+                readStart = e.ms;
+                break;
+            case EV_READ_DONE:
+                if (readStart >= 0) blockRead.add(e.ms - readStart);
+                if (e.arg < 0) readErrors++;
+                readStart = -1;
+                break;
+            case EV_WRITE_START:
+                writeStart = e.ms;
+                if (e.chan == 0) {
+                    for (double t : copiedIn) writeToStart.add(e.ms - t);
+                    sending.swap(copiedIn);
+                    copiedIn.clear();
+                }
+                break;
+            case EV_WRITE_DONE:
+                if (writeStart >= 0) blockWrite.add(e.ms - writeStart);
+                if (e.arg != 0) {
+                    // The data will be sent again in the next block
+                    writeErrors++;
+                    copiedIn.insert(copiedIn.begin(), sending.begin(), sending.end());
+                } else if (e.chan == 0) {
+                    for (double t : sending) writeToDone.add(e.ms - t);
+                }
+                sending.clear();
+                writeStart = -1;
+                break;
+            case EV_SUSPEND:
+                suspendedAt[e.chan] = e.ms;
+                break;
+            case EV_WAKEUP:
+                if (e.arg != IN_PROGRESS && suspendedAt.count(e.chan)) {
+                    suspended.add(e.ms - suspendedAt[e.chan]);
+                    suspendedAt.erase(e.chan);
+                }
+                break;
+            case EV_COPY_IN:
+                copiedIn.push_back(e.ms);
+                bytesIn += e.arg;
+                break;
+            case EV_COPY_OUT:
+                bytesOut += e.arg;
+                break;
+        }
+    }
+    if (timeline) printf("\n");
+
+    printf("Event counts:\n");
+    for (size_t i = 1; i < std::size(eventNames); i++) {
+        printf("  %-12s %8lu\n", eventNames[i], counts[i]);
+    }
+    if (counts[0]) printf("  %-12s %8lu\n", "unknown", counts[0]);
+    printf("\n");
+
+    const double seconds = events.back().ms / 1000;
+    printf("Bytes from Write calls:   %8lu (%.0f bytes/s)\n", bytesIn,  seconds > 0 ? bytesIn  / seconds : 0);
+    printf("Bytes to Read calls:      %8lu (%.0f bytes/s)\n", bytesOut, seconds > 0 ? bytesOut / seconds : 0);
+    printf("Block read errors:        %8lu\n", readErrors);
+    printf("Block write errors:       %8lu\n\n", writeErrors);
+
+    printf("Latencies (ms):                     count       avg       p50       p99       max\n");
+    writeToStart.print("Write call to block write");
+    writeToDone.print("Write call to FujiNet");
+    blockWrite.print("Block write");
+    blockRead.print("Block read");
+    suspended.print("Suspended Read/Write call");
+    vblInterval.print("VBL interval");
+    return 0;
+}
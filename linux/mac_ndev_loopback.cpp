@@ -1,50 +1,49 @@
+/* Loopback tool for a Pico connected via USB.
+ *
+ * Everything received from the Pico is sent straight back, so the Mac
+ * serial tests see the data they wrote come back to them. The bytes are
+ * echoed as-is, so this works whether or not MAC_NDEV_USB_FRAMING is set.
+ *
+ * By default, the echo is asynchronous: data is read as soon as it arrives
+ * and placed in an output queue, which is written out whenever the port
+ * can take it. The older synchronous mode, which writes each chunk and
+ * waits for it to drain before reading again, is kept for comparison.
+ *
+ * Once a second, the tool prints the bytes per second in each direction,
+ * along with the turnaround time: how long it took for new data to arrive
+ * after an echo was written. This is the time taken by the path back
+ * through the Pico and the Mac, and is what limits a ping-pong test.
+ *
+ * Usage: mac_ndev_loopback [-d tty] [-s] [-v]
+ *
+ *   -d tty   USB serial device of the Pico (default: /dev/ttyS3)
+ *   -s       Synchronous echo, with tcdrain() after every write
+ *   -v       Print the data as it goes by
+ */
+
 #define TERMINAL    "/dev/ttyS3"
 
-#include <errno.h>
 #include <fcntl.h>
-#include <stdio.h>
+#include <poll.h>
 #include <stdlib.h>
-#include <string.h>
-#include <termios.h>
-#include <unistd.h>
-#include <stdint.h>
-
-int set_interface_attribs(int fd, int speed)
-{
-    struct termios tty;
-
-    if (tcgetattr(fd, &tty) < 0) {
-        printf("Error from tcgetattr: %s\n", strerror(errno));
-        return -1;
-    }
+#include <time.h>
 
-    cfsetospeed(&tty, (speed_t)speed);
-    cfsetispeed(&tty, (speed_t)speed);
+#include <algorithm>
+#include <string>
 
-    tty.c_cflag |= (CLOCAL | CREAD);    /* ignore modem controls */
-    tty.c_cflag &= ~CSIZE;
-    tty.c_cflag |= CS8;         /* 8-bit characters */
-    tty.c_cflag &= ~PARENB;     /* no parity bit */
-    tty.c_cflag &= ~CSTOPB;     /* only need 1 stop bit */
-    tty.c_cflag &= ~CRTSCTS;    /* no hardware flowcontrol */
+#include "mac_ndev_link.h"
 
-    /* setup for non-canonical mode */
-    tty.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON);
-    tty.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
-    tty.c_oflag &= ~OPOST;
-
-    /* fetch bytes as they become available */
-    tty.c_cc[VMIN] = 1;
-    tty.c_cc[VTIME] = 1;
-
-    if (tcsetattr(fd, TCSANOW, &tty) != 0) {
-        printf("Error from tcsetattr: %s\n", strerror(errno));
-        return -1;
-    }
-    return 0;
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-void set_mincount(int fd, int mcount)
+/* Sets how the driver batches incoming bytes: a read returns once "vmin"
+ * bytes have arrived, or once the line has been idle for "vtime" tenths
+ * of a second after the first byte.
+ */
+static void set_batching(int fd, int vmin, int vtime)
 {
     struct termios tty;
 
@@ -53,48 +52,168 @@ void set_mincount(int fd, int mcount)
         return;
     }
 
-    tty.c_cc[VMIN] = mcount ? 1 : 0;
-    tty.c_cc[VTIME] = 5;        /* half second timer */
+    tty.c_cc[VMIN]  = vmin;
+    tty.c_cc[VTIME] = vtime;
 
     if (tcsetattr(fd, TCSANOW, &tty) < 0)
         printf("Error tcsetattr: %s\n", strerror(errno));
 }
 
+struct Stats {
+    unsigned long bytesIn   = 0;
+    unsigned long bytesOut  = 0;
+    unsigned long reads     = 0;
+    unsigned long turns     = 0;      // Turnarounds measured
+    double        turnTotal = 0;
+    double        turnMax   = 0;
+    double        start     = now();
+
+    void turnaround(double t) {
+        turns++;
+        turnTotal += t;
+        turnMax    = std::max(turnMax, t);
+    }
 
-int main()
-{
-    const char *portname = TERMINAL;
-    int fd;
-    int wlen;
-    const char *xstr = "Hello!\n";
-    int xlen = strlen(xstr);
-
-    fd = open(portname, O_RDWR | O_NOCTTY | O_SYNC);
-    if (fd < 0) {
-        printf("Error opening %s: %s\n", portname, strerror(errno));
-        return -1;
+    // Prints and resets the statistics once a second
+    void report() {
+        const double elapsed = now() - start;
+        if (elapsed < 1.0) return;
+        if (bytesIn || bytesOut) {
+            printf("in: %8.0f bytes/s  out: %8.0f bytes/s  reads: %5lu  turnaround: avg %6.2f ms, max %6.2f ms\n",
+                bytesIn / elapsed, bytesOut / elapsed, reads,
+                turns ? turnTotal * 1000 / turns : 0, turnMax * 1000);
+        }
+        *this = Stats();
     }
-    /*baudrate 115200, 8 bits, no parity, 1 stop bit */
-    set_interface_attribs(fd, B115200);
-    //set_mincount(fd, 0);                /* set to pure timed read */
+};
+
+static bool verbose = false;
+
+static void show(const uint8_t *buf, ssize_t len) {
+    if (!verbose) return;
+    fwrite(buf, 1, len, stdout);
+    fflush(stdout);
+}
+
+// The original echo loop: blocking reads and writes, draining every chunk
+
+static void echo_sync(int fd) {
+    Stats stats;
+    double lastWrite = 0;
 
     do {
         uint8_t buf[512];
-        int rdlen = ::read (fd, buf, 512);
+        int rdlen = ::read (fd, buf, sizeof(buf));
         if (rdlen > 0) {
-            for (int i = 0; i < rdlen; i++) {
-                putchar(buf[i]);
-            }
+            if (lastWrite) stats.turnaround(now() - lastWrite);
+            stats.bytesIn += rdlen;
+            stats.reads++;
+            show(buf, rdlen);
             int wlen = ::write(fd, buf, rdlen);
             if (wlen != rdlen) {
                 printf("Error from write: %d, %d\n", wlen, errno);
             }
             tcdrain(fd);    /* delay for output */
-            fflush(stdout);
+            stats.bytesOut += rdlen;
+            lastWrite = now();
         } else if (rdlen < 0) {
             printf("Error from read: %d: %s\n", rdlen, strerror(errno));
-        } else {  /* rdlen == 0 */
-            printf("Timeout from read\n");
         }
+        stats.report();
     } while (1);
 }
+
+// Asynchronous echo: reads are never held up by writes
+
+static void echo_async(int fd) {
+    Stats       stats;
+    std::string queue;
+    double      lastWrite = 0;
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    do {
+        struct pollfd pfd = {fd, short(POLLIN | (queue.empty() ? 0 : POLLOUT)), 0};
+        if (poll(&pfd, 1, 1000) < 0) {
+            if (errno == EINTR) continue;
+            printf("Error from poll: %s\n", strerror(errno));
+            return;
+        }
+
+        if (pfd.revents & POLLIN) {
+            // Take everything the driver has before writing anything back
+            uint8_t buf[4096];
+            ssize_t rdlen;
+            while ((rdlen = ::read(fd, buf, sizeof(buf))) > 0) {
+                if (lastWrite && queue.empty()) {
+                    stats.turnaround(now() - lastWrite);
+                    lastWrite = 0;
+                }
+                stats.bytesIn += rdlen;
+                stats.reads++;
+                show(buf, rdlen);
+                queue.append((const char*)buf, rdlen);
+            }
+            if (rdlen < 0 && errno != EAGAIN && errno != EINTR) {
+                printf("Error from read: %s\n", strerror(errno));
+                return;
+            }
+        }
+
+        if (!queue.empty()) {
+            ssize_t wlen = ::write(fd, queue.data(), queue.size());
+            if (wlen > 0) {
+                queue.erase(0, wlen);
+                stats.bytesOut += wlen;
+                if (queue.empty()) lastWrite = now();
+            } else if (wlen < 0 && errno != EAGAIN && errno != EINTR) {
+                printf("Error from write: %s\n", strerror(errno));
+                return;
+            }
+        }
+        stats.report();
+    } while (1);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *portname = TERMINAL;
+    bool sync = false;
+    int fd;
+
+    for (int i = 1; i < argc; i++) {
+        const std::string opt = argv[i];
+        if (opt == "-d" && i + 1 < argc) {
+            portname = argv[++i];
+        } else if (opt == "-s") {
+            sync = true;
+        } else if (opt == "-v") {
+            verbose = true;
+        } else {
+            printf("Usage: mac_ndev_loopback [-d tty] [-s] [-v]\n");
+            return -1;
+        }
+    }
+
+    fd = open(portname, O_RDWR | O_NOCTTY | (sync ? O_SYNC : 0));
+    if (fd < 0) {
+        printf("Error opening %s: %s\n", portname, strerror(errno));
+        return -1;
+    }
+    /*baudrate 115200, 8 bits, no parity, 1 stop bit */
+    set_interface_attribs(fd, B115200);
+
+    if (sync) {
+        // Return a full block at once when data is streaming in, or whatever
+        // has arrived once the line goes quiet for a tenth of a second.
+        set_batching(fd, 255, 1);
+        printf("Synchronous echo on %s\n", portname);
+        echo_sync(fd);
+    } else {
+        // Reads are driven by poll(), so never wait inside read()
+        set_batching(fd, 0, 0);
+        printf("Asynchronous echo on %s\n", portname);
+        echo_async(fd);
+    }
+    return 0;
+}
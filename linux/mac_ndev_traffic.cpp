@@ -0,0 +1,457 @@
+/* Traffic generator for the Pico USB serial link.
+ *
+ * Sends messages to the Mac through the Pico and times how long it takes
+ * for each one to come back. This needs something on the Mac echoing the
+ * modem port, such as the "Echo serial data" test in FujiTests.
+ *
+ * Each message starts with a sequence number and the time it was queued,
+ * followed by a pattern derived from the sequence number, so that lost,
+ * reordered or corrupted messages can be detected even though the Mac
+ * may split or merge them on the way back.
+ *
+ * There are three modes:
+ *
+ *   rate     Messages are sent at a constant rate. Giving a range of rates,
+ *            such as "-r 100:6400", doubles the rate at each step, which
+ *            traces out a throughput curve.
+ *   burst    Bursts of messages are sent back-to-back at a fixed interval.
+ *   rr       Request/response: a new message is sent only once the
+ *            previous ones have come back, with up to "-w" in flight.
+ *
+ * Once a second, the tool prints the throughput in each direction and the
+ * median latency. At the end of each step it prints the p50/p99/p999
+ * latencies, which can also be appended to a CSV file for plotting. The
+ * bytes out are all those written, while the bytes in only count messages
+ * sent during the step which came back intact; echoes of an earlier step,
+ * or an earlier run, are told apart by the time they were sent and left out.
+ *
+ * Usage: mac_ndev_traffic [-d tty] [-m rate|burst|rr] [-r rate[:max]]
+ *                         [-s size] [-b count] [-i ms] [-w window]
+ *                         [-t seconds] [-o file.csv] [-u]
+ *
+ *   -d tty      USB serial device of the Pico (default: /dev/ttyS3)
+ *   -m mode     Traffic pattern (default: rate)
+ *   -r rate     Messages per second in rate mode (default: 100)
+ *   -s size     Message size in bytes, at least 14 (default: 64)
+ *   -b count    Messages per burst in burst mode (default: 16)
+ *   -i ms       Interval between bursts in burst mode (default: 100)
+ *   -w window   Messages in flight in request/response mode (default: 1)
+ *   -t seconds  Duration of each step (default: 10)
+ *   -o file     Append a line of results for each step to a CSV file
+ *   -u          Unframed; use when MAC_NDEV_USB_FRAMING is not set
+ */
+
+#define TERMINAL    "/dev/ttyS3"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "mac_ndev_link.h"
+
+#define MSG_MAGIC       0xA55A
+#define MSG_HDR_LEN     14      // U16 magic, U32 sequence, U64 timestamp
+#define MAX_QUEUED      65536   // Don't let the output queue grow past this
+#define RR_TIMEOUT      1.0     // Seconds before an unanswered request is lost
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+enum Mode {RATE, BURST, RR};
+
+struct Options {
+    const char *portname  = TERMINAL;
+    const char *csv       = nullptr;
+    Mode        mode      = RATE;
+    double      rate      = 100;
+    double      maxRate   = 0;
+    size_t      size      = 64;
+    int         burst     = 16;
+    double      interval  = 0.1;
+    unsigned    window    = 1;
+    double      duration  = 10;
+    bool        framed    = true;
+} opt;
+
+/* Collects latencies and returns percentiles */
+
+class Latencies {
+    public:
+        void add(double t) {samples.push_back(t);}
+        size_t count() const {return samples.size();}
+        void clear() {samples.clear();}
+
+        // Returns the p-th percentile in milliseconds
+        double percentile(double p) {
+            if (samples.empty()) return 0;
+            std::sort(samples.begin(), samples.end());
+            const size_t i = std::min(samples.size() - 1, size_t(p * samples.size()));
+            return samples[i] * 1000;
+        }
+
+    private:
+        std::vector<double> samples;
+};
+
+struct Counters {
+    unsigned long sent      = 0;    // Messages sent
+    unsigned long received  = 0;    // Messages that came back intact
+    unsigned long lost      = 0;    // Gaps in the sequence numbers
+    unsigned long reordered = 0;    // Messages arriving after a later one
+    unsigned long corrupted = 0;    // Times we had to resynchronize
+    unsigned long throttled = 0;    // Messages not sent as the queue was full
+    unsigned long stale     = 0;    // Messages sent before the step started
+    unsigned long bytesOut  = 0;
+    unsigned long bytesIn   = 0;
+};
+
+class Generator {
+    public:
+        Generator(int fd) : fd(fd) {}
+        void runStep(double rate);
+
+    private:
+        int           fd;
+        std::string   outQueue;
+        std::string   inQueue;
+        FrameReader   frames;
+        uint32_t      nextSeq = 0;
+        uint32_t      expectSeq = 0;
+        double        lastReceive = 0;
+        double        stepStart = 0;
+        Counters      step, tick;
+        Latencies     stepLatency, tickLatency;
+
+        unsigned inFlight() const {return nextSeq - expectSeq;}
+        void queueMessage();
+        void received(const uint8_t *data, size_t len);
+        void parseMessages();
+        bool service(double until);
+        void printTick(double elapsed);
+        void printStep(double rate, double elapsed);
+};
+
+static void fillPattern(uint8_t *msg, size_t len, uint32_t seq) {
+    for (size_t i = MSG_HDR_LEN; i < len; i++) {
+        msg[i] = (seq + i) & 0xFF;
+    }
+}
+
+void Generator::queueMessage() {
+    if (outQueue.size() > MAX_QUEUED) {
+        step.throttled++;
+        return;
+    }
+
+    uint8_t msg[MAC_NDEV_MAX_PAYLOAD];
+    const uint16_t magic = MSG_MAGIC;
+    const uint64_t nsecs = uint64_t(now() * 1e9);
+    memcpy(msg,     &magic,   2);
+    memcpy(msg + 2, &nextSeq, 4);
+    memcpy(msg + 6, &nsecs,   8);
+    fillPattern(msg, opt.size, nextSeq);
+    nextSeq++;
+
+    if (opt.framed) {
+        const uint8_t hdr[MAC_NDEV_FRAME_LEN] = {
+            MAC_NDEV_CHAN_SERIAL, MAC_NDEV_CMD_DATA,
+            uint8_t(opt.size >> 8), uint8_t(opt.size & 0xFF)
+        };
+        outQueue.append((const char*)hdr, sizeof(hdr));
+    }
+    outQueue.append((const char*)msg, opt.size);
+    step.sent++;
+    tick.sent++;
+}
+
+void Generator::received(const uint8_t *data, size_t len) {
+    if (!opt.framed) {
+        inQueue.append((const char*)data, len);
+        return;
+    }
+    while (len) {
+        const size_t n = std::min(len, frames.space());
+        frames.add(data, n);
+        data += n;
+        len  -= n;
+        while (frames.next()) {
+            if (frames.chan == MAC_NDEV_CHAN_SERIAL && frames.cmd == MAC_NDEV_CMD_DATA) {
+                inQueue.append((const char*)frames.payload, frames.len);
+            }
+        }
+    }
+}
+
+/* Splits the echoed byte stream back into messages. If a message does not
+ * check out, bytes are skipped until one does.
+ */
+
+void Generator::parseMessages() {
+    const double t = now();
+    size_t pos = 0;
+    bool   inSync = true;
+    while (inQueue.size() - pos >= opt.size) {
+        const uint8_t *msg = (const uint8_t*)inQueue.data() + pos;
+        uint16_t magic;
+        uint32_t seq;
+        uint64_t nsecs;
+        memcpy(&magic, msg,     2);
+        memcpy(&seq,   msg + 2, 4);
+        memcpy(&nsecs, msg + 6, 8);
+
+        bool valid = magic == MSG_MAGIC;
+        for (size_t i = MSG_HDR_LEN; valid && i < opt.size; i++) {
+            valid = msg[i] == ((seq + i) & 0xFF);
+        }
+        if (!valid) {
+            if (inSync) step.corrupted++;
+            inSync = false;
+            pos++;
+            continue;
+        }
+        inSync = true;
+        pos += opt.size;
+
+        if (nsecs / 1e9 < stepStart) {
+            step.stale++;
+            continue;
+        }
+        if (int32_t(seq - expectSeq) < 0) {
+            step.reordered++;
+        } else {
+            step.lost += seq - expectSeq;
+            expectSeq  = seq + 1;
+        }
+        const double latency = t - nsecs / 1e9;
+        stepLatency.add(latency);
+        tickLatency.add(latency);
+        step.received++;
+        tick.received++;
+        step.bytesIn += opt.size;
+        tick.bytesIn += opt.size;
+        lastReceive = t;
+    }
+    inQueue.erase(0, pos);
+}
+
+/* Moves data in and out until "until" or until there is room for another
+ * request. Returns false on a fatal error.
+ */
+
+bool Generator::service(double until) {
+    do {
+        const double wait = std::max(0.0, until - now());
+        struct timespec ts = {time_t(wait), long((wait - time_t(wait)) * 1e9)};
+        struct pollfd pfd = {fd, short(POLLIN | (outQueue.empty() ? 0 : POLLOUT)), 0};
+        if (ppoll(&pfd, 1, &ts, nullptr) < 0) {
+            if (errno == EINTR) continue;
+            printf("Error from poll: %s\n", strerror(errno));
+            return false;
+        }
+
+        if (pfd.revents & POLLIN) {
+            uint8_t buf[4096];
+            ssize_t rdlen;
+            while ((rdlen = ::read(fd, buf, sizeof(buf))) > 0) {
+                received(buf, rdlen);
+            }
+            if (rdlen < 0 && errno != EAGAIN && errno != EINTR) {
+                printf("Error from read: %s\n", strerror(errno));
+                return false;
+            }
+            parseMessages();
+        }
+
+        if (!outQueue.empty()) {
+            ssize_t wlen = ::write(fd, outQueue.data(), outQueue.size());
+            if (wlen > 0) {
+                outQueue.erase(0, wlen);
+                step.bytesOut += wlen;
+                tick.bytesOut += wlen;
+            } else if (wlen < 0 && errno != EAGAIN && errno != EINTR) {
+                printf("Error from write: %s\n", strerror(errno));
+                return false;
+            }
+        }
+
+        if (opt.mode == RR && inFlight() < opt.window) break;
+    } while (now() < until);
+    return true;
+}
+
+void Generator::printTick(double elapsed) {
+    printf("out: %8.0f bytes/s  in: %8.0f bytes/s  msgs: %6.0f/s  p50: %7.2f ms  in flight: %u\n",
+        tick.bytesOut / elapsed, tick.bytesIn / elapsed, tick.received / elapsed,
+        tickLatency.percentile(0.5), inFlight());
+    tick = Counters();
+    tickLatency.clear();
+}
+
+void Generator::printStep(double rate, double elapsed) {
+    const double p50 = stepLatency.percentile(0.5), p99 = stepLatency.percentile(0.99),
+                 p999 = stepLatency.percentile(0.999), max = stepLatency.percentile(1);
+    printf("\n");
+    if (opt.mode == RATE) printf("Offered rate:  %.0f msgs/s\n", rate);
+    printf("Throughput:    out %.0f bytes/s, in %.0f bytes/s, %.0f msgs/s\n",
+        step.bytesOut / elapsed, step.bytesIn / elapsed, step.received / elapsed);
+    printf("Messages:      %lu sent, %lu received, %lu lost, %lu reordered, %lu resyncs, %lu throttled, %lu stale\n",
+        step.sent, step.received, step.lost, step.reordered, step.corrupted, step.throttled, step.stale);
+    printf("Latency:       p50 %.2f ms, p99 %.2f ms, p999 %.2f ms, max %.2f ms\n\n", p50, p99, p999, max);
+
+    if (opt.csv) {
+        FILE *f = fopen(opt.csv, "a");
+        if (!f) {
+            printf("Error opening %s: %s\n", opt.csv, strerror(errno));
+            return;
+        }
+        if (ftell(f) == 0) {
+            fprintf(f, "mode,size,rate,window,out_bps,in_bps,msgs_per_sec,sent,received,lost,p50_ms,p99_ms,p999_ms,max_ms\n");
+        }
+        static const char *modes[] = {"rate", "burst", "rr"};
+        fprintf(f, "%s,%zu,%.0f,%u,%.0f,%.0f,%.1f,%lu,%lu,%lu,%.3f,%.3f,%.3f,%.3f\n",
+            modes[opt.mode], opt.size, rate, opt.window, step.bytesOut / elapsed, step.bytesIn / elapsed,
+            step.received / elapsed, step.sent, step.received, step.lost, p50, p99, p999, max);
+        fclose(f);
+    }
+}
+
+void Generator::runStep(double rate) {
+    step = tick = Counters();
+    stepLatency.clear();
+    tickLatency.clear();
+
+    const double start = now(), end = start + opt.duration;
+    double nextSend = start, nextTick = start + 1, tickStart = start;
+    lastReceive = start;
+    stepStart   = start;
+
+    while (now() < end) {
+        const double t = now();
+        switch (opt.mode) {
+            case RATE:
+                // Catch up if we fell behind, but not by more than a burst
+                for (int i = 0; nextSend <= t && i < 64; i++) {
+                    queueMessage();
+                    nextSend += 1 / rate;
+                }
+                if (nextSend <= t) nextSend = t;
+                break;
+            case BURST:
+                if (nextSend <= t) {
+                    for (int i = 0; i < opt.burst; i++) queueMessage();
+                    nextSend += opt.interval;
+                }
+                break;
+            case RR:
+                if (inFlight() && t - lastReceive > RR_TIMEOUT) {
+                    // Give up on whatever is outstanding
+                    step.lost += inFlight();
+                    expectSeq  = nextSeq;
+                    lastReceive = t;
+                }
+                while (inFlight() < opt.window) queueMessage();
+                nextSend = t + RR_TIMEOUT;
+                break;
+        }
+
+        if (!service(std::min(std::min(nextSend, nextTick), end))) exit(-1);
+
+        if (now() >= nextTick) {
+            printTick(now() - tickStart);
+            tickStart = now();
+            nextTick += 1;
+        }
+    }
+
+    // Give the last few messages a chance to come back, without counting
+    // the extra time against the throughput
+    const double elapsed = now() - start;
+    const double drainUntil = now() + 0.5;
+    while (inFlight() && now() < drainUntil && service(drainUntil));
+    step.lost += inFlight();
+    expectSeq  = nextSeq;
+    printStep(rate, elapsed);
+}
+
+int main(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        const char *val = i + 1 < argc ? argv[i + 1] : "";
+        bool ok = true;
+        if (arg == "-u") {
+            opt.framed = false;
+            continue;
+        } else if (i + 1 == argc) {
+            ok = false;
+        } else if (arg == "-d") {
+            opt.portname = val;
+        } else if (arg == "-o") {
+            opt.csv = val;
+        } else if (arg == "-m") {
+            const std::string m = val;
+            opt.mode = m == "burst" ? BURST : m == "rr" ? RR : RATE;
+            ok = m == "burst" || m == "rr" || m == "rate";
+        } else if (arg == "-r") {
+            opt.rate = atof(val);
+            const char *colon = strchr(val, ':');
+            if (colon) opt.maxRate = atof(colon + 1);
+        } else if (arg == "-s") {
+            opt.size = atoi(val);
+        } else if (arg == "-b") {
+            opt.burst = atoi(val);
+        } else if (arg == "-i") {
+            opt.interval = atof(val) / 1000;
+        } else if (arg == "-w") {
+            opt.window = atoi(val);
+        } else if (arg == "-t") {
+            opt.duration = atof(val);
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            printf("Usage: mac_ndev_traffic [-d tty] [-m rate|burst|rr] [-r rate[:max]]\n"
+                   "                        [-s size] [-b count] [-i ms] [-w window]\n"
+                   "                        [-t seconds] [-o file.csv] [-u]\n");
+            return -1;
+        }
+        i++;
+    }
+
+    if (opt.size < MSG_HDR_LEN || opt.size > MAC_NDEV_MAX_PAYLOAD) {
+        printf("Message size must be between %d and %d bytes\n", MSG_HDR_LEN, MAC_NDEV_MAX_PAYLOAD);
+        return -1;
+    }
+    if (opt.rate <= 0 || opt.window < 1 || opt.burst < 1) {
+        printf("Invalid rate, window or burst size\n");
+        return -1;
+    }
+
+    int fd = open(opt.portname, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0) {
+        printf("Error opening %s: %s\n", opt.portname, strerror(errno));
+        return -1;
+    }
+    /*baudrate 115200, 8 bits, no parity, 1 stop bit */
+    set_interface_attribs(fd, B115200);
+    tcflush(fd, TCIOFLUSH);
+
+    Generator gen(fd);
+    double rate = opt.rate;
+    do {
+        if (opt.mode == RATE) printf("Sending %zu byte messages at %.0f msgs/s\n", opt.size, rate);
+        if (opt.mode == BURST) printf("Sending bursts of %d %zu byte messages every %.0f ms\n", opt.burst, opt.size, opt.interval * 1000);
+        if (opt.mode == RR) printf("Sending %zu byte requests, %u in flight\n", opt.size, opt.window);
+        gen.runStep(rate);
+        rate *= 2;
+    } while (opt.mode == RATE && rate <= opt.maxRate);
+    return 0;
+}
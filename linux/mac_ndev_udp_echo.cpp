@@ -0,0 +1,75 @@
+/* UDP echo server, for use with the MacTCP UDP benchmark in FujiTests.
+ *
+ * Every datagram received is sent back to where it came from. Once a
+ * second, while datagrams are arriving, the number of packets and bytes
+ * echoed in that second is printed.
+ *
+ * Usage: mac_ndev_udp_echo [port]
+ */
+
+#define DEFAULT_PORT 7777
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    const int port = argc > 1 ? atoi(argv[1]) : DEFAULT_PORT;
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port        = htons(port);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        printf("Error binding port %d: %s\n", port, strerror(errno));
+        return -1;
+    }
+    printf("Echoing UDP datagrams on port %d\n", port);
+
+    unsigned long packets = 0, bytes = 0, total = 0;
+    double start = now();
+
+    do {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd, 1, 1000) > 0) {
+            uint8_t buf[2048];
+            struct sockaddr_in from = {};
+            socklen_t fromlen = sizeof(from);
+            ssize_t n = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr*)&from, &fromlen);
+            if (n < 0) {
+                printf("Error from recvfrom: %s\n", strerror(errno));
+                continue;
+            }
+            if (sendto(fd, buf, n, 0, (struct sockaddr*)&from, fromlen) < 0) {
+                printf("Error from sendto: %s\n", strerror(errno));
+            }
+            packets++;
+            bytes += n;
+        }
+
+        const double elapsed = now() - start;
+        if (elapsed >= 1.0) {
+            if (packets) {
+                total += packets;
+                printf("%6.1f packets/sec, %7.1f bytes/sec (%lu total)\n", packets / elapsed, bytes / elapsed, total);
+            }
+            packets = bytes = 0;
+            start = now();
+        }
+    } while (1);
+}
@@ -0,0 +1,210 @@
+/* Access to the data interface of a Pico built with MAC_NDEV_USB_VENDOR.
+ *
+ * The Pico then has a vendor interface with a pair of bulk endpoints for
+ * the framed data, next to the CDC port which carries its log messages.
+ * No kernel driver binds to a vendor interface, so it is claimed through
+ * usbfs, which needs no library, only write access to the device node in
+ * "/dev/bus/usb" (a udev rule matching the VID and PID, or root).
+ *
+ * usbfs transfers are blocking, so "open_usbfs_link" starts a thread for
+ * each direction and returns one end of a socket pair. The tools can then
+ * read and write the frames as they would with the tty of the CDC port;
+ * the link is closed if the Pico goes away.
+ *
+ * The same interface can also be reached as a tty by binding the kernel's
+ * generic USB serial driver to it:
+ *
+ *   modprobe usbserial
+ *   echo 2e8a 000a > /sys/bus/usb-serial/drivers/generic/new_id
+ */
+
+#pragma once
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <linux/usbdevice_fs.h>
+
+#include <string>
+#include <thread>
+
+#define MAC_NDEV_USB_VID      0x2E8A
+#define MAC_NDEV_USB_PID      0x000A
+
+struct UsbfsLink {
+    int     dev  = -1;                    // usbfs device node
+    int     sock = -1;                    // Our end of the socket pair
+    int     itf  = -1;
+    uint8_t epIn = 0, epOut = 0;
+};
+
+static uint16_t usbfs_read_hex(const std::string &path) {
+    FILE *f = fopen(path.c_str(), "r");
+    unsigned v = 0;
+    if (f) {
+        if (fscanf(f, "%x", &v) != 1) v = 0;
+        fclose(f);
+    }
+    return v;
+}
+
+static int usbfs_read_int(const std::string &path) {
+    FILE *f = fopen(path.c_str(), "r");
+    int v = -1;
+    if (f) {
+        if (fscanf(f, "%d", &v) != 1) v = -1;
+        fclose(f);
+    }
+    return v;
+}
+
+// Returns the usbfs node of the first device with a VID and PID, or ""
+
+static std::string usbfs_find_device(uint16_t vid, uint16_t pid) {
+    const std::string sys = "/sys/bus/usb/devices/";
+    std::string node;
+    DIR *d = opendir(sys.c_str());
+    if (!d) return node;
+    while (struct dirent *e = readdir(d)) {
+        const std::string dir = sys + e->d_name + "/";
+        if (e->d_name[0] == '.' || strchr(e->d_name, ':')) continue;
+        if (usbfs_read_hex(dir + "idVendor") != vid || usbfs_read_hex(dir + "idProduct") != pid) continue;
+        char path[64];
+        snprintf(path, sizeof(path), "/dev/bus/usb/%03d/%03d", usbfs_read_int(dir + "busnum"), usbfs_read_int(dir + "devnum"));
+        node = path;
+        break;
+    }
+    closedir(d);
+    return node;
+}
+
+/* Reading the device node returns the device descriptor followed by the
+ * configuration descriptors. Finds the first vendor-specific interface
+ * with a bulk IN and a bulk OUT endpoint.
+ */
+static bool usbfs_find_interface(UsbfsLink &link) {
+    uint8_t desc[1024];
+    const ssize_t len = ::read(link.dev, desc, sizeof(desc));
+    int itf = -1;
+    uint8_t in = 0, out = 0;
+    for (ssize_t i = 0; i + 2 <= len && desc[i] >= 2; i += desc[i]) {
+        const uint8_t *d = desc + i;
+        if (d[1] == 4 && desc[i] >= 9) {            // Interface
+            if (itf >= 0 && in && out) break;
+            itf = (d[5] == 0xFF) ? d[2] : -1;
+            in  = out = 0;
+        } else if (d[1] == 5 && itf >= 0 && (d[3] & 3) == 2) {   // Bulk endpoint
+            if (d[2] & 0x80) in = d[2]; else out = d[2];
+        }
+    }
+    if (itf < 0 || !in || !out) return false;
+    link.itf   = itf;
+    link.epIn  = in;
+    link.epOut = out;
+    return true;
+}
+
+static int usbfs_bulk(int dev, uint8_t ep, void *buf, size_t len, unsigned timeout) {
+    struct usbdevfs_bulktransfer xfer = {};
+    xfer.ep      = ep;
+    xfer.len     = len;
+    xfer.timeout = timeout;
+    xfer.data    = buf;
+    return ioctl(dev, USBDEVFS_BULK, &xfer);
+}
+
+// Pico to socket; a multiple of the packet size, so short packets end a read
+
+static void usbfs_pump_in(UsbfsLink link) {
+    uint8_t buf[4096];
+    for (;;) {
+        const int n = usbfs_bulk(link.dev, link.epIn, buf, sizeof(buf), 0);
+        if (n < 0) {
+            if (errno == EINTR || errno == ETIMEDOUT) continue;
+            printf("Error reading from the Pico: %s\n", strerror(errno));
+            break;
+        }
+        if (n && send(link.sock, buf, n, MSG_NOSIGNAL) != n) break;
+    }
+    shutdown(link.sock, SHUT_RDWR);
+}
+
+/* Socket to Pico; the Pico takes up to a FIFO's worth at a time. There is
+ * no timeout, as usbfs does not say how much of a transfer went out before
+ * one, and sending the rest again would repeat the packets the Pico took,
+ * while it may stop reading for a while when its block pool is full.
+ */
+
+static void usbfs_pump_out(UsbfsLink link) {
+    uint8_t buf[4096];
+    for (;;) {
+        const ssize_t n = recv(link.sock, buf, sizeof(buf), 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            break;
+        }
+        ssize_t done = 0;
+        while (done < n) {
+            const int w = usbfs_bulk(link.dev, link.epOut, buf + done, n - done, 0);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                printf("Error writing to the Pico: %s\n", strerror(errno));
+                shutdown(link.sock, SHUT_RDWR);
+                return;
+            }
+            done += w;
+        }
+    }
+}
+
+/* Opens the data interface of the Pico, given as "vid:pid" in hex, as a
+ * "/dev/bus/usb" node, or as "" for the default VID and PID. Returns a
+ * socket which carries the data both ways, or -1.
+ */
+static int open_usbfs_link(const char *spec) {
+    UsbfsLink   link;
+    std::string node = spec;
+    unsigned    vid = MAC_NDEV_USB_VID, pid = MAC_NDEV_USB_PID;
+
+    if (node.empty() || sscanf(spec, "%x:%x", &vid, &pid) == 2) {
+        node = usbfs_find_device(vid, pid);
+        if (node.empty()) {
+            printf("No USB device %04x:%04x found\n", vid, pid);
+            return -1;
+        }
+    }
+    link.dev = open(node.c_str(), O_RDWR);
+    if (link.dev < 0) {
+        printf("Error opening %s: %s\n", node.c_str(), strerror(errno));
+        return -1;
+    }
+    if (!usbfs_find_interface(link)) {
+        printf("%s has no vendor interface; is MAC_NDEV_USB_VENDOR set on the Pico?\n", node.c_str());
+        close(link.dev);
+        return -1;
+    }
+    unsigned int itf = link.itf;
+    if (ioctl(link.dev, USBDEVFS_CLAIMINTERFACE, &itf) < 0) {
+        printf("Error claiming interface %d of %s: %s\n", itf, node.c_str(), strerror(errno));
+        close(link.dev);
+        return -1;
+    }
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        printf("Error from socketpair: %s\n", strerror(errno));
+        close(link.dev);
+        return -1;
+    }
+    link.sock = sv[1];
+    std::thread(usbfs_pump_in,  link).detach();
+    std::thread(usbfs_pump_out, link).detach();
+    printf("Using interface %d of %s (endpoints %02x, %02x)\n", link.itf, node.c_str(), link.epIn, link.epOut);
+    return sv[0];
+}
@@ -79,20 +79,124 @@
  * the Mac serial driver may assume more data is available and
  * repeat the request.
  *
+ * Framed Mode:
+ *
+ * When MAC_NDEV_ESP_FRAMING is set, 'S' messages are not used.
+ * Instead, either side may send the other a frame at any time,
+ * without waiting to be asked. Frames are SLIP encoded: each one
+ * starts and ends with END [0xC0], and any END or ESC [0xDB]
+ * byte within it is sent as ESC followed by 0xDC or 0xDD. The
+ * first byte of a frame gives its type:
+ *
+ *           +-------+-----------+-------------------------------+
+ *           | Type  | Direction | Followed by                   |
+ *           +-------+-----------+-------------------------------+
+ *           | 'D'   | Both      | U8 channel, U8 command, data  |
+ *           | 'C'   | Both      | U16 credit, U8 frames         |
+ *           | 'A'   | To Pico   | U8 channel, U16 bytes waiting |
+ *           | 'r'   | To Pico   | 512 bytes of a sector         |
+ *           | 'w'   | To Pico   | Nothing, write done           |
+ *           | 'e'   | To Pico   | Nothing, write refused        |
+ *           +-------+-----------+-------------------------------+
+ *
+ * A 'D' frame carries up to 500 bytes of data for a channel,
+ * with the same channels and commands as the blocks exchanged
+ * with the Mac (see below). Each side starts out able to send
+ * the other 2000 bytes of 'D' frames, counting four bytes for
+ * each frame on top of the data; a 'C' frame tells the other
+ * side it may send that many more, as the receiver has made
+ * room for them. As the Pico keeps each 'D' frame in a block
+ * of its pool until the Mac has read it, the ESP32 may also
+ * only send seven frames ahead, and the last byte of a 'C'
+ * frame gives the number of frames the receiver has made room
+ * for, which the Pico ignores. An 'A' frame tells the Pico how many bytes
+ * the ESP32 is holding back on a channel for want of credit,
+ * which the Pico passes on to the Mac so that it keeps reading.
+ *
+ * The Pico still sends 'R' and 'W' as before, outside of any
+ * frame, but everything the ESP32 sends is framed, so that the
+ * answers to 'R' and 'W' come back as 'r', 'w' or 'e' frames
+ * and can never be confused with data being pushed at the
+ * same time.
+ *
+ */
+
+/* Channels:
+ *
+ * Each 512 byte block exchanged with the Mac starts with a 12 byte
+ * header. Bytes 4 and 5 of the header identify the channel the data
+ * belongs to and a command for that channel:
+ *
+ *           +---------------+--------------+------------------+
+ *           | No. of bytes  | Type [Value] | Description      |
+ *           +---------------+--------------+------------------+
+ *           | 4             | CHAR[4]      | "NDEV" or "FUJI" |
+ *           | 1             | U8           | channel          |
+ *           | 1             | U8           | command          |
+ *           | 2             | U16          | length or avail  |
+ *           | 2             | U16          | length (replies) |
+ *           | 2             | U16          | session ID       |
+ *           +---------------+--------------+------------------+
+ *
+ * On blocks written by the Mac, bytes 6-7 hold the payload length.
+ * On blocks read by the Mac, bytes 6-7 hold the number of bytes
+ * waiting on that channel, including the ones in the block, while
+ * bytes 8-9 hold the payload length of the block itself.
+ *
+ * Bytes 10-11 of blocks read by the Mac hold a session ID, which is
+ * picked when the Pico starts up and stays the same until it restarts.
+ * A read from MAC_NDEV_STATUS_LBA returns just the header, without
+ * taking any data from the queues, so the Mac can cheaply check that
+ * a connection it set up earlier is still good.
+ *
+ * Channel 0 is the serial port, which carries a plain byte stream.
+ * Other channels carry MacTCP streams, for which the command may be
+ * DATA, OPEN, CLOSE, ABORT or WINDOW (see MAC_NDEV_CMD_*). These are
+ * not interpreted by the Pico but are passed on to the far side,
+ * where the TCP connections are made.
+ *
+ * When MAC_NDEV_USB_FRAMING is set, data is exchanged with the USB
+ * host as a sequence of frames, each made up of the channel, the
+ * command and a U16 length, followed by the payload. Frames sent by
+ * the host must not have a payload larger than 500 bytes. When not
+ * set, only the serial channel is bridged, as a raw byte stream.
+ *
+ * When MAC_NDEV_USB_VENDOR is also set, the frames go through a vendor
+ * interface with a bulk endpoint pair of its own, while the CDC port only
+ * carries the "MacNDev:" messages (see "mac_ndev_usb_descriptors.h").
  */
 
 #pragma once
 
 #include <ctype.h>
 
+#ifndef MAC_NDEV_LOOPBACK_TEST
 #define MAC_NDEV_LOOPBACK_TEST   0
+#endif
+#ifndef MAC_NDEV_USB_SERIAL_TEST
 #define MAC_NDEV_USB_SERIAL_TEST 1
+#endif
+#define MAC_NDEV_USB_FRAMING     1  // Tag USB data with channel frames
+#define MAC_NDEV_USB_VENDOR      0  // Data on its own USB interface, away from stdio
+#ifndef MAC_NDEV_ESP_FRAMING
+#define MAC_NDEV_ESP_FRAMING     0  // Full-duplex frames to the ESP32, in place of 'S' polls
+#endif
+#ifndef MAC_NDEV_CORE1
+#define MAC_NDEV_CORE1           0  // Move USB and loopback data to the second core
+#endif
 
 #define MAC_NDEV_KNOCK_SEQ    {0,70,85,74,73}  // Macintosh -> FujiNet
 #define MAC_NDEV_REQUEST_TAG  "NDEV"           // Macintosh -> FujiNet
 #define MAC_NDEV_REPLY_TAG    "FUJI"           // FujiNet -> Macintosh
 #define MAC_NDEV_HEADER_LEN   12
+#define MAC_NDEV_FRAME_LEN    4
+#define MAC_NDEV_MAX_PAYLOAD  (512 - MAC_NDEV_HEADER_LEN)
 #define MAC_NDEV_NEGATIVE_LBA 0x007FFFFF
+#define MAC_NDEV_STATUS_LBA   0x007FFFFE
+#define MAC_NDEV_MAX_DRIVES   8
+
+#define MAC_NDEV_CHAN_SERIAL  0
+#define MAC_NDEV_CMD_DATA     0
 
 #define MAC_NDEV_ESP32_CMD    'S'
 
@@ -106,16 +210,44 @@ enum {
     MAC_NDEV_WAIT_MAGIC_WRITE,
     MAC_NDEV_WAIT_MAGIC_READ,
     MAC_NDEV_WAIT_MAGIC_SECTOR
-} mac_ndev_state;
+};
 
 typedef enum {
     MAC_NDEV_READ,
     MAC_NDEV_WRITE
 } mac_ndev_mode;
 
-uint8_t  mac_ndev_knock = 0;
-uint8_t  mac_ndev_drive;
-uint32_t mac_ndev_sector;
+/* The Mac may connect through several DCD drives at once, so the
+ * handshake state is kept separately for each drive. Every channel is
+ * owned by the drive which last wrote to it, and data arriving for that
+ * channel is only returned by reads through that drive.
+ */
+
+typedef struct {
+    uint8_t  state;
+    uint8_t  knock;
+    bool     active;     // Handshake complete or negative LBA in use
+    uint32_t sector;
+} MacNDevConn;
+
+MacNDevConn mac_ndev_conns[MAC_NDEV_MAX_DRIVES] = {0};
+uint8_t     mac_ndev_chan_owner[256] = {0};   // Drive number plus one, or zero
+uint16_t    mac_ndev_session = 0;
+
+/* Returns true if reads through "drive" should return data for "chan" */
+
+bool mac_ndev_owns_channel(uint8_t drive, uint8_t chan) {
+    if (mac_ndev_chan_owner[chan]) {
+        return mac_ndev_chan_owner[chan] == drive + 1;
+    }
+    // Channels no drive has written to yet go to the first active drive
+    for (uint8_t i = 0; i < MAC_NDEV_MAX_DRIVES; i++) {
+        if (mac_ndev_conns[i].active) {
+            return i == drive;
+        }
+    }
+    return true;
+}
 
 void printHexDump(const uint8_t *ptr, uint16_t len) {
     short n = MIN(15, len);
@@ -133,19 +265,23 @@ void printHexDump(const uint8_t *ptr, uint16_t len) {
  * This header is not used for serial communications to the ESP32.
  */
 
-void mac_ndev_put_header(uint8_t buff[], uint16_t len) {
+void mac_ndev_put_header(uint8_t buff[], uint8_t chan, uint8_t cmd, uint16_t avail, uint16_t len) {
+    // Pick a session ID the first time one is needed; it must not be zero
+    while (mac_ndev_session == 0) {
+        mac_ndev_session = time_us_32() & 0xFFFF;
+    }
     buff[ 0] = MAC_NDEV_REPLY_TAG[0];
     buff[ 1] = MAC_NDEV_REPLY_TAG[1];
     buff[ 2] = MAC_NDEV_REPLY_TAG[2];
     buff[ 3] = MAC_NDEV_REPLY_TAG[3];
-    buff[ 4] = 0;
-    buff[ 5] = 0;
-    buff[ 6] = UINT16_HI_BYTE(len);
-    buff[ 7] = UINT16_LO_BYTE(len);
-    buff[ 8] = 0;
-    buff[ 9] = 0;
-    buff[10] = 0;
-    buff[11] = 0;
+    buff[ 4] = chan;
+    buff[ 5] = cmd;
+    buff[ 6] = UINT16_HI_BYTE(avail);
+    buff[ 7] = UINT16_LO_BYTE(avail);
+    buff[ 8] = UINT16_HI_BYTE(len);
+    buff[ 9] = UINT16_LO_BYTE(len);
+    buff[10] = UINT16_HI_BYTE(mac_ndev_session);
+    buff[11] = UINT16_LO_BYTE(mac_ndev_session);
 }
 
 /* This function reads the 12 bytes of header data that are used for
@@ -155,12 +291,14 @@ void mac_ndev_put_header(uint8_t buff[], uint16_t len) {
  * This header is not used for serial communications to the ESP32.
  */
 
-bool mac_ndev_get_header(uint8_t buff[], uint16_t *len) {
+bool mac_ndev_get_header(uint8_t buff[], uint8_t *chan, uint8_t *cmd, uint16_t *len) {
     if (memcmp(buff, MAC_NDEV_REQUEST_TAG, 4)) {
         //printf("MacNDev: Invalid tag on I/O request: %4s\n", buff);
         return false;
     } else {
-        *len = CHARS_TO_UINT16(buff[6], buff[7]);
+        *chan = buff[4];
+        *cmd  = buff[5];
+        *len  = CHARS_TO_UINT16(buff[6], buff[7]);
         return true;
     }
 }
@@ -170,122 +308,1669 @@ bool mac_ndev_get_header(uint8_t buff[], uint16_t *len) {
  * sequence. It is used during handshaking to allow the Mac FujiNet
  * serial driver to announce its presence.
  */
-bool mac_ndev_detect_knock_sequence(uint32_t sector) {
-    const int mac_ndev_knock_sequence[5] = MAC_NDEV_KNOCK_SEQ;
+bool mac_ndev_detect_knock_sequence(MacNDevConn *conn, uint32_t sector) {
+    const uint32_t mac_ndev_knock_sequence[5] = MAC_NDEV_KNOCK_SEQ;
 
-    if (sector == mac_ndev_knock_sequence[mac_ndev_knock]) {
-        printf("MacNDev: Got knock %d\n", mac_ndev_knock);
-        if (++mac_ndev_knock == NELEMENTS(mac_ndev_knock_sequence)) {
+    if (sector == mac_ndev_knock_sequence[conn->knock]) {
+        printf("MacNDev: Got knock %d\n", conn->knock);
+        if (++conn->knock == NELEMENTS(mac_ndev_knock_sequence)) {
             printf("MacNDev: Knock sequence complete!\n");
-            mac_ndev_knock = 0;
+            conn->knock = 0;
             return true;
         }
     } else {
-        mac_ndev_knock = 0;
+        conn->knock = 0;
     }
     return false;
 }
 
-/***************************** Fifo Queue Object *****************************/
+/***************************** Block Pool Object ******************************/
+
+/* Data on its way to the Mac is kept in a fixed pool of blocks, each laid
+ * out as the Mac will read it: the payload is received straight into place
+ * behind room for the 12 byte header, which is only filled in once the Mac
+ * asks for the block. From then on, the block is handed from the producer
+ * to the consumer by pointer, and copied only once, into the floppy code's
+ * buffer, when the Mac reads it.
+ *
+ * A block is owned by whoever holds a reference to it, and goes back to
+ * the pool when the last one is released. With MAC_NDEV_CORE1, blocks are
+ * taken and released on both cores, so the pool is locked while it is
+ * changed; otherwise, the lock does nothing.
+ *
+ * The receive paths keep "MAC_NDEV_POOL_RESERVE" blocks back for the
+ * blocks the Mac writes, so that these can always be passed to core 1.
+ */
+
+#ifndef MAC_NDEV_POOL_BLOCKS
+    #if MAC_NDEV_CORE1
+        #define MAC_NDEV_POOL_BLOCKS 16   // 8 KB of SRAM
+    #else
+        #define MAC_NDEV_POOL_BLOCKS 8    // 4 KB of SRAM
+    #endif
+#endif
+
+#if MAC_NDEV_CORE1
+    #define MAC_NDEV_POOL_RESERVE  4     // The length of the write ring
+    #ifndef MAC_NDEV_HOST_SIM
+        #include "pico/sync.h"
+        critical_section_t mac_ndev_pool_cs;
+        #define mac_ndev_pool_init()    critical_section_init(&mac_ndev_pool_cs)
+        #define mac_ndev_pool_lock()    critical_section_enter_blocking(&mac_ndev_pool_cs)
+        #define mac_ndev_pool_unlock()  critical_section_exit(&mac_ndev_pool_cs)
+    #endif
+#else
+    #define MAC_NDEV_POOL_RESERVE  0
+    #define mac_ndev_pool_init()
+    #define mac_ndev_pool_lock()
+    #define mac_ndev_pool_unlock()
+#endif
+
+typedef struct {
+    uint8_t  refs;
+    uint8_t  drive;      // Of a block written by the Mac
+    uint8_t  chan;
+    uint8_t  cmd;
+    uint16_t len;        // Of the payload
+    uint8_t  frames;     // Received frames merged into the payload
+    uint8_t  data[512 + MAC_NDEV_FRAME_LEN];  // Header, payload, and the next
+                                              // frame header read along with it
+} MacNDevBlock;
+
+MacNDevBlock mac_ndev_pool[MAC_NDEV_POOL_BLOCKS] = {0};
+uint8_t      mac_ndev_pool_free = MAC_NDEV_POOL_BLOCKS;
+
+#define mac_ndev_block_payload(b) ((b)->data + MAC_NDEV_HEADER_LEN)
+
+/* Takes a block from the pool, as long as more than "reserve" are left,
+ * otherwise returns NULL.
+ */
+MacNDevBlock *mac_ndev_block_alloc(uint8_t reserve) {
+    MacNDevBlock *b = NULL;
+    mac_ndev_pool_lock();
+    if (mac_ndev_pool_free > reserve) {
+        for (uint8_t i = 0; i < MAC_NDEV_POOL_BLOCKS; i++) {
+            if (mac_ndev_pool[i].refs == 0) {
+                b = &mac_ndev_pool[i];
+                b->refs   = 1;
+                b->len    = 0;
+                b->frames = 0;
+                mac_ndev_pool_free--;
+                break;
+            }
+        }
+    }
+    mac_ndev_pool_unlock();
+    return b;
+}
+
+void mac_ndev_block_ref(MacNDevBlock *b) {
+    mac_ndev_pool_lock();
+    b->refs++;
+    mac_ndev_pool_unlock();
+}
+
+void mac_ndev_block_release(MacNDevBlock *b) {
+    mac_ndev_pool_lock();
+    if (--b->refs == 0) {
+        mac_ndev_pool_free++;
+    }
+    mac_ndev_pool_unlock();
+}
+
+/* Blocks waiting for the Mac are queued in the order they arrived. Each has
+ * one channel and command; a data frame which arrives on a channel while
+ * the last block queued on it still has room is added to that block, so
+ * that a run of short frames does not use up the pool. Only then is the
+ * frame copied, and since it is short, this costs little.
+ */
 
 typedef struct {
-    uint16_t fifoLen;
-    uint8_t  fifoData[2000];
-} FifoBuffer;
+    uint8_t       count;
+    MacNDevBlock *blocks[MAC_NDEV_POOL_BLOCKS];
+} MacNDevBlockQueue;
 
-uint16_t fifoBytesAvailable (FifoBuffer *fb) {
-    return fb->fifoLen;
+// Returns the last block queued on "chan", or NULL if there is none
+
+MacNDevBlock *blockQueueLast (MacNDevBlockQueue *q, uint8_t chan) {
+    for (uint8_t i = q->count; i > 0; i--) {
+        if (q->blocks[i - 1]->chan == chan) {
+            return q->blocks[i - 1];
+        }
+    }
+    return NULL;
 }
 
-uint16_t fifoSpaceLeft (FifoBuffer *fb) {
-    return NELEMENTS(fb->fifoData) - fb->fifoLen;
+/* Queues a block received with one frame, with "chan", "cmd" and "len" set
+ * and the payload in place. Returns true if the block was taken, or false
+ * if the frame was added to a block already queued, in which case the
+ * block is left with the caller to be used again.
+ */
+bool blockQueuePut (MacNDevBlockQueue *q, MacNDevBlock *b) {
+    MacNDevBlock *last = blockQueueLast(q, b->chan);
+    b->frames = 1;
+    if (last && (last->cmd == MAC_NDEV_CMD_DATA) && (b->cmd == MAC_NDEV_CMD_DATA) &&
+        (last->len + b->len <= MAC_NDEV_MAX_PAYLOAD)) {
+        memcpy (mac_ndev_block_payload(last) + last->len, mac_ndev_block_payload(b), b->len);
+        last->len += b->len;
+        last->frames++;
+        b->len = 0;
+        return false;
+    }
+    q->blocks[q->count++] = b;   // Every block in the pool fits
+    return true;
 }
 
-uint16_t fifoGetData (FifoBuffer *fb, uint8_t *buf, uint16_t len) {
-    const uint16_t dataToReturn = MIN(fb->fifoLen, len);
-    memcpy (buf, fb->fifoData, dataToReturn);
-    memmove (fb->fifoData, fb->fifoData + dataToReturn, fb->fifoLen - dataToReturn);
-    fb->fifoLen -= dataToReturn;
-    return dataToReturn;
+// Returns the number of data bytes queued on a channel
+
+uint16_t blockQueueChannelBytes (MacNDevBlockQueue *q, uint8_t chan) {
+    uint16_t total = 0;
+    for (uint8_t i = 0; i < q->count; i++) {
+        if ((q->blocks[i]->chan == chan) && (q->blocks[i]->cmd == MAC_NDEV_CMD_DATA)) {
+            total += q->blocks[i]->len;
+        }
+    }
+    return total;
 }
 
-void fifoPutData(FifoBuffer *fb, const uint8_t *buf, uint16_t len) {
-    if ((fb->fifoLen + len) <= NELEMENTS(fb->fifoData)) {
-        memcpy (fb->fifoData + fb->fifoLen, buf, len);
-        fb->fifoLen += len;
+/* Removes the first block on a channel owned by "drive" and returns it,
+ * with the reference the queue held, or returns NULL if there is none.
+ */
+MacNDevBlock *blockQueueGet (MacNDevBlockQueue *q, uint8_t drive) {
+    for (uint8_t i = 0; i < q->count; i++) {
+        MacNDevBlock *b = q->blocks[i];
+        if (mac_ndev_owns_channel(drive, b->chan)) {
+            memmove (q->blocks + i, q->blocks + i + 1, (q->count - i - 1) * sizeof(q->blocks[0]));
+            q->count--;
+            return b;
+        }
+    }
+    return NULL;
+}
+
+/* Fills in the header of a block taken from the queue, for the Mac. Even
+ * though only the block's own payload is returned, the header reports the
+ * total number of bytes available on the channel.
+ */
+void blockQueuePutHeader (MacNDevBlockQueue *q, MacNDevBlock *b, uint16_t more) {
+    const uint32_t availBytes = b->len + blockQueueChannelBytes(q, b->chan) + more;
+    mac_ndev_put_header (b->data, b->chan, b->cmd, MIN(availBytes, 0xFFFF), b->len);
+}
+
+/************************** End of Block Pool Object *************************/
+
+/**************************** Sector Cache Object ****************************/
+
+/* Disk reads which are not special I/O go to the ESP32 over the UART, one
+ * sector at a time, so every sector the Mac reads again (such as those of
+ * the catalog and extents B-trees) costs another round trip. Sectors read
+ * from the ESP32 are therefore kept in spare SRAM, evicting the least
+ * recently used first. The Pico disk I/O code should remove a sector from
+ * the cache whenever it is written, and call "mac_ndev_disk_changed" for a
+ * drive whose disk is ejected or swapped, before the ESP32 is told, or the
+ * old disk's catalog and bitmap would be served for the new one.
+ *
+ * The patch does not hook the firmware's eject and mount paths, so the
+ * cache is off unless MAC_NDEV_CACHE_SECTORS is set once they call it.
+ *
+ * The magic sector and the negative and status LBAs are never cached, as
+ * reads from them are special I/O rather than disk data.
+ *
+ * "mac_ndev_cache_size" may be lowered at run time to find out how the hit
+ * rate depends on the size; "mac_ndev_disk_sim" in the linux directory
+ * does this against a simulated ESP32.
+ */
+
+#ifndef MAC_NDEV_CACHE_SECTORS
+    #define MAC_NDEV_CACHE_SECTORS 0    // 64 takes 32 KB of SRAM
+#endif
+
+typedef struct {
+    bool     valid;
+    uint8_t  drive;
+    uint32_t sector;
+    uint32_t lastUse;   // Value of mac_ndev_cache_clock when last read or filled
+    uint8_t  data[512];
+} MacNDevCacheEntry;
+
+MacNDevCacheEntry mac_ndev_cache[MAC_NDEV_CACHE_SECTORS ? MAC_NDEV_CACHE_SECTORS : 1] = {0};
+uint16_t mac_ndev_cache_size   = MAC_NDEV_CACHE_SECTORS;   // Entries in use
+uint32_t mac_ndev_cache_clock  = 0;
+uint32_t mac_ndev_cache_hits   = 0;
+uint32_t mac_ndev_cache_misses = 0;
+
+/* Returns true if reads of "sector" through "drive" are disk data */
+
+bool mac_ndev_cacheable(uint8_t drive, uint32_t sector) {
+    if ((drive >= MAC_NDEV_MAX_DRIVES) || (sector == MAC_NDEV_NEGATIVE_LBA) || (sector == MAC_NDEV_STATUS_LBA)) {
+        return false;
+    }
+    // Once the magic sector has been picked, it carries special I/O
+    const MacNDevConn *conn = &mac_ndev_conns[drive];
+    const bool magicPicked = (conn->state == MAC_NDEV_WAIT_MAGIC_READ) || (conn->state == MAC_NDEV_WAIT_MAGIC_SECTOR);
+    return !magicPicked || (sector != conn->sector);
+}
+
+MacNDevCacheEntry *mac_ndev_cache_find(uint8_t drive, uint32_t sector) {
+    for (uint16_t i = 0; i < mac_ndev_cache_size; i++) {
+        MacNDevCacheEntry *entry = &mac_ndev_cache[i];
+        if (entry->valid && (entry->sector == sector) && (entry->drive == drive)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* Copies a sector out of the cache into "blkPtr". Returns false on a miss,
+ * in which case the sector should be read from the ESP32 and passed on to
+ * "mac_ndev_cache_fill".
+ */
+bool mac_ndev_cache_read(uint8_t drive, uint32_t sector, uint8_t *blkPtr) {
+    if (!mac_ndev_cacheable(drive, sector)) {
+        return false;
+    }
+    MacNDevCacheEntry *entry = mac_ndev_cache_find(drive, sector);
+    if (entry) {
+        memcpy (blkPtr, entry->data, 512);
+        entry->lastUse = ++mac_ndev_cache_clock;
+        mac_ndev_cache_hits++;
+        return true;
+    }
+    mac_ndev_cache_misses++;
+    return false;
+}
+
+void mac_ndev_cache_fill(uint8_t drive, uint32_t sector, const uint8_t *blkPtr) {
+    if ((mac_ndev_cache_size == 0) || !mac_ndev_cacheable(drive, sector)) {
+        return;
+    }
+    MacNDevCacheEntry *entry = mac_ndev_cache_find(drive, sector);
+    if (entry == NULL) {
+        // Take an unused entry, or else the least recently used one
+        entry = &mac_ndev_cache[0];
+        for (uint16_t i = 0; (i < mac_ndev_cache_size) && entry->valid; i++) {
+            if (!mac_ndev_cache[i].valid || (mac_ndev_cache[i].lastUse < entry->lastUse)) {
+                entry = &mac_ndev_cache[i];
+            }
+        }
+    }
+    memcpy (entry->data, blkPtr, 512);
+    entry->valid   = true;
+    entry->drive   = drive;
+    entry->sector  = sector;
+    entry->lastUse = ++mac_ndev_cache_clock;
+}
+
+void mac_ndev_cache_invalidate(uint8_t drive, uint32_t sector) {
+    MacNDevCacheEntry *entry = mac_ndev_cache_find(drive, sector);
+    if (entry) {
+        entry->valid = false;
+    }
+}
+
+void mac_ndev_cache_invalidate_drive(uint8_t drive) {
+    for (uint16_t i = 0; i < NELEMENTS(mac_ndev_cache); i++) {
+        if (mac_ndev_cache[i].drive == drive) {
+            mac_ndev_cache[i].valid = false;
+        }
+    }
+}
+
+/************************* End of Sector Cache Object ************************/
+
+/**************************** Disk Read-Ahead Object **************************/
+
+/* Disk sectors are read from the ESP32 by sending 'R' and a U24 sector
+ * number, to which it replies with the 512 bytes of the sector. Without
+ * read-ahead, the UART transfer and the transfer of the previous sector to
+ * the Mac take turns. Instead, once a sector has been handed over to the
+ * floppy code, the next one is requested and received by DMA into a second
+ * buffer while the floppy code sends out the current one.
+ *
+ * Within a multi-sector read, the next sector is always fetched. At the
+ * end of a read, it is fetched only if that read carried on from where the
+ * previous one ended, as happens when a file is read sequentially.
+ *
+ * The UART is shared with the 'W' and 'S' commands, so any code which is
+ * about to send one of these must first call "mac_ndev_read_ahead_cancel",
+ * which waits for the transfer to finish and moves the sector to the cache.
+ * Likewise, no read is started while a write is on its way to the ESP32.
+ */
+
+#ifndef MAC_NDEV_HOST_SIM
+    #include "hardware/dma.h"
+
+    int      mac_ndev_rx_dma = -1;
+    uint16_t mac_ndev_rx_len = 0;
+
+    // Starts receiving "len" bytes from the ESP32 UART into "buf" by DMA
+    void mac_ndev_uart_rx_start(uint8_t *buf, uint16_t len) {
+        if (mac_ndev_rx_dma < 0) {
+            mac_ndev_rx_dma = dma_claim_unused_channel(true);
+        }
+        mac_ndev_rx_len = len;
+        dma_channel_config cfg = dma_channel_get_default_config(mac_ndev_rx_dma);
+        channel_config_set_transfer_data_size(&cfg, DMA_SIZE_8);
+        channel_config_set_read_increment(&cfg, false);
+        channel_config_set_write_increment(&cfg, true);
+        channel_config_set_dreq(&cfg, uart_get_dreq(UART_ID, false));
+        dma_channel_configure(mac_ndev_rx_dma, &cfg, buf, &uart_get_hw(UART_ID)->dr, len, true);
+    }
+
+    void mac_ndev_uart_rx_wait() {
+        dma_channel_wait_for_finish_blocking(mac_ndev_rx_dma);
+    }
+
+    // Returns how many bytes have been received since "mac_ndev_uart_rx_start"
+    uint16_t mac_ndev_uart_rx_count() {
+        return mac_ndev_rx_len - dma_channel_hw_addr(mac_ndev_rx_dma)->transfer_count;
+    }
+
+    // Stops a receive which has got all the bytes it needs
+    void mac_ndev_uart_rx_abort() {
+        dma_channel_abort(mac_ndev_rx_dma);
+    }
+
+    int mac_ndev_tx_dma = -1;
+
+    // Starts sending "len" bytes from "buf" to the ESP32 UART by DMA
+    void mac_ndev_uart_tx_start(const uint8_t *buf, uint16_t len) {
+        if (mac_ndev_tx_dma < 0) {
+            mac_ndev_tx_dma = dma_claim_unused_channel(true);
+        }
+        dma_channel_config cfg = dma_channel_get_default_config(mac_ndev_tx_dma);
+        channel_config_set_transfer_data_size(&cfg, DMA_SIZE_8);
+        channel_config_set_read_increment(&cfg, true);
+        channel_config_set_write_increment(&cfg, false);
+        channel_config_set_dreq(&cfg, uart_get_dreq(UART_ID, true));
+        dma_channel_configure(mac_ndev_tx_dma, &cfg, &uart_get_hw(UART_ID)->dr, buf, len, true);
+    }
+
+    bool mac_ndev_uart_tx_busy() {
+        return (mac_ndev_tx_dma >= 0) && dma_channel_is_busy(mac_ndev_tx_dma);
+    }
+
+    #if MAC_NDEV_ESP_FRAMING
+        /* In framed mode, the ESP32 may send at any time, so everything it
+         * sends is received by DMA into a ring, which is never stopped, and
+         * taken out of it by the CPU. The ring has room for the whole credit
+         * the ESP32 is given, twice over for SLIP escapes, plus a sector.
+         */
+
+        #define MAC_NDEV_RX_RING_BITS 13   // 8 KB
+
+        uint8_t  mac_ndev_rx_ring[1 << MAC_NDEV_RX_RING_BITS] __attribute__((aligned(1 << MAC_NDEV_RX_RING_BITS)));
+        uint16_t mac_ndev_rx_ring_pos = 0;
+
+        // Returns the next byte received from the ESP32, or -1 if there is none
+        int mac_ndev_uart_ring_get() {
+            const uint16_t mask = NELEMENTS(mac_ndev_rx_ring) - 1;
+            if (mac_ndev_rx_dma < 0) {
+                mac_ndev_rx_dma = dma_claim_unused_channel(true);
+                dma_channel_config cfg = dma_channel_get_default_config(mac_ndev_rx_dma);
+                channel_config_set_transfer_data_size(&cfg, DMA_SIZE_8);
+                channel_config_set_read_increment(&cfg, false);
+                channel_config_set_write_increment(&cfg, true);
+                channel_config_set_ring(&cfg, true, MAC_NDEV_RX_RING_BITS);
+                channel_config_set_dreq(&cfg, uart_get_dreq(UART_ID, false));
+                dma_channel_configure(mac_ndev_rx_dma, &cfg, mac_ndev_rx_ring, &uart_get_hw(UART_ID)->dr, 0xFFFFFFFF, true);
+            } else if (!dma_channel_is_busy(mac_ndev_rx_dma)) {
+                // After 4 GB, carry on where the ring left off
+                dma_channel_set_trans_count(mac_ndev_rx_dma, 0xFFFFFFFF, true);
+            }
+            const uint16_t in = (dma_channel_hw_addr(mac_ndev_rx_dma)->write_addr - (uintptr_t) mac_ndev_rx_ring) & mask;
+            if (mac_ndev_rx_ring_pos == in) {
+                return -1;
+            }
+            const uint8_t c = mac_ndev_rx_ring[mac_ndev_rx_ring_pos];
+            mac_ndev_rx_ring_pos = (mac_ndev_rx_ring_pos + 1) & mask;
+            return c;
+        }
+    #endif
+#endif
+
+/* To show what DMA saves, the bytes it moves and the time the CPU still
+ * spends waiting for them are counted. There is no cycle counter on the
+ * RP2040, so the times are taken from the microsecond timer.
+ */
+
+uint32_t mac_ndev_uart_bytes   = 0;    // Moved by DMA, both ways
+uint32_t mac_ndev_uart_wait_us = 0;    // Spent waiting for the UART
+uint32_t mac_ndev_uart_sectors = 0;    // Disk sectors and 'S' messages
+
+#define MAC_NDEV_UART_WAIT_START()  const uint32_t waitStart = time_us_32()
+#define MAC_NDEV_UART_WAIT_END()    mac_ndev_uart_wait_us += time_us_32() - waitStart
+
+void mac_ndev_uart_tx_wait() {
+    if (mac_ndev_uart_tx_busy()) {
+        MAC_NDEV_UART_WAIT_START();
+        while (mac_ndev_uart_tx_busy()) {
+            tight_loop_contents();
+        }
+        MAC_NDEV_UART_WAIT_END();
+    }
+}
+
+/* The ESP32's answers to 'R' and 'W' arrive straight from the UART, except
+ * in framed mode, where they are taken out of the frames it sends.
+ */
+
+#if MAC_NDEV_ESP_FRAMING
+    // Defined in the ESP32 Link Object below
+
+    void mac_ndev_esp_sector_start(uint8_t *blkPtr);
+    void mac_ndev_esp_sector_wait();
+    int  mac_ndev_esp_answer();
+
+    #define mac_ndev_sector_rx_start(b)  mac_ndev_esp_sector_start(b)
+    #define mac_ndev_sector_rx_wait()    mac_ndev_esp_sector_wait()
+    #define mac_ndev_write_answer()      mac_ndev_esp_answer()
+#else
+    #define mac_ndev_sector_rx_start(b)  mac_ndev_uart_rx_start(b, 512)
+
+    void mac_ndev_sector_rx_wait() {
+        mac_ndev_uart_rx_wait();
+        mac_ndev_uart_bytes += 512;
+    }
+
+    // Returns the answer to a 'W', or -1 if it has not arrived yet
+    int mac_ndev_write_answer() {
+        return uart_is_readable(UART_ID) ? uart_getc(UART_ID) : -1;
+    }
+#endif
+
+// Waits for a sector being received by "mac_ndev_sector_rx_start"
+
+void mac_ndev_uart_rx_sector() {
+    MAC_NDEV_UART_WAIT_START();
+    mac_ndev_sector_rx_wait();
+    MAC_NDEV_UART_WAIT_END();
+    mac_ndev_uart_sectors++;
+}
+
+typedef struct {
+    bool     pending;       // A sector was requested and is going into "data"
+    uint8_t  drive;
+    uint32_t sector;
+    bool     midRead;       // Between the sectors of a multi-sector read
+    uint8_t  nextDrive;     // Where the last read left off
+    uint32_t nextSector;
+    uint8_t  seqReads;      // Reads in a row which carried on from the last one
+    uint8_t  data[512];
+} MacNDevReadAhead;
+
+MacNDevReadAhead mac_ndev_read_ahead = {0};
+bool     mac_ndev_read_ahead_on     = true;   // May be turned off to compare
+uint32_t mac_ndev_read_ahead_hits   = 0;
+uint32_t mac_ndev_read_ahead_unused = 0;   // Cancelled, and moved to the cache
+
+void mac_ndev_esp_request(uint8_t cmd, uint32_t sector) {
+    // Bytes written now would end up in the middle of a DMA transfer
+    mac_ndev_uart_tx_wait();
+    uart_putc_raw(UART_ID, cmd);
+    uart_putc_raw(UART_ID, (sector >> 16) & 0xff);
+    uart_putc_raw(UART_ID, (sector >>  8) & 0xff);
+    uart_putc_raw(UART_ID,  sector        & 0xff);
+    mac_ndev_uart_bytes += 4;
+}
+
+// Defined in the Disk Write-Behind Object below
+
+bool mac_ndev_disk_queued_read(uint8_t drive, uint32_t sector, uint8_t *blkPtr);
+bool mac_ndev_disk_write_sending();
+void mac_ndev_disk_write_wait();
+void mac_ndev_disk_service();
+void mac_ndev_disk_flush();
+
+// Defined in the ESP32 Link Object below
+
+bool mac_ndev_esp_busy();
+void mac_ndev_esp_poll_wait();
+
+void mac_ndev_read_ahead_cancel() {
+    MacNDevReadAhead *ra = &mac_ndev_read_ahead;
+    if (ra->pending) {
+        mac_ndev_uart_rx_sector();
+        ra->pending = false;
+        mac_ndev_cache_fill(ra->drive, ra->sector, ra->data);
+        mac_ndev_read_ahead_unused++;
+    }
+}
+
+/* Fills "blkPtr" with a disk sector, from the cache, the read-ahead buffer
+ * or else the ESP32. To be called for each sector of a read, once
+ * "not_mac_ndev_read" has confirmed it is regular disk I/O.
+ */
+void mac_ndev_disk_read(uint8_t drive, uint32_t sector, uint8_t *blkPtr) {
+    MacNDevReadAhead *ra = &mac_ndev_read_ahead;
+
+    if (!ra->midRead) {
+        const bool carriesOn = (drive == ra->nextDrive) && (sector == ra->nextSector);
+        ra->seqReads = carriesOn ? MIN(ra->seqReads + 1, 255) : 0;
+    }
+    ra->midRead = true;
+
+    mac_ndev_disk_service();
+    if (mac_ndev_disk_queued_read(drive, sector, blkPtr) || mac_ndev_cache_read(drive, sector, blkPtr)) {
+        return;
+    }
+    if (ra->pending && (ra->drive == drive) && (ra->sector == sector)) {
+        mac_ndev_uart_rx_sector();
+        ra->pending = false;
+        memcpy (blkPtr, ra->data, 512);
+        mac_ndev_read_ahead_hits++;
     } else {
-        printf("MacNDev: Overflow in fifo buffer!\n");
+        mac_ndev_read_ahead_cancel();
+        mac_ndev_disk_write_wait();
+        mac_ndev_esp_poll_wait();
+        mac_ndev_esp_request('R', sector);
+        mac_ndev_sector_rx_start(blkPtr);
+        mac_ndev_uart_rx_sector();
+    }
+    mac_ndev_cache_fill(drive, sector, blkPtr);
+}
+
+/* To be called once a sector has been read, before it is sent to the Mac.
+ * "sector" is the one after it and "more" tells whether the read goes on.
+ * Sectors which were special I/O, and so did not go through
+ * "mac_ndev_disk_read", are ignored.
+ */
+void mac_ndev_disk_read_ahead(uint8_t drive, uint32_t sector, bool more) {
+    MacNDevReadAhead *ra = &mac_ndev_read_ahead;
+
+    if (!ra->midRead) {
+        return;
+    }
+    ra->midRead    = more;
+    ra->nextDrive  = drive;
+    ra->nextSector = sector;
+
+    if (mac_ndev_read_ahead_on && (more || ra->seqReads) && !ra->pending && !mac_ndev_disk_write_sending() && !mac_ndev_esp_busy() &&
+        mac_ndev_cacheable(drive, sector) && !mac_ndev_cache_find(drive, sector) &&
+        !mac_ndev_disk_queued_read(drive, sector, NULL)) {
+        ra->pending = true;
+        ra->drive   = drive;
+        ra->sector  = sector;
+        mac_ndev_esp_request('R', sector);
+        mac_ndev_sector_rx_start(ra->data);
     }
 }
 
-void fifoPutChar (FifoBuffer *fb, char c) {
-    fifoPutData (fb, &c, 1);
+/* To be called when the disk in "drive" is ejected or swapped, before the
+ * ESP32 is told, so that the writes still queued go to the old disk and
+ * nothing read from it is returned for the new one. The read-ahead is
+ * cancelled first, as it would otherwise put its sector into the cache.
+ *
+ * Example:
+ *
+ *    mac_ndev_disk_changed (drive_num);
+ *    // Now tell the ESP32 to eject or mount the image
+ */
+void mac_ndev_disk_changed(uint8_t drive) {
+    mac_ndev_disk_flush();
+    mac_ndev_cache_invalidate_drive(drive);
+    mac_ndev_read_ahead.nextDrive = 0xFF;
+    mac_ndev_read_ahead.seqReads  = 0;
 }
 
-/************************** End of Fifo Queue Object *************************/
+/************************ End of Disk Read-Ahead Object ***********************/
 
-/* This function processes reads and writes to the special magic sector.
+/*************************** Disk Write-Behind Object *************************/
+
+/* Writing a sector to the ESP32 means sending 'W', a U24 sector number and
+ * the 512 bytes, then waiting for it to answer 'w', or 'e' if the disk is
+ * read-only. Rather than keep the Mac waiting for all this, the sectors it
+ * writes are queued and it is answered at once. The queue is sent to the
+ * ESP32 one sector at a time, with the data going out by DMA, whenever the
+ * UART is not needed for a read. "mac_ndev_disk_service" moves this along;
+ * it is called on every disk command and may also be called from the main
+ * loop.
+ *
+ * Reads of a sector which is still queued are served from the queue.
+ * "mac_ndev_disk_flush" is a barrier which returns once every queued sector
+ * has been written; it is called for writes the Mac wants verified and by
+ * "mac_ndev_disk_changed".
+ *
+ * The patch only hooks dcd_read() and dcd_write(), so nothing would move
+ * the queue along once the Mac stops using the disk, and the last sectors
+ * would be lost if the Pico were switched off. Unless MAC_NDEV_WRITE_BEHIND
+ * is set, "mac_ndev_disk_write" therefore waits for the ESP32 before
+ * returning. Set it once the firmware calls "mac_ndev_disk_idle" from its
+ * main loop and "mac_ndev_disk_changed" on eject.
+ *
+ * When the ESP32 refuses a write, "mac_ndev_disk_status" returns the error
+ * for the next reply to the Mac about that drive, which with write-behind
+ * is not the reply to the refused write itself.
  */
-bool mac_ndev_magic_sector_io(uint8_t *tagPtr, uint8_t *blkPtr, mac_ndev_mode mode) {
-    const uint16_t reqDat = 0x8000;
-    uint16_t       len;
 
-    #if MAC_NDEV_LOOPBACK_TEST || MAC_NDEV_USB_SERIAL_TEST
-        static FifoBuffer fifo = {0};
-    #else
-        static uint8_t ser_hdr[3] = {0};
+#ifndef MAC_NDEV_WRITE_BEHIND
+    #define MAC_NDEV_WRITE_BEHIND 0
+#endif
+#define MAC_NDEV_WRITE_QUEUE 8   // Sectors, 4 KB of SRAM
+#define MAC_NDEV_WRITE_PROT  ((uint8_t) -44)   // wPrErr, for the DCD reply status
+
+typedef struct {
+    uint8_t  drive;
+    uint32_t sector;
+    uint8_t  data[512];
+} MacNDevQueuedWrite;
+
+typedef struct {
+    MacNDevQueuedWrite entries[MAC_NDEV_WRITE_QUEUE];
+    uint8_t  head;          // Oldest entry, which is the one being sent
+    uint8_t  count;
+    bool     sending;       // Waiting for the ESP32 to answer for the oldest entry
+    uint8_t  refused;       // Drives with a refused write not yet reported, one bit each
+} MacNDevWriteQueue;
+
+MacNDevWriteQueue mac_ndev_write_queue = {0};
+uint32_t mac_ndev_writes_queued  = 0;
+uint32_t mac_ndev_writes_merged  = 0;   // Sectors written again while still queued
+uint32_t mac_ndev_writes_stalled = 0;   // Writes which had to wait for room in the queue
+
+MacNDevQueuedWrite *mac_ndev_write_queue_entry(uint8_t i) {
+    MacNDevWriteQueue *wq = &mac_ndev_write_queue;
+    return &wq->entries[(wq->head + i) % MAC_NDEV_WRITE_QUEUE];
+}
+
+// Returns the most recently queued write of a sector, or NULL
+
+MacNDevQueuedWrite *mac_ndev_write_queue_find(uint8_t drive, uint32_t sector) {
+    for (int i = mac_ndev_write_queue.count - 1; i >= 0; i--) {
+        MacNDevQueuedWrite *entry = mac_ndev_write_queue_entry(i);
+        if ((entry->sector == sector) && (entry->drive == drive)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* Copies a queued sector into "blkPtr", if there is one. "blkPtr" may be
+ * NULL to just check.
+ */
+bool mac_ndev_disk_queued_read(uint8_t drive, uint32_t sector, uint8_t *blkPtr) {
+    const MacNDevQueuedWrite *entry = mac_ndev_write_queue_find(drive, sector);
+    if (entry && blkPtr) {
+        memcpy (blkPtr, entry->data, 512);
+    }
+    return entry != NULL;
+}
+
+bool mac_ndev_disk_write_sending() {
+    return mac_ndev_write_queue.sending;
+}
+
+// Takes the ESP32's answer for the write being sent, if it has arrived
+
+void mac_ndev_disk_write_poll() {
+    MacNDevWriteQueue *wq = &mac_ndev_write_queue;
+    if (!wq->sending || mac_ndev_uart_tx_busy()) {
+        return;
+    }
+    const int answer = mac_ndev_write_answer();
+    if (answer < 0) {
+        return;
+    }
+    const MacNDevQueuedWrite *entry = mac_ndev_write_queue_entry(0);
+    if (answer == 'e') {
+        printf("MacNDev: ESP32 refused write to sector %ld, drive %d\n", (long) entry->sector, entry->drive);
+        wq->refused |= 1 << entry->drive;
+    }
+    wq->head = (wq->head + 1) % MAC_NDEV_WRITE_QUEUE;
+    wq->count--;
+    wq->sending = false;
+    mac_ndev_uart_bytes++;
+    mac_ndev_uart_sectors++;
+}
+
+// Waits for the ESP32 to answer for the write being sent
+
+void mac_ndev_disk_write_wait() {
+    if (mac_ndev_write_queue.sending) {
+        MAC_NDEV_UART_WAIT_START();
+        while (mac_ndev_write_queue.sending) {
+            mac_ndev_disk_write_poll();
+        }
+        MAC_NDEV_UART_WAIT_END();
+    }
+}
+
+void mac_ndev_disk_service() {
+    MacNDevWriteQueue *wq = &mac_ndev_write_queue;
+    mac_ndev_disk_write_poll();
+    if (!wq->sending && wq->count && !mac_ndev_read_ahead.pending && !mac_ndev_esp_busy()) {
+        const MacNDevQueuedWrite *entry = mac_ndev_write_queue_entry(0);
+
+        #if !MAC_NDEV_ESP_FRAMING
+            // Clear out any residual byte in the UART buffer
+            while (uart_is_readable(UART_ID))
+                uart_getc(UART_ID);
+        #endif
+
+        mac_ndev_esp_request('W', entry->sector);
+        mac_ndev_uart_tx_start(entry->data, 512);
+        mac_ndev_uart_bytes += 512;
+        wq->sending = true;
+    }
+}
+
+/* Queues a sector to be written to the ESP32. To be called for each sector
+ * of a write, once "not_mac_ndev_write" has confirmed it is regular disk
+ * I/O.
+ */
+void mac_ndev_disk_write(uint8_t drive, uint32_t sector, const uint8_t *blkPtr) {
+    MacNDevWriteQueue  *wq = &mac_ndev_write_queue;
+    MacNDevQueuedWrite *entry = mac_ndev_write_queue_find(drive, sector);
+
+    // A sector fetched ahead of time, or in the cache, is now out of date
+    mac_ndev_read_ahead_cancel();
+    mac_ndev_cache_invalidate(drive, sector);
+
+    if (entry && !(wq->sending && (entry == mac_ndev_write_queue_entry(0)))) {
+        mac_ndev_writes_merged++;
+    } else {
+        if (wq->count == MAC_NDEV_WRITE_QUEUE) {
+            mac_ndev_writes_stalled++;
+            while (wq->count == MAC_NDEV_WRITE_QUEUE) {
+                mac_ndev_disk_service();
+            }
+        }
+        entry = mac_ndev_write_queue_entry(wq->count++);
+        entry->drive  = drive;
+        entry->sector = sector;
+    }
+    memcpy (entry->data, blkPtr, 512);
+    mac_ndev_writes_queued++;
+    mac_ndev_disk_service();
+
+    #if !MAC_NDEV_WRITE_BEHIND
+        mac_ndev_disk_flush();
     #endif
+}
+
+// Returns once every queued write has been answered by the ESP32
 
-   #if MAC_NDEV_USB_SERIAL_TEST
-        // There is no way to check how many bytes are available
-        // on the USB interface, so read them all into the FIFO
-        // queue so we can count them.
-        while (fifoSpaceLeft(&fifo)) {
-            int c = getchar_timeout_us(0);
-            if (c == PICO_ERROR_TIMEOUT) {
+void mac_ndev_disk_flush() {
+    mac_ndev_read_ahead_cancel();
+    while (mac_ndev_write_queue.count) {
+        mac_ndev_disk_service();
+    }
+}
+
+/* Returns the status byte for the reply to a read or write of "drive" which
+ * went through "mac_ndev_disk_read" or "mac_ndev_disk_write": wPrErr if a
+ * write to it has been refused since the last call, or else zero.
+ *
+ * Example:
+ *
+ *    payload[2] = mac_ndev_disk_status (drive_num);
+ */
+uint8_t mac_ndev_disk_status(uint8_t drive) {
+    MacNDevWriteQueue *wq = &mac_ndev_write_queue;
+    const bool refused = wq->refused & (1 << drive);
+    wq->refused &= ~(1 << drive);
+    return refused ? MAC_NDEV_WRITE_PROT : 0;
+}
+
+/* Prints the disk counters after every thousand reads */
+
+void mac_ndev_disk_report() {
+    static uint32_t lastReport = 0;
+    const uint32_t lookups = mac_ndev_cache_hits + mac_ndev_cache_misses;
+    if (lookups - lastReport >= 1000) {
+        lastReport = lookups;
+        printf("MacNDev: Cache hits %lu, misses %lu (%lu%% hits, %d sectors); read-ahead hits %lu, unused %lu\n",
+            (unsigned long) mac_ndev_cache_hits, (unsigned long) mac_ndev_cache_misses,
+            (unsigned long) ((uint64_t) mac_ndev_cache_hits * 100 / lookups), mac_ndev_cache_size,
+            (unsigned long) mac_ndev_read_ahead_hits, (unsigned long) mac_ndev_read_ahead_unused);
+        printf("MacNDev: Writes queued %lu, merged %lu, stalled %lu\n",
+            (unsigned long) mac_ndev_writes_queued, (unsigned long) mac_ndev_writes_merged,
+            (unsigned long) mac_ndev_writes_stalled);
+        #ifdef BAUD_RATE
+            // Ten bits a byte on the wire, with the start and stop bits
+            const uint32_t sectors = mac_ndev_uart_sectors ? mac_ndev_uart_sectors : 1;
+            const uint32_t wireUs  = (uint64_t) mac_ndev_uart_bytes * 10000000 / BAUD_RATE;
+            printf("MacNDev: UART %lu bytes, %lu us per sector on the wire, %lu us waited for (%ld us saved)\n",
+                (unsigned long) mac_ndev_uart_bytes, (unsigned long) (wireUs / sectors),
+                (unsigned long) (mac_ndev_uart_wait_us / sectors),
+                ((long) wireUs - (long) mac_ndev_uart_wait_us) / (long) sectors);
+        #endif
+    }
+}
+
+/* Sends the queued writes to the ESP32, with MAC_NDEV_WRITE_BEHIND, while
+ * the Mac is not using the disk, and prints the disk counters, which would
+ * otherwise hold up the floppy transfers. To be called from the firmware's
+ * main loop, or wherever it waits for the next command.
+ *
+ * Example:
+ *
+ *    while (true) {
+ *        mac_ndev_disk_idle ();
+ *        // Wait for and handle the next command from the Mac
+ *    }
+ */
+void mac_ndev_disk_idle() {
+    #if MAC_NDEV_WRITE_BEHIND
+        mac_ndev_disk_service();
+    #endif
+    mac_ndev_disk_report();
+}
+
+/************************ End of Disk Write-Behind Object *********************/
+
+/****************************** ESP32 Link Object *****************************/
+
+/* The 'S' messages to and from the ESP32 go by DMA too. A message from the
+ * Mac is copied out of the block, behind its 'S' header, and sent while the
+ * floppy code carries on; the UART is only waited for when it is next
+ * needed. Reads are answered from a poll which was started once the
+ * previous read was answered, so that while the Mac is busy with one block
+ * the ESP32's reply to the next poll is received in the background. A
+ * prefetched reply with no data is thrown away, and a new poll made, so
+ * that data which has come in since is not held up.
+ *
+ * The reply is received into a buffer large enough for the most it can
+ * hold, so the DMA transfer only runs to completion when the ESP32 sends
+ * 500 bytes; otherwise, "mac_ndev_esp_busy" stops it once the length has
+ * arrived along with that many bytes.
+ */
+
+/* In framed mode, there are no polls. Whatever the ESP32 sends is taken
+ * apart by "mac_ndev_esp_receive" as it comes out of the ring, which is
+ * done on every disk command and whenever the Pico waits on the ESP32:
+ * data frames are decoded straight into a block from the pool, which is
+ * queued for the Mac, and sectors go straight into the buffer given for
+ * them. Frames from the
+ * Mac, on any channel, are sent by DMA as long as there is credit for them.
+ */
+
+#if MAC_NDEV_ESP_FRAMING && (MAC_NDEV_LOOPBACK_TEST || MAC_NDEV_USB_SERIAL_TEST)
+    #error "MAC_NDEV_ESP_FRAMING requires MAC_NDEV_LOOPBACK_TEST and MAC_NDEV_USB_SERIAL_TEST to be 0"
+#endif
+
+#if MAC_NDEV_ESP_FRAMING
+    #define MAC_NDEV_SLIP_END      0xC0
+    #define MAC_NDEV_SLIP_ESC      0xDB
+    #define MAC_NDEV_SLIP_ESC_END  0xDC
+    #define MAC_NDEV_SLIP_ESC_ESC  0xDD
+    #define MAC_NDEV_ESP_WINDOW    2000   // Credit each side starts out with
+    #define MAC_NDEV_ESP_FRAMES    7      // 'D' frames the ESP32 may send ahead
+
+    #if MAC_NDEV_POOL_BLOCKS <= MAC_NDEV_ESP_FRAMES
+        #error "MAC_NDEV_ESP_FRAMING requires MAC_NDEV_POOL_BLOCKS to be more than MAC_NDEV_ESP_FRAMES"
+    #endif
+
+    typedef struct {
+        // Receiving
+        uint16_t   pos;             // Bytes of the frame so far, with the type
+        bool       escaped;
+        uint8_t    type;
+        uint8_t    field[3];        // Channel and command, or U16 values
+        MacNDevBlock *frame;        // Where the payload of a 'D' frame goes
+        uint8_t   *sector;          // Where the sector of an 'r' frame goes
+        bool       sectorDone;
+        int        answer;          // 'w' or 'e', once it has arrived, or -1
+        MacNDevBlockQueue queue;    // Data frames waiting for the Mac
+        uint16_t   waiting[256];    // Bytes the ESP32 is holding back, by channel
+        uint16_t   consumed;        // Taken from "queue" since the last 'C' frame
+        uint8_t    freed;           // Blocks given back since the last 'C' frame
+        // Sending
+        uint16_t   credit;
+        uint8_t    send[2 + 2 * (3 + MAC_NDEV_MAX_PAYLOAD)];
+    } MacNDevEspLink;
+
+    MacNDevEspLink mac_ndev_esp = {.answer = -1, .credit = MAC_NDEV_ESP_WINDOW};
+    uint32_t mac_ndev_esp_dropped = 0;   // Frames from the ESP32 which were thrown away
+
+    void mac_ndev_esp_frame_byte(uint8_t c) {
+        MacNDevEspLink *esp = &mac_ndev_esp;
+        const uint16_t n = esp->pos++;
+        if (n == 0) {
+            esp->type = c;
+            if ((c == 'D') && !esp->frame) {
+                esp->frame = mac_ndev_block_alloc(MAC_NDEV_POOL_RESERVE);
+            }
+        } else if (esp->type == 'r') {
+            if (esp->sector && (n <= 512)) {
+                esp->sector[n - 1] = c;
+            }
+        } else if (esp->type == 'D' && (n > 2)) {
+            if (esp->frame && (n - 3 < MAC_NDEV_MAX_PAYLOAD)) {
+                mac_ndev_block_payload(esp->frame)[n - 3] = c;
+            }
+        } else if (n <= NELEMENTS(esp->field)) {
+            esp->field[n - 1] = c;
+        }
+    }
+
+    void mac_ndev_esp_frame_end() {
+        MacNDevEspLink *esp = &mac_ndev_esp;
+        const uint16_t len = esp->pos - 1;   // Not counting the type
+        if (esp->pos == 0) {
+            return;     // Between frames
+        }
+        esp->pos = 0;
+        switch (esp->type) {
+            case 'D':
+                if ((len < 2) || (len - 2 > MAC_NDEV_MAX_PAYLOAD) || !esp->frame) {
+                    printf("MacNDev: Dropped data frame from the ESP32 (len = %d)\n", len);
+                    mac_ndev_esp_dropped++;
+                    // Give back the credit, or the ESP32 would be short of it for good
+                    esp->consumed += MAC_NDEV_FRAME_LEN + ((len < 2) ? 0 : len - 2);
+                    esp->freed++;
+                    break;
+                }
+                esp->frame->chan = esp->field[0];
+                esp->frame->cmd  = esp->field[1];
+                esp->frame->len  = len - 2;
+                if (blockQueuePut(&esp->queue, esp->frame)) {
+                    esp->frame = NULL;
+                } else {
+                    esp->freed++;   // Merged, so its block is free again
+                }
+                break;
+            case 'r':
+                if (esp->sector && (len == 512)) {
+                    esp->sector     = NULL;
+                    esp->sectorDone = true;
+                } else {
+                    printf("MacNDev: Unexpected sector frame from the ESP32 (len = %d)\n", len);
+                    mac_ndev_esp_dropped++;
+                }
+                break;
+            case 'w':
+            case 'e':
+                esp->answer = esp->type;
                 break;
+            case 'C':
+                esp->credit += CHARS_TO_UINT16(esp->field[0], esp->field[1]);
+                break;
+            case 'A':
+                esp->waiting[esp->field[0]] = CHARS_TO_UINT16(esp->field[1], esp->field[2]);
+                break;
+            default:
+                printf("MacNDev: Unknown frame type %d from the ESP32\n", esp->type);
+                mac_ndev_esp_dropped++;
+        }
+    }
+
+    // Takes apart whatever the ESP32 has sent so far
+
+    void mac_ndev_esp_receive() {
+        MacNDevEspLink *esp = &mac_ndev_esp;
+        int c;
+        while ((c = mac_ndev_uart_ring_get()) >= 0) {
+            mac_ndev_uart_bytes++;
+            if (c == MAC_NDEV_SLIP_END) {
+                mac_ndev_esp_frame_end();
+                esp->escaped = false;
+            } else if (c == MAC_NDEV_SLIP_ESC) {
+                esp->escaped = true;
+            } else {
+                if (esp->escaped) {
+                    c = (c == MAC_NDEV_SLIP_ESC_END) ? MAC_NDEV_SLIP_END : (c == MAC_NDEV_SLIP_ESC_ESC) ? MAC_NDEV_SLIP_ESC : c;
+                    esp->escaped = false;
+                }
+                mac_ndev_esp_frame_byte(c);
+            }
+        }
+    }
+
+    // Encodes a frame into "send" and starts sending it by DMA
+
+    void mac_ndev_esp_send_frame(const uint8_t *hdr, uint8_t hdrLen, const uint8_t *payload, uint16_t len) {
+        MacNDevEspLink *esp = &mac_ndev_esp;
+        uint16_t n = 0;
+        mac_ndev_uart_tx_wait();
+        esp->send[n++] = MAC_NDEV_SLIP_END;
+        for (uint16_t i = 0; i < hdrLen + len; i++) {
+            const uint8_t c = (i < hdrLen) ? hdr[i] : payload[i - hdrLen];
+            if (c == MAC_NDEV_SLIP_END) {
+                esp->send[n++] = MAC_NDEV_SLIP_ESC;
+                esp->send[n++] = MAC_NDEV_SLIP_ESC_END;
+            } else if (c == MAC_NDEV_SLIP_ESC) {
+                esp->send[n++] = MAC_NDEV_SLIP_ESC;
+                esp->send[n++] = MAC_NDEV_SLIP_ESC_ESC;
+            } else {
+                esp->send[n++] = c;
+            }
+        }
+        esp->send[n++] = MAC_NDEV_SLIP_END;
+        mac_ndev_uart_tx_start(esp->send, n);
+        mac_ndev_uart_bytes += n;
+    }
+
+    void mac_ndev_esp_sector_start(uint8_t *blkPtr) {
+        mac_ndev_esp.sector     = blkPtr;
+        mac_ndev_esp.sectorDone = false;
+    }
+
+    void mac_ndev_esp_sector_wait() {
+        while (!mac_ndev_esp.sectorDone) {
+            mac_ndev_esp_receive();
+        }
+    }
+
+    int mac_ndev_esp_answer() {
+        mac_ndev_esp_receive();
+        const int answer = mac_ndev_esp.answer;
+        mac_ndev_esp.answer = -1;
+        return answer;
+    }
+
+    // Nothing is ever outstanding, but this keeps the ring emptied out
+
+    bool mac_ndev_esp_busy() {
+        mac_ndev_esp_receive();
+        return false;
+    }
+
+    void mac_ndev_esp_poll_wait() {
+        mac_ndev_esp_receive();
+    }
+
+    /* Fills "blkPtr" with the next block for "drive", or just the header if
+     * there is none, and gives the ESP32 credit for the frames which have
+     * been taken out of the queue once there is a block's worth, or the
+     * queue is empty.
+     */
+    void mac_ndev_esp_read_block(uint8_t drive, uint8_t *blkPtr) {
+        MacNDevEspLink *esp = &mac_ndev_esp;
+
+        mac_ndev_esp_receive();
+        MacNDevBlock *b = blockQueueGet(&esp->queue, drive);
+        if (b) {
+            blockQueuePutHeader (&esp->queue, b, esp->waiting[b->chan]);
+            memcpy (blkPtr, b->data, MAC_NDEV_HEADER_LEN + b->len);
+            esp->consumed += b->frames * MAC_NDEV_FRAME_LEN + b->len;
+            esp->freed++;
+            mac_ndev_block_release(b);
+            mac_ndev_uart_sectors++;
+        } else {
+            const uint32_t availBytes = blockQueueChannelBytes(&esp->queue, MAC_NDEV_CHAN_SERIAL) + esp->waiting[MAC_NDEV_CHAN_SERIAL];
+            mac_ndev_put_header (blkPtr, MAC_NDEV_CHAN_SERIAL, MAC_NDEV_CMD_DATA, MIN(availBytes, 0xFFFF), 0);
+        }
+
+        if ((esp->consumed >= MAC_NDEV_FRAME_LEN + MAC_NDEV_MAX_PAYLOAD) || (esp->freed >= MAC_NDEV_ESP_FRAMES / 2) ||
+            ((esp->consumed || esp->freed) && !esp->queue.count)) {
+            const uint8_t hdr[4] = {'C', (uint8_t) UINT16_HI_BYTE(esp->consumed), (uint8_t) UINT16_LO_BYTE(esp->consumed), esp->freed};
+            mac_ndev_esp_send_frame(hdr, sizeof(hdr), NULL, 0);
+            esp->consumed = 0;
+            esp->freed    = 0;
+        }
+    }
+
+    // Sends a frame written by the Mac through "drive", once there is credit for it
+
+    void mac_ndev_esp_write_block(uint8_t drive, uint8_t chan, uint8_t cmd, const uint8_t *payload, uint16_t len) {
+        MacNDevEspLink *esp = &mac_ndev_esp;
+        mac_ndev_chan_owner[chan] = drive + 1;
+        mac_ndev_esp_receive();
+        if (esp->credit < MAC_NDEV_FRAME_LEN + len) {
+            MAC_NDEV_UART_WAIT_START();
+            while (esp->credit < MAC_NDEV_FRAME_LEN + len) {
+                mac_ndev_esp_receive();
             }
-            fifoPutChar(&fifo, c);
+            MAC_NDEV_UART_WAIT_END();
         }
+        esp->credit -= MAC_NDEV_FRAME_LEN + len;
+        const uint8_t hdr[3] = {'D', chan, cmd};
+        mac_ndev_esp_send_frame(hdr, sizeof(hdr), payload, len);
+        mac_ndev_uart_sectors++;
+    }
+#elif !(MAC_NDEV_LOOPBACK_TEST || MAC_NDEV_USB_SERIAL_TEST)
+    typedef enum {
+        MAC_NDEV_ESP_IDLE,
+        MAC_NDEV_ESP_RECEIVING,     // A poll has been sent and its reply is arriving
+        MAC_NDEV_ESP_READY          // The reply is in "reply", waiting for the Mac
+    } mac_ndev_esp_state;
+
+    typedef struct {
+        mac_ndev_esp_state state;
+        uint16_t len;
+        uint8_t  reply[2 + MAC_NDEV_MAX_PAYLOAD];
+        uint8_t  send[3 + MAC_NDEV_MAX_PAYLOAD];
+    } MacNDevEspLink;
+
+    MacNDevEspLink mac_ndev_esp = {MAC_NDEV_ESP_IDLE};
+
+    // Sends a zero length 'S' message with the "data request" bit set
+
+    void mac_ndev_esp_poll_start() {
+        mac_ndev_read_ahead_cancel();
+        mac_ndev_disk_write_wait();
+        mac_ndev_uart_tx_wait();
+        while (uart_is_readable(UART_ID))
+            uart_getc(UART_ID);
+        uart_putc_raw(UART_ID, MAC_NDEV_ESP32_CMD);
+        uart_putc_raw(UART_ID, 0x80);
+        uart_putc_raw(UART_ID, 0x00);
+        mac_ndev_uart_rx_start(mac_ndev_esp.reply, sizeof(mac_ndev_esp.reply));
+        mac_ndev_esp.state = MAC_NDEV_ESP_RECEIVING;
+    }
+
+    // Returns whether a reply is still arriving, taking it if it is complete
+
+    bool mac_ndev_esp_busy() {
+        MacNDevEspLink *esp = &mac_ndev_esp;
+        if (esp->state == MAC_NDEV_ESP_RECEIVING) {
+            const uint16_t count = mac_ndev_uart_rx_count();
+            if (count >= 2) {
+                const uint16_t len = MIN(CHARS_TO_UINT16(esp->reply[0], esp->reply[1]), MAC_NDEV_MAX_PAYLOAD);
+                if (count >= 2 + len) {
+                    mac_ndev_uart_rx_abort();
+                    esp->len   = len;
+                    esp->state = MAC_NDEV_ESP_READY;
+                    mac_ndev_uart_bytes += 2 + len;
+                }
+            }
+        }
+        return esp->state == MAC_NDEV_ESP_RECEIVING;
+    }
+
+    void mac_ndev_esp_poll_wait() {
+        if (mac_ndev_esp_busy()) {
+            MAC_NDEV_UART_WAIT_START();
+            while (mac_ndev_esp_busy()) {
+                tight_loop_contents();
+            }
+            MAC_NDEV_UART_WAIT_END();
+        }
+    }
+
+    // Fills "blkPtr" with the ESP32's reply to a poll
+
+    void mac_ndev_esp_read_block(uint8_t drive, uint8_t *blkPtr) {
+        MacNDevEspLink *esp = &mac_ndev_esp;
+        (void) drive;
+        mac_ndev_esp_poll_wait();
+        if ((esp->state == MAC_NDEV_ESP_READY) && (esp->len == 0)) {
+            esp->state = MAC_NDEV_ESP_IDLE;
+        }
+        if (esp->state == MAC_NDEV_ESP_IDLE) {
+            mac_ndev_esp_poll_start();
+            mac_ndev_esp_poll_wait();
+        }
+        const uint16_t len = esp->len;
+        memcpy (blkPtr + MAC_NDEV_HEADER_LEN, esp->reply + 2, len);
+        mac_ndev_put_header (blkPtr, MAC_NDEV_CHAN_SERIAL, MAC_NDEV_CMD_DATA, len, len);
+        esp->state = MAC_NDEV_ESP_IDLE;
+        mac_ndev_uart_sectors++;
+        printf("MacNDev: Got I/O read request (len = %d)\n", len);
+
+        // More is likely to follow
+        if (len) {
+            mac_ndev_esp_poll_start();
+        }
+    }
+
+    // Sends the ESP32 a message, returning as soon as the DMA transfer is started
+
+    void mac_ndev_esp_write_block(uint8_t drive, uint8_t chan, uint8_t cmd, const uint8_t *payload, uint16_t len) {
+        MacNDevEspLink *esp = &mac_ndev_esp;
+        mac_ndev_chan_owner[chan] = drive + 1;
+        printf("MacNDev: Got I/O write request (len = %d)\n", len);
+        if ((chan != MAC_NDEV_CHAN_SERIAL) || (cmd != MAC_NDEV_CMD_DATA)) {
+            printf("MacNDev: Channel %d is not supported by the ESP32 link; enable MAC_NDEV_ESP_FRAMING\n", chan);
+            return;
+        }
+        mac_ndev_esp_poll_wait();
+        mac_ndev_read_ahead_cancel();
+        mac_ndev_disk_write_wait();
+        mac_ndev_uart_tx_wait();
+        if (esp->state != MAC_NDEV_ESP_READY) {
+            // Clear out any residual byte in the UART buffer
+            while (uart_is_readable(UART_ID))
+                uart_getc(UART_ID);
+        }
+        esp->send[0] = MAC_NDEV_ESP32_CMD;        // 'S'
+        esp->send[1] = UINT16_HI_BYTE(len);       // No "request data"
+        esp->send[2] = UINT16_LO_BYTE(len);
+        memcpy (esp->send + 3, payload, len);
+        mac_ndev_uart_tx_start(esp->send, 3 + len);
+        mac_ndev_uart_bytes += 3 + len;
+        mac_ndev_uart_sectors++;
+    }
+#else
+    bool mac_ndev_esp_busy() {return false;}
+    void mac_ndev_esp_poll_wait() {}
+#endif
+
+/************************** End of ESP32 Link Object **************************/
+
+#if MAC_NDEV_USB_VENDOR && !(MAC_NDEV_USB_SERIAL_TEST && MAC_NDEV_USB_FRAMING)
+    #error "MAC_NDEV_USB_VENDOR requires MAC_NDEV_USB_SERIAL_TEST and MAC_NDEV_USB_FRAMING"
+#endif
+
+/* Over the CDC port, TinyUSB is run on core 0 by "pico_stdio_usb", under a
+ * lock of its own which cannot be taken from here, so it must not also be
+ * called from core 1. The host sims stand in for TinyUSB with calls which
+ * are safe from any thread.
+ */
+
+#if MAC_NDEV_CORE1 && MAC_NDEV_USB_SERIAL_TEST && !MAC_NDEV_USB_VENDOR && !defined(MAC_NDEV_HOST_SIM)
+    #error "MAC_NDEV_CORE1 requires MAC_NDEV_USB_VENDOR when MAC_NDEV_USB_SERIAL_TEST is set"
+#endif
+
+#if MAC_NDEV_USB_SERIAL_TEST
+    #ifndef MAC_NDEV_HOST_SIM
+        #include "tusb.h"
     #endif
 
-    if (mode == MAC_NDEV_READ) {
-        #if MAC_NDEV_LOOPBACK_TEST || MAC_NDEV_USB_SERIAL_TEST
-            const uint16_t availBytes  = fifoBytesAvailable(&fifo);
-            const uint16_t bytesToRead = fifoGetData(&fifo, blkPtr + MAC_NDEV_HEADER_LEN, 512 - MAC_NDEV_HEADER_LEN);
-            // Even though we are only returning bytesToRead bytes, we report back
-            // on the total number of available bytes.
-            mac_ndev_put_header (blkPtr, availBytes);
+    /* Data for the USB host is moved in blocks with the TinyUSB calls,
+     * straight into blocks from the pool and out of the block the Mac wrote,
+     * rather than a byte at a time through stdio, which is left for the
+     * "MacNDev:" messages alone.
+     */
+
+    #if MAC_NDEV_USB_VENDOR
+        #include "pico/mutex.h"
+        #include "pico/time.h"
+        #include "mac_ndev_usb_descriptors.h"
+
+        /* With its own descriptors, the application has to run TinyUSB. This
+         * is done every millisecond from a timer, as "pico_stdio_usb" would,
+         * unless the data path is using it. Full 64 byte packets go out as
+         * soon as they are written, but the last, partial, packet of a frame
+         * is only sent by the timer, so that frames written within the same
+         * millisecond share packets.
+         */
+
+        mutex_t           mac_ndev_usb_mutex;
+        repeating_timer_t mac_ndev_usb_timer;
+
+        bool mac_ndev_usb_timer_cb(repeating_timer_t *rt) {
+            (void) rt;
+            if (mutex_try_enter(&mac_ndev_usb_mutex, NULL)) {
+                tud_task();
+                tud_vendor_write_flush();
+                mutex_exit(&mac_ndev_usb_mutex);
+            }
+            return true;
+        }
+
+        // Runs before main(), so TinyUSB is up by the time stdio is started
+
+        void __attribute__((constructor)) mac_ndev_usb_init() {
+            mutex_init(&mac_ndev_usb_mutex);
+            tusb_init();
+            add_repeating_timer_us(-1000, mac_ndev_usb_timer_cb, NULL, &mac_ndev_usb_timer);
+        }
+
+        #define mac_ndev_usb_lock()        mutex_enter_blocking(&mac_ndev_usb_mutex)
+        #define mac_ndev_usb_unlock()      mutex_exit(&mac_ndev_usb_mutex)
+        #define mac_ndev_usb_available()   tud_vendor_available()
+        #define mac_ndev_usb_read(b,n)     tud_vendor_read(b,n)
+        #define mac_ndev_usb_put(b,n)      tud_vendor_write(b,n)
+        #define mac_ndev_usb_push()        tud_task()
+        #define mac_ndev_usb_flush()
+        #define mac_ndev_usb_connected()   tud_mounted()
+    #else
+        // TinyUSB is serviced in the background by "pico_stdio_usb"
+        #define mac_ndev_usb_lock()
+        #define mac_ndev_usb_unlock()
+        #define mac_ndev_usb_available()   tud_cdc_available()
+        #define mac_ndev_usb_read(b,n)     tud_cdc_read(b,n)
+        #define mac_ndev_usb_put(b,n)      tud_cdc_write(b,n)
+        #define mac_ndev_usb_push()        tud_cdc_write_flush()
+        #define mac_ndev_usb_flush()       tud_cdc_write_flush()
+        #define mac_ndev_usb_connected()   tud_cdc_connected()
+    #endif
+
+    /* Reads what the USB host has sent into a block, with the frame header
+     * going into the last bytes of the room left for the Mac's header, and
+     * the payload after it, where the Mac will read it. To keep down the
+     * calls into TinyUSB, the header of the next frame is read along with
+     * each payload, and carried over into the next block. A frame may arrive
+     * over several calls; once it is complete, the block is queued. When the
+     * pool runs out, nothing more is read, and TinyUSB holds off the host.
+     */
+
+    MacNDevBlock *mac_ndev_usb_frame = NULL;       // The frame being received
+    uint16_t      mac_ndev_usb_frame_pos = 0;      // Bytes of it so far, with the header
+    bool          mac_ndev_usb_frame_hdr = false;  // Whether the header has been taken apart
+    uint8_t       mac_ndev_usb_next[MAC_NDEV_FRAME_LEN];
+
+    void mac_ndev_usb_receive(MacNDevBlockQueue *q) {
+        #if MAC_NDEV_USB_FRAMING
+            mac_ndev_usb_lock();
+            bool stalled = !mac_ndev_usb_available();
+            for (;;) {
+                MacNDevBlock *b = mac_ndev_usb_frame;
+                if (!b) {
+                    if (!(b = mac_ndev_usb_frame = mac_ndev_block_alloc(MAC_NDEV_POOL_RESERVE))) {
+                        break;
+                    }
+                    memcpy (mac_ndev_block_payload(b) - MAC_NDEV_FRAME_LEN, mac_ndev_usb_next, mac_ndev_usb_frame_pos);
+                }
+                uint8_t *hdr = mac_ndev_block_payload(b) - MAC_NDEV_FRAME_LEN;
+                uint16_t pos = mac_ndev_usb_frame_pos;
+                if (!mac_ndev_usb_frame_hdr && (pos >= MAC_NDEV_FRAME_LEN)) {
+                    b->chan = hdr[0];
+                    b->cmd  = hdr[1];
+                    b->len  = CHARS_TO_UINT16(hdr[2], hdr[3]);
+                    if (b->len > MAC_NDEV_MAX_PAYLOAD) {
+                        // The host broke the protocol; there is no way to resync
+                        printf("MacNDev: Invalid frame length %d from the USB host!\n", b->len);
+                        b->len = MAC_NDEV_MAX_PAYLOAD;
+                    }
+                    mac_ndev_usb_frame_hdr = true;
+                }
+                if (mac_ndev_usb_frame_hdr && (pos >= MAC_NDEV_FRAME_LEN + b->len)) {
+                    pos -= MAC_NDEV_FRAME_LEN + b->len;
+                    memcpy (mac_ndev_usb_next, hdr + MAC_NDEV_FRAME_LEN + b->len, pos);
+                    mac_ndev_usb_frame_pos = pos;
+                    mac_ndev_usb_frame_hdr = false;
+                    if (blockQueuePut(q, b)) {
+                        mac_ndev_usb_frame = NULL;
+                    } else {
+                        memcpy (hdr, mac_ndev_usb_next, pos);
+                    }
+                    continue;
+                }
+                if (stalled) {
+                    break;
+                }
+                const uint16_t want = mac_ndev_usb_frame_hdr ? 2 * MAC_NDEV_FRAME_LEN + b->len - pos : MAC_NDEV_FRAME_LEN - pos;
+                const uint16_t got  = mac_ndev_usb_read(hdr + pos, want);
+                mac_ndev_usb_frame_pos += got;
+                stalled = got < want;
+            }
+            mac_ndev_usb_unlock();
+        #else
+            // Without framing, whatever arrives is data for the serial channel
+            if (mac_ndev_usb_available()) {
+                MacNDevBlock *b = mac_ndev_usb_frame;
+                if (b || (b = mac_ndev_usb_frame = mac_ndev_block_alloc(MAC_NDEV_POOL_RESERVE))) {
+                    b->len = mac_ndev_usb_read(mac_ndev_block_payload(b), MAC_NDEV_MAX_PAYLOAD);
+                    if (b->len) {
+                        b->chan = MAC_NDEV_CHAN_SERIAL;
+                        b->cmd  = MAC_NDEV_CMD_DATA;
+                        if (blockQueuePut(q, b)) {
+                            mac_ndev_usb_frame = NULL;
+                        }
+                    }
+                }
+            }
+        #endif
+    }
+
+    // Queues all of "buf" for the USB host, waiting for room if need be
+
+    void mac_ndev_usb_write(const uint8_t *buf, uint16_t len) {
+        while (len) {
+            const uint32_t n = mac_ndev_usb_put(buf, len);
+            buf += n;
+            len -= n;
+            if (len) {
+                mac_ndev_usb_push();
+                if (!mac_ndev_usb_connected()) {
+                    printf("MacNDev: USB host not connected, dropping %d bytes\n", len);
+                    return;
+                }
+            }
+        }
+    }
+
+    void mac_ndev_usb_send(uint8_t chan, uint8_t cmd, const uint8_t *payload, uint16_t len) {
+        #if MAC_NDEV_USB_FRAMING
+            const uint8_t hdr[MAC_NDEV_FRAME_LEN] = {chan, cmd, (uint8_t) UINT16_HI_BYTE(len), (uint8_t) UINT16_LO_BYTE(len)};
+            mac_ndev_usb_lock();
+            mac_ndev_usb_write(hdr, MAC_NDEV_FRAME_LEN);
+        #else
+            if ((chan != MAC_NDEV_CHAN_SERIAL) || (cmd != MAC_NDEV_CMD_DATA)) {
+                printf("MacNDev: Dropping message for channel %d; enable MAC_NDEV_USB_FRAMING\n", chan);
+                return;
+            }
+        #endif
+        mac_ndev_usb_write(payload, len);
+        mac_ndev_usb_flush();
+        mac_ndev_usb_unlock();
+    }
+#endif
+
+#if MAC_NDEV_LOOPBACK_TEST || MAC_NDEV_USB_SERIAL_TEST
+    MacNDevBlockQueue mac_ndev_fifo = {0};
+
+    /* Takes the next block for the Mac to read through "drive" out of the
+     * queue, with its header filled in, or returns NULL if there is none.
+     */
+    MacNDevBlock *mac_ndev_fifo_get_block(uint8_t drive) {
+        MacNDevBlock *b = blockQueueGet(&mac_ndev_fifo, drive);
+        if (b) {
+            blockQueuePutHeader (&mac_ndev_fifo, b, 0);
             #if MAC_NDEV_LOOPBACK_TEST
-                printf("MacNDev: Got I/O read request (availBytes = %d)\n", availBytes);
-                printHexDump (blkPtr + MAC_NDEV_HEADER_LEN, bytesToRead);
+                printf("MacNDev: Got I/O read request (chan = %d, len = %d)\n", b->chan, b->len);
+                printHexDump (mac_ndev_block_payload(b), b->len);
             #endif
+        }
+        return b;
+    }
+
+    // Copies a block for the Mac into "blkPtr" and hands it back to the pool
+
+    void mac_ndev_fifo_copy_block(MacNDevBlock *b, uint8_t *blkPtr) {
+        memcpy (blkPtr, b->data, MAC_NDEV_HEADER_LEN + b->len);
+        mac_ndev_block_release(b);
+    }
+
+    // Fills a block to be read by the Mac through "drive", or just its header
+
+    void mac_ndev_fifo_read_block(uint8_t drive, uint8_t *blkPtr) {
+        MacNDevBlock *b = mac_ndev_fifo_get_block(drive);
+        if (b) {
+            mac_ndev_fifo_copy_block(b, blkPtr);
+        } else {
+            const uint16_t availBytes = blockQueueChannelBytes(&mac_ndev_fifo, MAC_NDEV_CHAN_SERIAL);
+            mac_ndev_put_header (blkPtr, MAC_NDEV_CHAN_SERIAL, MAC_NDEV_CMD_DATA, availBytes, 0);
+        }
+    }
+
+    /* Passes on a frame the Mac wrote, already copied into a block from the
+     * pool. The loopback queues the block itself to be read back.
+     */
+    void mac_ndev_fifo_write_pooled(MacNDevBlock *b) {
+        mac_ndev_chan_owner[b->chan] = b->drive + 1;
+        #if MAC_NDEV_USB_SERIAL_TEST
+            mac_ndev_usb_send(b->chan, b->cmd, mac_ndev_block_payload(b), b->len);
+            mac_ndev_block_release(b);
         #else
-            // Serial message header
-            ser_hdr[0]  = MAC_NDEV_ESP32_CMD;  // 'S'
-            ser_hdr[1]  = 0x80;                // Zero length + "request data"
-            ser_hdr[2]  = 0x00;                // Zero length
+            printf("MacNDev: Got I/O write request (chan = %d, cmd = %d, len = %d, pend = %d)\n", b->chan, b->cmd, b->len, mac_ndev_fifo.count);
+            printHexDump (mac_ndev_block_payload(b), b->len);
+            if (!blockQueuePut(&mac_ndev_fifo, b)) {
+                mac_ndev_block_release(b);
+            }
+        #endif
+    }
 
-            // Send request to the ESP32
-            while (uart_is_readable(UART_ID))
-                uart_getc (UART_ID);
-            uart_write_blocking (UART_ID, ser_hdr, 3);
-
-            // Receive reply from the ESP32
-            uint8_t s[2];
-            uart_read_blocking(UART_ID, s, 2);
-            const short len = CHARS_TO_UINT16(s[0],s[1]);
-            uart_read_blocking(UART_ID, blkPtr + MAC_NDEV_HEADER_LEN, len);
-            // Append header to reply to Mac host
-            mac_ndev_put_header (blkPtr, len);
-            printf("MacNDev: Got I/O read request (len = %d)\n", len);
-            //printHexDump (blkPtr, len + MAC_NDEV_HEADER_LEN);
+    /* Passes on a frame written by the Mac through "drive". The USB link
+     * sends it straight out of the floppy code's buffer; the loopback
+     * copies it into a block, as it has to be kept.
+     */
+    void mac_ndev_fifo_write_block(uint8_t drive, uint8_t chan, uint8_t cmd, const uint8_t *payload, uint16_t len) {
+        #if MAC_NDEV_USB_SERIAL_TEST
+            mac_ndev_chan_owner[chan] = drive + 1;
+            mac_ndev_usb_send(chan, cmd, payload, len);
+        #else
+            MacNDevBlock *b = mac_ndev_block_alloc(0);
+            if (!b) {
+                printf("MacNDev: Overflow in block pool!\n");
+                return;
+            }
+            b->drive = drive;
+            b->chan  = chan;
+            b->cmd   = cmd;
+            b->len   = MIN(len, MAC_NDEV_MAX_PAYLOAD);
+            memcpy (mac_ndev_block_payload(b), payload, b->len);
+            mac_ndev_fifo_write_pooled(b);
+        #endif
+    }
+#endif
+
+/****************************** Core 1 Service Object *************************/
+
+/* When MAC_NDEV_CORE1 is set, the FIFO and the USB link are looked after by
+ * a loop on the Pico's second core, so that USB transfers never hold up the
+ * floppy protocol on core 0. At sector time, core 0 only copies a block:
+ *
+ *   - Blocks written by the Mac are copied into a block from the pool,
+ *     which is passed through a ring to core 1.
+ *   - For each drive, core 1 keeps the next block for the Mac to read
+ *     ready in a mailbox, which core 0 copies out when the Mac reads.
+ *
+ * Each ring and mailbox has one producer and one consumer, on different
+ * cores, so only the pool needs a lock: a block is filled in before the
+ * index is moved, or the pointer set, with a memory barrier in between.
+ *
+ * The ESP32 link stays on core 0, as it shares the UART with the sectors
+ * read and written by dcd_read() and dcd_write().
+ */
+
+#if MAC_NDEV_CORE1
+    #if !(MAC_NDEV_LOOPBACK_TEST || MAC_NDEV_USB_SERIAL_TEST)
+        #error "MAC_NDEV_CORE1 requires MAC_NDEV_LOOPBACK_TEST or MAC_NDEV_USB_SERIAL_TEST"
+    #endif
+
+    #ifndef MAC_NDEV_HOST_SIM
+        #include "pico/multicore.h"
+        #define mac_ndev_barrier() __dmb()
+    #endif
+
+    #define MAC_NDEV_WRITE_RING MAC_NDEV_POOL_RESERVE   // A power of two
+
+    typedef struct {
+        MacNDevBlock     *blocks[MAC_NDEV_WRITE_RING];
+        volatile uint32_t head;     // Moved by core 0
+        volatile uint32_t tail;     // Moved by core 1
+    } MacNDevWriteRing;
+
+    typedef struct {
+        MacNDevBlock * volatile block;  // Set by core 1, cleared by core 0
+    } MacNDevReadMailbox;
+
+    MacNDevWriteRing   mac_ndev_write_ring = {0};
+    MacNDevReadMailbox mac_ndev_read_mailbox[MAC_NDEV_MAX_DRIVES] = {0};
+    bool               mac_ndev_core1_running = false;
+    uint32_t           mac_ndev_ring_stalls  = 0;     // Writes which waited for core 1
+    uint32_t           mac_ndev_empty_reads  = 0;     // Reads with no block ready
+
+    // One pass of the core 1 loop
+
+    void mac_ndev_core1_service() {
+        MacNDevWriteRing *ring = &mac_ndev_write_ring;
+
+        #if MAC_NDEV_USB_SERIAL_TEST
+            mac_ndev_usb_receive(&mac_ndev_fifo);
+        #endif
+
+        while (ring->tail != ring->head) {
+            mac_ndev_barrier();
+            mac_ndev_fifo_write_pooled(ring->blocks[ring->tail % MAC_NDEV_WRITE_RING]);
+            mac_ndev_barrier();
+            ring->tail++;
+        }
+
+        for (uint8_t drive = 0; drive < MAC_NDEV_MAX_DRIVES; drive++) {
+            MacNDevReadMailbox *mb = &mac_ndev_read_mailbox[drive];
+            if (mac_ndev_conns[drive].active && !mb->block) {
+                MacNDevBlock *b = mac_ndev_fifo_get_block(drive);
+                if (b) {
+                    mac_ndev_barrier();
+                    mb->block = b;
+                }
+            }
+        }
+    }
+
+    void mac_ndev_core1_main() {
+        for (;;) {
+            mac_ndev_core1_service();
+        }
+    }
+
+    void mac_ndev_core1_start() {
+        if (!mac_ndev_core1_running) {
+            mac_ndev_core1_running = true;
+            mac_ndev_pool_init();
+            multicore_launch_core1(mac_ndev_core1_main);
+            printf("MacNDev: Started service loop on core 1\n");
+        }
+    }
+
+    /* Core 0: hands a block written by the Mac to core 1. Core 1 only takes
+     * blocks for the Mac to read out of the pool while more than the ring
+     * holds are left, so there is always a block for a write once the ring
+     * has room, except in the loopback, where the blocks written are kept
+     * until they are read back.
+     */
+    void mac_ndev_core0_write(uint8_t drive, uint8_t chan, uint8_t cmd, const uint8_t *payload, uint16_t len) {
+        MacNDevWriteRing *ring = &mac_ndev_write_ring;
+        if (ring->head - ring->tail == MAC_NDEV_WRITE_RING) {
+            mac_ndev_ring_stalls++;
+            while (ring->head - ring->tail == MAC_NDEV_WRITE_RING) {
+                tight_loop_contents();
+            }
+        }
+        MacNDevBlock *b = mac_ndev_block_alloc(0);
+        if (!b) {
+            printf("MacNDev: Overflow in block pool!\n");
+            return;
+        }
+        b->drive = drive;
+        b->chan  = chan;
+        b->cmd   = cmd;
+        b->len   = MIN(len, MAC_NDEV_MAX_PAYLOAD);
+        memcpy (mac_ndev_block_payload(b), payload, b->len);
+        ring->blocks[ring->head % MAC_NDEV_WRITE_RING] = b;
+        mac_ndev_barrier();
+        ring->head++;
+    }
+
+    // Core 0: copies out the block core 1 has ready for "drive", if any
+
+    void mac_ndev_core0_read(uint8_t drive, uint8_t *blkPtr) {
+        MacNDevReadMailbox *mb = &mac_ndev_read_mailbox[drive];
+        MacNDevBlock *b = mb->block;
+        if (b) {
+            mac_ndev_barrier();
+            mac_ndev_fifo_copy_block(b, blkPtr);
+            mac_ndev_barrier();
+            mb->block = NULL;
+        } else {
+            mac_ndev_empty_reads++;
+            mac_ndev_put_header (blkPtr, MAC_NDEV_CHAN_SERIAL, MAC_NDEV_CMD_DATA, 0, 0);
+        }
+    }
+#endif
+
+/************************** End of Core 1 Service Object **********************/
+
+/* This function processes reads and writes to the special magic sector.
+ */
+bool mac_ndev_magic_sector_io(uint8_t drive, uint8_t *tagPtr, uint8_t *blkPtr, mac_ndev_mode mode) {
+    uint8_t        chan, cmd;
+    uint16_t       len;
+
+    #if MAC_NDEV_CORE1
+        mac_ndev_core1_start();
+    #elif MAC_NDEV_USB_SERIAL_TEST
+        mac_ndev_usb_receive(&mac_ndev_fifo);
+    #endif
+
+    if (mode == MAC_NDEV_READ) {
+        #if MAC_NDEV_CORE1
+            mac_ndev_core0_read(drive, blkPtr);
+        #elif MAC_NDEV_LOOPBACK_TEST || MAC_NDEV_USB_SERIAL_TEST
+            mac_ndev_fifo_read_block(drive, blkPtr);
+        #else
+            mac_ndev_esp_read_block(drive, blkPtr);
         #endif
         return true;
     }
     else if (mode == MAC_NDEV_WRITE) {
-        const bool headerInTags = mac_ndev_get_header(tagPtr, &len);
-        if (headerInTags || mac_ndev_get_header(blkPtr, &len)) {
+        const bool headerInTags = mac_ndev_get_header(tagPtr, &chan, &cmd, &len);
+        if (headerInTags || mac_ndev_get_header(blkPtr, &chan, &cmd, &len)) {
             const uint8_t headerSize = headerInTags ? 0 : MAC_NDEV_HEADER_LEN;
             const uint8_t *payload = blkPtr + headerSize;
             if (!headerInTags) {
@@ -295,25 +1980,12 @@ bool mac_ndev_magic_sector_io(uint8_t *tagPtr, uint8_t *blkPtr, mac_ndev_mode mo
                 printf("MacNDev: Got invalid write len (len = %d)\n", len);
                 len = 512 - headerSize;
             }
-            #if MAC_NDEV_USB_SERIAL_TEST
-                for (int i = 0; i < len; i++) {
-                    putchar_raw (payload[i]);
-                }
-            #elif MAC_NDEV_LOOPBACK_TEST
-                printf("MacNDev: Got I/O write request (len = %d, pend = %d)\n", len, fifoBytesAvailable(&fifo));
-                printHexDump (payload, len);
-                fifoPutData(&fifo, payload, len);
+            #if MAC_NDEV_CORE1
+                mac_ndev_core0_write(drive, chan, cmd, payload, len);
+            #elif MAC_NDEV_LOOPBACK_TEST || MAC_NDEV_USB_SERIAL_TEST
+                mac_ndev_fifo_write_block(drive, chan, cmd, payload, len);
             #else
-                printf("MacNDev: Got I/O write request (len = %d)\n", len);
-                // Serial message header
-                ser_hdr[0] = MAC_NDEV_ESP32_CMD;  // 'S'
-                ser_hdr[1] = tagPtr[6] & ~0x80;   // hi-byte of len (clear "request data")
-                ser_hdr[2] = tagPtr[7];           // lo-byte of len
-                // Send data to the ESP32
-                while (uart_is_readable(UART_ID))
-                    uart_getc(UART_ID);
-                uart_write_blocking(UART_ID, ser_hdr, 3);
-                uart_write_blocking(UART_ID, payload, len);
+                mac_ndev_esp_write_block(drive, chan, cmd, payload, MIN(len, MAC_NDEV_MAX_PAYLOAD));
             #endif
             return true;
         } else {
@@ -328,16 +2000,34 @@ bool mac_ndev_magic_sector_io(uint8_t *tagPtr, uint8_t *blkPtr, mac_ndev_mode mo
 // This is a helper function called by "not_mac_ndev_read" and "not_mac_ndev_write"
 
 bool is_mac_ndev_io (uint8_t drive, uint32_t sector, uint8_t *tagPtr, uint8_t *blkPtr, mac_ndev_mode mode) {
-    //printf("MacNDev: drive %d; sector %ld; mode %d; state %d; knock %d; magic %d/%ld\n", drive, sector, mode, mac_ndev_state, mac_ndev_knock, mac_ndev_drive, mac_ndev_sector);
+    if (drive >= MAC_NDEV_MAX_DRIVES) {
+        return false;
+    }
+
+    MacNDevConn *conn = &mac_ndev_conns[drive];
+
+    //printf("MacNDev: drive %d; sector %ld; mode %d; state %d; knock %d; magic %ld\n", drive, sector, mode, conn->state, conn->knock, conn->sector);
+
+    if (sector == MAC_NDEV_STATUS_LBA) {
+        // A status read returns the header alone; writes are ignored.
+        if (mode == MAC_NDEV_READ) {
+            memset(blkPtr, 0, 512);
+            mac_ndev_put_header(blkPtr, MAC_NDEV_CHAN_SERIAL, MAC_NDEV_CMD_DATA, 0, 0);
+        }
+        return true;
+    }
 
     if (sector == MAC_NDEV_NEGATIVE_LBA) {
-        // If we get a negative LBA, it must be special I/O...
-        printf("MacNDev: Got negative LBA!\n");
-        mac_ndev_magic_sector_io (tagPtr, blkPtr, mode);
-        if (mac_ndev_state != MAC_NDEV_WAIT_MAGIC_SECTOR) {
+        // If we get a negative LBA, it must be special I/O. The Mac probes
+        // this with a read before anything else, and skips the knock and
+        // magic file handshake if the reply carries our tag.
+        //printf("MacNDev: Got negative LBA!\n");
+        conn->active = true;
+        mac_ndev_magic_sector_io (drive, tagPtr, blkPtr, mode);
+        if (conn->state != MAC_NDEV_WAIT_MAGIC_SECTOR) {
             // Finish partially complete handshake, as
             // the host is using negative LBA instead.
-            mac_ndev_state = MAC_NDEV_WAIT_KNOCK;
+            conn->state = MAC_NDEV_WAIT_KNOCK;
         }
         return true;
     }
@@ -345,22 +2035,21 @@ bool is_mac_ndev_io (uint8_t drive, uint32_t sector, uint8_t *tagPtr, uint8_t *b
     // Listen for the knock sequence, which may be sent at any time
     // to start designated I/O sector selection.
 
-    if (mac_ndev_detect_knock_sequence(sector)) {
-        mac_ndev_state  = MAC_NDEV_WAIT_MAGIC_WRITE;
-        mac_ndev_drive  = drive;
-        mac_ndev_sector = 0;
-        printf("MacNDev: Will use drive number %d for I/O\n", mac_ndev_drive);
+    if (mac_ndev_detect_knock_sequence(conn, sector)) {
+        conn->state  = MAC_NDEV_WAIT_MAGIC_WRITE;
+        conn->sector = 0;
+        printf("MacNDev: Will use drive number %d for I/O\n", drive);
 
         // When the knocking sequence is complete, send
         // back special tags to let the host know a
         // FujiNet device is present.
 
-        mac_ndev_put_header(tagPtr, 0);
+        mac_ndev_put_header(tagPtr, MAC_NDEV_CHAN_SERIAL, MAC_NDEV_CMD_DATA, 0, 0);
     }
 
     // Handle the current run state
 
-    switch (mac_ndev_state) {
+    switch (conn->state) {
         case MAC_NDEV_WAIT_KNOCK:
             /* STEP 1: Device idle, waiting for a valid knock sequence.
              */
@@ -374,8 +2063,7 @@ bool is_mac_ndev_io (uint8_t drive, uint32_t sector, uint8_t *tagPtr, uint8_t *b
              *         subsequent I/O.
              */
             printf("MacNDev: waiting for magic write\n");
-            if ((mode  == MAC_NDEV_WRITE) &&
-                (drive == mac_ndev_drive)) {
+            if (mode == MAC_NDEV_WRITE) {
                 // Check whether the whole sector consists of
                 // repetitions of the magic value.
                 const char *magic = MAC_NDEV_REQUEST_TAG;
@@ -388,9 +2076,9 @@ bool is_mac_ndev_io (uint8_t drive, uint32_t sector, uint8_t *tagPtr, uint8_t *b
                     }
                 }
                 // We've got a magic sector!
-                mac_ndev_sector = sector;
-                mac_ndev_state = MAC_NDEV_WAIT_MAGIC_READ;
-                printf("MacNDev: Will use sector number %ld for I/O\n", mac_ndev_sector);
+                conn->sector = sector;
+                conn->state  = MAC_NDEV_WAIT_MAGIC_READ;
+                printf("MacNDev: Will use sector number %ld for I/O\n", conn->sector);
                 return true;
             }
             break;
@@ -404,20 +2092,20 @@ bool is_mac_ndev_io (uint8_t drive, uint32_t sector, uint8_t *tagPtr, uint8_t *b
              */
             printf("MacNDev: waiting for magic read\n");
             if ((mode  == MAC_NDEV_READ) &&
-                (drive == mac_ndev_drive) &&
-                (sector == mac_ndev_sector)) {
-                mac_ndev_put_header(tagPtr, 8);
+                (sector == conn->sector)) {
+                mac_ndev_put_header(tagPtr, MAC_NDEV_CHAN_SERIAL, MAC_NDEV_CMD_DATA, 8, 8);
                 blkPtr[0] = MAC_NDEV_REPLY_TAG[0];
                 blkPtr[1] = MAC_NDEV_REPLY_TAG[1];
                 blkPtr[2] = MAC_NDEV_REPLY_TAG[2];
                 blkPtr[3] = MAC_NDEV_REPLY_TAG[3];
-                blkPtr[4] = (mac_ndev_sector & 0xFF000000) >> 24;
-                blkPtr[5] = (mac_ndev_sector & 0x00FF0000) >> 16;
-                blkPtr[6] = (mac_ndev_sector & 0x0000FF00) >>  8;
-                blkPtr[7] = (mac_ndev_sector & 0x000000FF) >>  0;
+                blkPtr[4] = (conn->sector & 0xFF000000) >> 24;
+                blkPtr[5] = (conn->sector & 0x00FF0000) >> 16;
+                blkPtr[6] = (conn->sector & 0x0000FF00) >>  8;
+                blkPtr[7] = (conn->sector & 0x000000FF) >>  0;
                 printf("MacNDev: Sent I/O sector to Mac host.\n");
                 printf("MacNDev: Handshake complete.\n");
-                mac_ndev_state = MAC_NDEV_WAIT_MAGIC_SECTOR;
+                conn->state  = MAC_NDEV_WAIT_MAGIC_SECTOR;
+                conn->active = true;
                 return true;
             } else {
                 printf("MacNDev: Got %s to sector %ld, drive %d instead\n",
@@ -431,15 +2119,13 @@ bool is_mac_ndev_io (uint8_t drive, uint32_t sector, uint8_t *tagPtr, uint8_t *b
             /* STEP 4: We can now intercept all reads and writes to the
              *         magic sector as I/O.
              */
-            if ((drive == mac_ndev_drive) && (sector == mac_ndev_sector)) {
+            if (sector == conn->sector) {
                 //printf("MacNDev: Magic sector access\n");
-                return mac_ndev_magic_sector_io(tagPtr, blkPtr, mode);
-            } else if (sector == mac_ndev_sector) {
-                printf("MacNDev: Magic sector request to wrong drive? %d != %d\n", drive, mac_ndev_drive);
+                return mac_ndev_magic_sector_io(drive, tagPtr, blkPtr, mode);
             }
             break;
         default:
-            printf("MacNDev: Invalid state %d\n", mac_ndev_state);
+            printf("MacNDev: Invalid state %d\n", conn->state);
     }
     return false;
 }
@@ -496,7 +2182,13 @@ inline bool not_mac_ndev_write (uint8_t drive, uint32_t sector, uint8_t *tagPtr,
 #undef MAC_NDEV_REQUEST_TAG
 #undef MAC_NDEV_REPLY_TAG
 #undef MAC_NDEV_HEADER_LEN
+#undef MAC_NDEV_FRAME_LEN
+#undef MAC_NDEV_MAX_PAYLOAD
 #undef MAC_NDEV_NEGATIVE_LBA
+#undef MAC_NDEV_STATUS_LBA
+#undef MAC_NDEV_MAX_DRIVES
+#undef MAC_NDEV_CHAN_SERIAL
+#undef MAC_NDEV_CMD_DATA
 
 #undef NELEMENTS
 #undef CHARS_TO_UINT16
@@ -0,0 +1,132 @@
+/****************************************************************************
+ *   mac68k-fuji-drivers (c) 2024 Marcio Teixeira                           *
+ *                                                                          *
+ *   This program is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU General Public License as published by   *
+ *   the Free Software Foundation, either version 3 of the License, or      *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   This program is distributed in the hope that it will be useful,        *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU General Public License for more details.                           *
+ *                                                                          *
+ *   To view a copy of the GNU General Public License, go to the following  *
+ *   location: <http://www.gnu.org/licenses/>.                              *
+ ****************************************************************************/
+
+/* USB descriptors for MAC_NDEV_USB_VENDOR, included by "mac_ndev.h".
+ *
+ * The Pico shows up as a composite device with two functions:
+ *
+ *           +-----------+---------------+-------------------------+
+ *           | Interface | Endpoints     | Description             |
+ *           +-----------+---------------+-------------------------+
+ *           | 0, 1      | 0x81, 2, 0x82 | CDC ACM, stdio messages |
+ *           | 2         | 3, 0x83       | Vendor, framed data     |
+ *           +-----------+---------------+-------------------------+
+ *
+ * On Linux, the CDC interface is picked up by "cdc_acm" as before, while
+ * the vendor interface is left for "mac_ndev_bridge" to claim through
+ * usbfs. The firmware must link "tinyusb_device" alongside "pico_stdio_usb"
+ * and find "tusb_config.h" in this directory; "pico_stdio_usb" then leaves
+ * the descriptors and TinyUSB itself to the application.
+ */
+
+#pragma once
+
+#include "tusb.h"
+#include "pico/unique_id.h"
+
+#define MAC_NDEV_USB_VID      0x2E8A   // Raspberry Pi
+#define MAC_NDEV_USB_PID      0x000A   // Same as "pico_stdio_usb"
+
+#define MAC_NDEV_ITF_CDC      0
+#define MAC_NDEV_ITF_VENDOR   2
+#define MAC_NDEV_ITF_COUNT    3
+
+#define MAC_NDEV_EP_CDC_NOTIF 0x81
+#define MAC_NDEV_EP_CDC_OUT   0x02
+#define MAC_NDEV_EP_CDC_IN    0x82
+#define MAC_NDEV_EP_DATA_OUT  0x03
+#define MAC_NDEV_EP_DATA_IN   0x83
+
+#define MAC_NDEV_USB_CONFIG_LEN (TUD_CONFIG_DESC_LEN + TUD_CDC_DESC_LEN + TUD_VENDOR_DESC_LEN)
+
+enum {
+    MAC_NDEV_STR_LANGID,
+    MAC_NDEV_STR_MANUFACTURER,
+    MAC_NDEV_STR_PRODUCT,
+    MAC_NDEV_STR_SERIAL,
+    MAC_NDEV_STR_CDC,
+    MAC_NDEV_STR_VENDOR
+};
+
+static const tusb_desc_device_t mac_ndev_usb_device_desc = {
+    .bLength            = sizeof(tusb_desc_device_t),
+    .bDescriptorType    = TUSB_DESC_DEVICE,
+    .bcdUSB             = 0x0200,
+    // Composite device with an interface association for the CDC function
+    .bDeviceClass       = TUSB_CLASS_MISC,
+    .bDeviceSubClass    = MISC_SUBCLASS_COMMON,
+    .bDeviceProtocol    = MISC_PROTOCOL_IAD,
+    .bMaxPacketSize0    = CFG_TUD_ENDPOINT0_SIZE,
+    .idVendor           = MAC_NDEV_USB_VID,
+    .idProduct          = MAC_NDEV_USB_PID,
+    .bcdDevice          = 0x0100,
+    .iManufacturer      = MAC_NDEV_STR_MANUFACTURER,
+    .iProduct           = MAC_NDEV_STR_PRODUCT,
+    .iSerialNumber      = MAC_NDEV_STR_SERIAL,
+    .bNumConfigurations = 1
+};
+
+static const uint8_t mac_ndev_usb_config_desc[MAC_NDEV_USB_CONFIG_LEN] = {
+    TUD_CONFIG_DESCRIPTOR(1, MAC_NDEV_ITF_COUNT, 0, MAC_NDEV_USB_CONFIG_LEN, 0, 250),
+    TUD_CDC_DESCRIPTOR(MAC_NDEV_ITF_CDC, MAC_NDEV_STR_CDC, MAC_NDEV_EP_CDC_NOTIF, 8,
+        MAC_NDEV_EP_CDC_OUT, MAC_NDEV_EP_CDC_IN, 64),
+    TUD_VENDOR_DESCRIPTOR(MAC_NDEV_ITF_VENDOR, MAC_NDEV_STR_VENDOR,
+        MAC_NDEV_EP_DATA_OUT, MAC_NDEV_EP_DATA_IN, CFG_TUD_VENDOR_EPSIZE)
+};
+
+static const char *mac_ndev_usb_strings[] = {
+    [MAC_NDEV_STR_MANUFACTURER] = "FujiNet",
+    [MAC_NDEV_STR_PRODUCT]      = "FujiNet Mac NDev",
+    [MAC_NDEV_STR_CDC]          = "FujiNet Console",
+    [MAC_NDEV_STR_VENDOR]       = "FujiNet Data"
+};
+
+const uint8_t *tud_descriptor_device_cb(void) {
+    return (const uint8_t *) &mac_ndev_usb_device_desc;
+}
+
+const uint8_t *tud_descriptor_configuration_cb(uint8_t index) {
+    (void) index;
+    return mac_ndev_usb_config_desc;
+}
+
+const uint16_t *tud_descriptor_string_cb(uint8_t index, uint16_t langid) {
+    static uint16_t desc[32];
+    char            serial[2 * PICO_UNIQUE_BOARD_ID_SIZE_BYTES + 1];
+    const char     *str;
+    uint8_t         len;
+
+    (void) langid;
+    if (index == MAC_NDEV_STR_LANGID) {
+        desc[1] = 0x0409;   // English
+        len = 1;
+    } else {
+        if (index == MAC_NDEV_STR_SERIAL) {
+            pico_get_unique_board_id_string(serial, sizeof(serial));
+            str = serial;
+        } else if (index < NELEMENTS(mac_ndev_usb_strings) && mac_ndev_usb_strings[index]) {
+            str = mac_ndev_usb_strings[index];
+        } else {
+            return NULL;
+        }
+        for (len = 0; str[len] && len < NELEMENTS(desc) - 1; len++) {
+            desc[1 + len] = str[len];
+        }
+    }
+    desc[0] = (TUSB_DESC_STRING << 8) | (2 * len + 2);
+    return desc;
+}
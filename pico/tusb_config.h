@@ -0,0 +1,38 @@
+/****************************************************************************
+ *   mac68k-fuji-drivers (c) 2024 Marcio Teixeira                           *
+ *                                                                          *
+ *   This program is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU General Public License as published by   *
+ *   the Free Software Foundation, either version 3 of the License, or      *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   This program is distributed in the hope that it will be useful,        *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU General Public License for more details.                           *
+ *                                                                          *
+ *   To view a copy of the GNU General Public License, go to the following  *
+ *   location: <http://www.gnu.org/licenses/>.                              *
+ ****************************************************************************/
+
+/* TinyUSB configuration for MAC_NDEV_USB_VENDOR: one CDC interface for the
+ * stdio messages and one vendor interface for the framed data. Only used
+ * when the firmware links "tinyusb_device" (see "mac_ndev_usb_descriptors.h").
+ */
+
+#pragma once
+
+#define CFG_TUSB_RHPORT0_MODE       OPT_MODE_DEVICE
+#define CFG_TUSB_OS                 OPT_OS_PICO
+
+#define CFG_TUD_ENDPOINT0_SIZE      64
+
+#define CFG_TUD_CDC                 1
+#define CFG_TUD_CDC_RX_BUFSIZE      256
+#define CFG_TUD_CDC_TX_BUFSIZE      256
+
+// Room for two frames each way, so the Mac is never held up by one packet
+#define CFG_TUD_VENDOR              1
+#define CFG_TUD_VENDOR_EPSIZE       64
+#define CFG_TUD_VENDOR_RX_BUFSIZE   1024
+#define CFG_TUD_VENDOR_TX_BUFSIZE   1024